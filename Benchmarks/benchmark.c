@@ -0,0 +1,539 @@
+#if defined __linux__ && !defined _GNU_SOURCE
+#define _GNU_SOURCE
+#endif
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "../GC/GC.h"
+
+#if defined _WIN32
+#include <windows.h>
+#include <psapi.h>
+#else
+#include <sys/resource.h>
+#include <sys/wait.h>
+#include <time.h>
+#include <unistd.h>
+#endif
+
+/* ============================================================================
+*  Allocators
+*  ========================================================================= */
+
+// The allocators a workload can run against, the libc one is the baseline
+typedef enum { ALLOCATOR_MALLOC, ALLOCATOR_GC, ALLOCATOR_GENERATIONAL, ALLOCATOR_CONCURRENT } allocator_t;
+
+static const char* allocator_names[] = { "malloc", "gc", "gc-generational", "gc-concurrent" };
+#define ALLOCATORS_COUNT (sizeof(allocator_names) / sizeof(allocator_names[0]))
+
+// The allocator used by the running workload
+static allocator_t allocator;
+
+// The allocations done by the running workload and their total size
+static size_t allocations = 0;
+static size_t allocated_bytes = 0;
+
+// Allocates a block that can hold pointers
+static void* bench_alloc(size_t size)
+{
+	void* pointer = allocator == ALLOCATOR_MALLOC ? malloc(size) : GC_alloc(size);
+	if (pointer == NULL)
+	{
+		fprintf(stderr, "Out of memory\n");
+		exit(EXIT_FAILURE);
+	}
+	allocations++;
+	allocated_bytes += size;
+	return pointer;
+}
+
+// Allocates a block that never holds pointers
+static void* bench_alloc_atomic(size_t size)
+{
+	void* pointer = allocator == ALLOCATOR_MALLOC ? malloc(size) : GC_alloc_atomic(size);
+	if (pointer == NULL)
+	{
+		fprintf(stderr, "Out of memory\n");
+		exit(EXIT_FAILURE);
+	}
+	allocations++;
+	allocated_bytes += size;
+	return pointer;
+}
+
+// Resizes a block, like realloc
+static void* bench_realloc(void* pointer, size_t size)
+{
+	pointer = allocator == ALLOCATOR_MALLOC ? realloc(pointer, size) : GC_realloc(pointer, size);
+	if (pointer == NULL)
+	{
+		fprintf(stderr, "Out of memory\n");
+		exit(EXIT_FAILURE);
+	}
+	allocations++;
+	allocated_bytes += size;
+	return pointer;
+}
+
+// Releases a block explicitly, the workloads that rely on the collector only call it with malloc
+// and the churn one also calls GC_free to measure it
+static void bench_free(void* pointer)
+{
+	if (allocator == ALLOCATOR_MALLOC) free(pointer);
+	else GC_free(pointer);
+}
+
+// Stores a pointer into an allocated block, through the write barrier when the GC needs it
+static void bench_write(void** slot, void* value)
+{
+	if (allocator == ALLOCATOR_MALLOC) *slot = value;
+	else GC_WRITE(slot, value);
+}
+
+/* ============================================================================
+*  Measurements
+*  ========================================================================= */
+
+// Returns the time of a monotonic clock in nanoseconds
+static uint64_t now()
+{
+#if defined _WIN32
+	static LARGE_INTEGER frequency;
+	LARGE_INTEGER counter;
+	if (frequency.QuadPart == 0) QueryPerformanceFrequency(&frequency);
+	QueryPerformanceCounter(&counter);
+	return (uint64_t)(counter.QuadPart / frequency.QuadPart) * 1000000000ULL +
+		(uint64_t)(counter.QuadPart % frequency.QuadPart) * 1000000000ULL / frequency.QuadPart;
+#else
+	struct timespec time;
+	clock_gettime(CLOCK_MONOTONIC, &time);
+	return (uint64_t)time.tv_sec * 1000000000ULL + (uint64_t)time.tv_nsec;
+#endif
+}
+
+// Returns the peak resident memory of the process, in KB
+static size_t peak_rss()
+{
+#if defined _WIN32
+	PROCESS_MEMORY_COUNTERS counters;
+	if (!GetProcessMemoryInfo(GetCurrentProcess(), &counters, sizeof(counters))) return 0;
+	return counters.PeakWorkingSetSize / 1024;
+#else
+	struct rusage usage;
+	getrusage(RUSAGE_SELF, &usage);
+#if defined(__APPLE__) && defined(__MACH__)
+	return (size_t)usage.ru_maxrss / 1024;
+#else
+	return (size_t)usage.ru_maxrss;
+#endif
+#endif
+}
+
+// The pauses of the collections seen so far, in nanoseconds
+static uint64_t* pauses = NULL;
+static size_t pauses_count = 0;
+static size_t pauses_capacity = 0;
+static size_t seen_collections = 0;
+static uint64_t seen_pause_time = 0;
+
+// Adds a pause to the list
+static void add_pause(uint64_t pause)
+{
+	if (pauses_count == pauses_capacity)
+	{
+		pauses_capacity = pauses_capacity == 0 ? 256 : pauses_capacity * 2;
+		pauses = (uint64_t*)realloc(pauses, pauses_capacity * sizeof(uint64_t));
+		if (pauses == NULL)
+		{
+			fprintf(stderr, "Out of memory\n");
+			exit(EXIT_FAILURE);
+		}
+	}
+	pauses[pauses_count++] = pause;
+}
+
+// Records the collections done since the previous call. The workloads call it after each
+// step of work, the collections done within the same step share their total pause time
+static void poll_pauses()
+{
+	if (allocator == ALLOCATOR_MALLOC) return;
+	struct GC_stats_s stats = GC_get_stats();
+	size_t collections = stats.collections - seen_collections;
+	if (collections == 0) return;
+	uint64_t pause_time = stats.total_pause_time - seen_pause_time;
+	if (collections == 1) add_pause(pause_time);
+	else
+	{
+		size_t i;
+		for (i = 0; i < collections; i++) add_pause(pause_time / collections);
+	}
+	seen_collections = stats.collections;
+	seen_pause_time = stats.total_pause_time;
+}
+
+// Compares two pauses, for qsort
+static int compare_pauses(const void* a, const void* b)
+{
+	uint64_t first = *(const uint64_t*)a, second = *(const uint64_t*)b;
+	return first < second ? -1 : first > second;
+}
+
+// Returns a percentile of the sorted pauses, in milliseconds
+static double pause_percentile(unsigned int percentile)
+{
+	if (pauses_count == 0) return 0.0;
+	return pauses[(pauses_count - 1) * percentile / 100] / 1e6;
+}
+
+/* ============================================================================
+*  Workloads
+*  ========================================================================= */
+
+// A node of the binary trees and of the lists
+typedef struct node_s
+{
+	struct node_s* left;
+	struct node_s* right;
+	long value;
+} node_t;
+
+// Builds a tree from the leaves up, like the bottom-up trees of GCBench
+static node_t* make_tree(int depth)
+{
+	node_t* node = (node_t*)bench_alloc(sizeof(node_t));
+	if (depth > 0)
+	{
+		node_t* left = make_tree(depth - 1);
+		node_t* right = make_tree(depth - 1);
+		bench_write((void**)&node->left, left);
+		bench_write((void**)&node->right, right);
+	}
+	else node->left = node->right = NULL;
+	node->value = depth;
+	return node;
+}
+
+// Fills the children of a node from the root down, like the top-down trees of GCBench
+static void populate(int depth, node_t* node)
+{
+	if (depth <= 0)
+	{
+		node->left = node->right = NULL;
+		return;
+	}
+	bench_write((void**)&node->left, bench_alloc(sizeof(node_t)));
+	bench_write((void**)&node->right, bench_alloc(sizeof(node_t)));
+	populate(depth - 1, node->left);
+	populate(depth - 1, node->right);
+}
+
+// Releases a tree, only needed with malloc
+static void free_tree(node_t* node)
+{
+	if (node == NULL) return;
+	free_tree(node->left);
+	free_tree(node->right);
+	bench_free(node);
+}
+
+// Returns the number of nodes of a tree
+static size_t count_tree(node_t* node)
+{
+	return node == NULL ? 0 : 1 + count_tree(node->left) + count_tree(node->right);
+}
+
+// GCBench: a long lived tree and array stay alive while many short lived trees of
+// growing depth are built from the top down and from the bottom up
+static int binary_trees()
+{
+	const int long_lived_depth = 16, max_depth = 16, array_size = 500000;
+
+	// The stretch tree makes the heap grow before the long lived data is built
+	node_t* stretch = make_tree(max_depth + 1);
+	if (allocator == ALLOCATOR_MALLOC) free_tree(stretch);
+	stretch = NULL;
+	poll_pauses();
+
+	node_t* long_lived = (node_t*)bench_alloc(sizeof(node_t));
+	populate(long_lived_depth, long_lived);
+	double* array = (double*)bench_alloc_atomic(array_size * sizeof(double));
+	int i;
+	for (i = 0; i < array_size / 2; i++) array[i] = 1.0 / i;
+	poll_pauses();
+
+	int depth;
+	for (depth = 4; depth <= max_depth; depth += 2)
+	{
+		int iterations = 1 << (max_depth - depth + 4);
+		for (i = 0; i < iterations; i++)
+		{
+			node_t* temp = (node_t*)bench_alloc(sizeof(node_t));
+			populate(depth, temp);
+			if (allocator == ALLOCATOR_MALLOC) free_tree(temp);
+			temp = make_tree(depth);
+			if (allocator == ALLOCATOR_MALLOC) free_tree(temp);
+			poll_pauses();
+		}
+	}
+
+	// The long lived data must have survived all the collections
+	int valid = count_tree(long_lived) == (2u << long_lived_depth) - 1 && array[1000] == 1.0 / 1000;
+	if (allocator == ALLOCATOR_MALLOC)
+	{
+		free_tree(long_lived);
+		bench_free(array);
+	}
+	return valid;
+}
+
+// Builds a long list that stays alive while garbage is allocated next to each node, so
+// that the collections have to follow a chain of millions of pointers
+static int linked_list()
+{
+	const long length = 4000000;
+	node_t* head = NULL;
+	long i;
+	for (i = 0; i < length; i++)
+	{
+		node_t* node = (node_t*)bench_alloc(sizeof(node_t));
+		bench_write((void**)&node->left, head);
+		node->right = NULL;
+		node->value = i;
+		head = node;
+		void* garbage = bench_alloc(48);
+		memset(garbage, 0, 48);
+		if (allocator == ALLOCATOR_MALLOC) bench_free(garbage);
+		if ((i & 4095) == 0) poll_pauses();
+	}
+
+	// Walk the list to check that no node was lost
+	long count = 0, expected = length - 1;
+	int valid = 1;
+	node_t* node;
+	for (node = head; node != NULL; node = node->left)
+	{
+		if (node->value != expected--) valid = 0;
+		count++;
+	}
+	if (allocator == ALLOCATOR_MALLOC)
+	{
+		while (head != NULL)
+		{
+			node = head->left;
+			bench_free(head);
+			head = node;
+		}
+	}
+	return valid && count == length;
+}
+
+// Returns a pseudo random number, xorshift64
+static uint64_t next_random(uint64_t* state)
+{
+	uint64_t x = *state;
+	x ^= x << 13;
+	x ^= x >> 7;
+	x ^= x << 17;
+	return *state = x;
+}
+
+// Random allocations, explicit frees and reallocations over a table of live blocks,
+// most of the sizes are small and a few ones go over the small size classes
+static int churn()
+{
+	const size_t slots = 4096, operations = 20000000;
+	void** table = (void**)bench_alloc(slots * sizeof(void*));
+	memset(table, 0, slots * sizeof(void*));
+	uint64_t state = 0x9E3779B97F4A7C15ULL;
+	size_t i;
+	for (i = 0; i < operations; i++)
+	{
+		uint64_t random = next_random(&state);
+		size_t slot = (size_t)(random % slots);
+		size_t size = (random >> 32) % 63 == 0 ? 512 + (size_t)((random >> 40) % 65536) : 8 + (size_t)((random >> 40) % 504);
+		if (table[slot] == NULL)
+		{
+			bench_write(&table[slot], bench_alloc(size));
+			*(size_t*)table[slot] = slot;
+		}
+		else if ((random >> 16) & 1)
+		{
+			bench_free(table[slot]);
+			table[slot] = NULL;
+		}
+		else
+		{
+			bench_write(&table[slot], bench_realloc(table[slot], size));
+		}
+		if ((i & 4095) == 0) poll_pauses();
+	}
+
+	// Each block must still start with the index of its slot
+	int valid = 1;
+	for (i = 0; i < slots; i++)
+	{
+		if (table[i] == NULL) continue;
+		if (*(size_t*)table[i] != i) valid = 0;
+		bench_free(table[i]);
+	}
+	bench_free(table);
+	return valid;
+}
+
+// Builds a large random graph and then collects it repeatedly, so the pauses are
+// dominated by the marking of a heap that is all alive
+static int large_heap()
+{
+	const size_t nodes = 8 * 1024 * 1024, collections = 10;
+	node_t** all = (node_t**)bench_alloc(nodes * sizeof(node_t*));
+	uint64_t state = 0x2545F4914F6CDD1DULL;
+	size_t i;
+	for (i = 0; i < nodes; i++)
+	{
+		node_t* node = (node_t*)bench_alloc(sizeof(node_t));
+		node->value = (long)i;
+		bench_write((void**)&node->left, i > 0 ? all[next_random(&state) % i] : NULL);
+		bench_write((void**)&node->right, i > 0 ? all[next_random(&state) % i] : NULL);
+		bench_write((void**)&all[i], node);
+		if ((i & 4095) == 0) poll_pauses();
+	}
+	if (allocator != ALLOCATOR_MALLOC)
+	{
+		for (i = 0; i < collections; i++)
+		{
+			GC_collect();
+			poll_pauses();
+		}
+	}
+
+	int valid = 1;
+	for (i = 0; i < nodes; i++)
+	{
+		if (all[i]->value != (long)i) valid = 0;
+	}
+	if (allocator == ALLOCATOR_MALLOC)
+	{
+		for (i = 0; i < nodes; i++) bench_free(all[i]);
+		bench_free(all);
+	}
+	return valid;
+}
+
+// The available workloads
+typedef struct
+{
+	const char* name;
+	int (*run)();
+} workload_t;
+
+static const workload_t workloads[] =
+{
+	{ "binary-trees", binary_trees },
+	{ "linked-list", linked_list },
+	{ "churn", churn },
+	{ "large-heap", large_heap }
+};
+#define WORKLOADS_COUNT (sizeof(workloads) / sizeof(workloads[0]))
+
+/* ============================================================================
+*  Driver
+*  ========================================================================= */
+
+// Runs a workload with an allocator and prints its results on a single line
+static int run_workload(const workload_t* workload, allocator_t selected)
+{
+	static int initialized = 0;
+	allocator = selected;
+	allocations = allocated_bytes = 0;
+	pauses_count = 0;
+	if (allocator != ALLOCATOR_MALLOC)
+	{
+		// The runs share the process on Windows, so the modes of the previous one are reset
+		if (!initialized) GC_init();
+		initialized = 1;
+		GC_set_concurrent(FALSE);
+		GC_set_generational(FALSE);
+		struct GC_stats_s stats = GC_get_stats();
+		seen_collections = stats.collections;
+		seen_pause_time = stats.total_pause_time;
+		if ((allocator == ALLOCATOR_GENERATIONAL && !GC_set_generational(TRUE)) ||
+			(allocator == ALLOCATOR_CONCURRENT && !GC_set_concurrent(TRUE)))
+		{
+			printf("%-14s %-16s not available\n", workload->name, allocator_names[allocator]);
+			return EXIT_SUCCESS;
+		}
+	}
+
+	uint64_t start = now();
+	int valid = workload->run();
+	double seconds = (now() - start) / 1e9;
+	poll_pauses();
+	qsort(pauses, pauses_count, sizeof(uint64_t), compare_pauses);
+	printf("%-14s %-16s %8.3f %10.2f %9.1f %7zu %8.2f %8.2f %8.2f %8.2f %9.1f%s\n",
+		workload->name, allocator_names[allocator], seconds,
+		allocations / seconds / 1e6, allocated_bytes / seconds / (1024.0 * 1024.0),
+		pauses_count, pause_percentile(50), pause_percentile(90), pause_percentile(99), pause_percentile(100),
+		peak_rss() / 1024.0, valid ? "" : "  INVALID");
+	fflush(stdout);
+	return valid ? EXIT_SUCCESS : EXIT_FAILURE;
+}
+
+// Runs a workload in its own process when possible, so that the peak memory of a run
+// doesn't include the ones that came before it
+static int run_isolated(const workload_t* workload, allocator_t selected)
+{
+#if defined _WIN32
+	return run_workload(workload, selected);
+#else
+	fflush(stdout);
+	pid_t child = fork();
+	if (child < 0) return run_workload(workload, selected);
+	if (child == 0) exit(run_workload(workload, selected));
+	int status;
+	if (waitpid(child, &status, 0) < 0 || !WIFEXITED(status))
+	{
+		printf("%-14s %-16s crashed\n", workload->name, allocator_names[selected]);
+		return EXIT_FAILURE;
+	}
+	return WEXITSTATUS(status);
+#endif
+}
+
+// Prints the command line options
+static void print_usage(const char* program)
+{
+	size_t i;
+	printf("Usage: %s [workload|all] [allocator|all]\nWorkloads:", program);
+	for (i = 0; i < WORKLOADS_COUNT; i++) printf(" %s", workloads[i].name);
+	printf("\nAllocators:");
+	for (i = 0; i < ALLOCATORS_COUNT; i++) printf(" %s", allocator_names[i]);
+	printf("\n");
+}
+
+int main(int argc, char** argv)
+{
+	const char* workload_name = argc > 1 ? argv[1] : "all";
+	const char* allocator_name = argc > 2 ? argv[2] : "all";
+	size_t w, a, runs = 0;
+	int result = EXIT_SUCCESS;
+
+	printf("%-14s %-16s %8s %10s %9s %7s %8s %8s %8s %8s %9s\n", "workload", "allocator", "time(s)",
+		"Mops/s", "MB/s", "pauses", "p50(ms)", "p90(ms)", "p99(ms)", "max(ms)", "peak(MB)");
+	for (w = 0; w < WORKLOADS_COUNT; w++)
+	{
+		if (strcmp(workload_name, "all") != 0 && strcmp(workload_name, workloads[w].name) != 0) continue;
+		for (a = 0; a < ALLOCATORS_COUNT; a++)
+		{
+			if (strcmp(allocator_name, "all") != 0 && strcmp(allocator_name, allocator_names[a]) != 0) continue;
+			if (run_isolated(workloads + w, (allocator_t)a) != EXIT_SUCCESS) result = EXIT_FAILURE;
+			runs++;
+		}
+	}
+	if (runs == 0)
+	{
+		print_usage(argv[0]);
+		return EXIT_FAILURE;
+	}
+	return result;
+}
@@ -1,33 +1,54 @@
 ﻿// Default libraries
+#include <setjmp.h>
+#include <string.h>
 #include "../Misc/GC_definitions.h"
+#include "../Misc/GC_threads.h"
+#include "../Misc/GC_atomic.h"
 #include "../HashMap/hash_map_t.h"
 #include "MemoryHelper/memory_helper.h"
-#include "SharedCode\GC_shared.h"
-
-// On Unix-like OSes, switch to a multithread GC
-#if !defined(_WIN32) && (defined(__unix__) || defined(__unix) || (defined(__APPLE__) && defined(__MACH__)))
-#include <pthread.h>
-#include<unistd.h>
-#define POSIX_THREADS
-#elif defined _WIN32
-#include <windows.h>
-#define WIN_THREADS
-#endif
+#include "Heap/heap.h"
+#include "Heap/page_map.h"
+#include "Heap/blacklist.h"
+#include "Mark/marker.h"
+#include "Mark/write_barrier.h"
+#include "Mark/root_set.h"
+#include "Mark/type_descriptor.h"
+#include "Heap/thread_cache.h"
+#include "Threads/thread_registry.h"
+#include "GC.h"
 
 /* =========== Global variables and local functions =========== */
 
 // Global shared variables
 bool_t initialized = FALSE;
-void* stack_bottom;
 hash_map_t allocation_map;
 
+// The large blocks allocated and released while the background thread reads the hash map,
+// they are moved into it or removed from it by the final pause of the marking
+hash_map_t marking_allocations;
+hash_map_t deferred_frees;
+
+// Number of pages swept by the background sweeper each time it takes the lock
+#define SWEEP_BATCH_PAGES 16
+
+// Large blocks take whole granules, so that the page map can resolve their addresses
+#define ROUND_TO_GRANULE(size) (((size) + PAGE_MAP_GRANULE - 1) & ~(PAGE_MAP_GRANULE - 1))
+
+// The large blocks of at least this size get their own mapping from the OS, like the libc allocator
+// does past its own threshold: it is released as soon as they are freed and it grows without copies
+#define LARGE_MAPPING_THRESHOLD ((size_t)128 << 10)
+#define IS_MAPPED(size) (ROUND_TO_GRANULE(size) >= LARGE_MAPPING_THRESHOLD)
+
+// Number of mappings tried for a large block before one reached by a false pointer is accepted
+#define LARGE_MAPPING_ATTEMPTS 4
+
 // OS-specific global variables
 #if defined POSIX_THREADS
 
 // UNIX global mutex and macros
 pthread_mutex_t shared_lock;
 #define GET_LOCK pthread_mutex_lock(&shared_lock);
-#define RELEASE_LOCK pthread_muted_unlock(&shared_lock);
+#define RELEASE_LOCK pthread_mutex_unlock(&shared_lock);
 #elif defined WIN_THREADS
 
 // WIN32 global mutex and helper functions
@@ -55,12 +76,270 @@ static inline void try_release_mutex(HANDLE mutex)
 // WIN32 macros
 #define GET_LOCK try_get_mutex(shared_lock)
 #define RELEASE_LOCK try_release_mutex(shared_lock)
+#else
+
+// Single-threaded builds don't need any synchronization
+#define GET_LOCK
+#define RELEASE_LOCK
 #endif
 
+// The background thread, it finishes the sweep left by each collection while the program runs
+// and it marks the heap when the concurrent collections are enabled
+#if defined POSIX_THREADS || defined WIN_THREADS
+gc_mutex_t sweeper_lock;
+gc_cond_t sweeper_wakeup;
+gc_cond_t marking_done;
+bool_t sweep_requested = FALSE;
+bool_t mark_requested = FALSE;
+#endif
+
+// The collector thread, it runs the stop-the-world collections: the queue of the threads waiting
+// for one and whether a collection was requested without waiting for it
+#if defined POSIX_THREADS || defined WIN_THREADS
+gc_mutex_t collector_lock;
+gc_cond_t collector_wakeup;
+gc_cond_t collection_finished;
+struct collect_request_s* collect_requests = NULL;
+bool_t async_requested = FALSE;
+#endif
+
+// The number of the last collection started and of the last one completed, that are the tickets
+// returned by GC_collect_async, and the function called when each collection completes
+uint64_t collections_started = 0;
+uint64_t collections_completed = 0;
+GC_collection_callback_t collection_callback = NULL;
+
+// Indicates whether the large blocks still have to be swept after the last collection
+bool_t large_sweep_pending = FALSE;
+
+// The phases of a concurrent collection
+#define MARKING_IDLE 0
+#define MARKING_CONCURRENT 1
+#define MARKING_DONE 2
+
+// The state of the concurrent collections, the roots given to the background thread
+// and whether its mark stacks overflowed
+bool_t concurrent_enabled = FALSE;
+uintptr_t marking_state = MARKING_IDLE;
+root_range_t concurrent_roots;
+bool_t concurrent_overflow = FALSE;
+
+// Number of minor collections between two full ones in generational mode
+#define MINOR_COLLECTIONS_PER_MAJOR 8
+
+// The generational collections, the minor ones done since the last full collection and
+// whether the heap holds young blocks, that are allocated unmarked
+bool_t generational_enabled = FALSE;
+unsigned int minor_collections = 0;
+bool_t young_blocks = FALSE;
+
+// Whether the full collections move the blocks of the sparse pages that weren't pinned
+bool_t compaction_enabled = FALSE;
+
+// Whether only the roots on the shadow stacks are scanned, instead of the whole stacks
+bool_t precise_roots = FALSE;
+
+// Whether the addresses inside the blocks keep them alive, a false pointer anywhere in a large block retains it
+bool_t interior_pointers = FALSE;
+
+// The data segments and the manual roots, gathered before each collection stops the threads
+root_range_t* static_roots = NULL;
+int static_roots_count = 0;
+
+// Smallest allocation budget between two paced collections, so that small heaps aren't collected all the time
+#define MIN_COLLECTION_BUDGET ((size_t)4 << 20)
+
+// Smallest budget left by the memory limit, when the live memory is already close to it
+#define MIN_LIMIT_BUDGET ((size_t)1 << 20)
+
+// The collection pacing: the growth allowed over the live memory in percent, negative to only
+// use the limit, the soft memory limit, 0 if there is none, the live memory measured by the
+// last marking and the bytes allocated since then, and whether the budget was used up
+int heap_growth = 100;
+size_t memory_limit = 0;
+size_t live_bytes = 0;
+size_t collection_budget = MIN_COLLECTION_BUDGET;
+size_t heap_bytes_at_cycle = 0;
+size_t large_bytes_since_cycle = 0;
+uintptr_t collection_due = FALSE;
+
+// Default time an empty heap page stays resident, so that a heap that shrinks and grows back doesn't thrash
+#define DEFAULT_PAGE_DECAY 1000
+
+// The time in milliseconds before the empty pages are returned to the OS, negative to only return
+// them in GC_trim, and the time when the oldest resident empty page decays, 0 if there are none
+int page_decay = DEFAULT_PAGE_DECAY;
+uint64_t page_decay_deadline = 0;
+
+// The statistics of the collections, the large blocks counters and the cumulative counters read
+// at the start of the last cycle, to compute the ones of the cycle. The time spent by the
+// background thread marking the heap is handed to the final pause of the concurrent cycle
+struct GC_stats_s stats;
+size_t large_allocated_bytes = 0;
+size_t large_freed_bytes = 0;
+size_t large_freed_blocks = 0;
+uint64_t large_sweep_time = 0;
+struct heap_counters_s cycle_heap_counters;
+size_t cycle_large_freed_bytes = 0;
+size_t cycle_large_freed_blocks = 0;
+uint64_t cycle_large_sweep_time = 0;
+uint64_t concurrent_mark_time = 0;
+
+// The marker settings can't change while the background thread uses them
+#define FINISH_MARKING if (marking_state != MARKING_IDLE) finish_concurrent_cycle()
+
 /* ============================================================================
 *  Init and allocation functions
 *  ========================================================================= */
 
+// Private functions prototypes
+struct root_report_s;
+static void large_free(void* pointer, size_t size);
+static void finish_concurrent_cycle();
+static void start_collection(bool_t paced, bool_t full, struct root_report_s* report);
+#if defined POSIX_THREADS || defined WIN_THREADS
+static bool_t start_collector();
+#endif
+static void compute_collection_budget();
+
+// Releases a large block that wasn't reached by the last marking
+static void sweep_large_block(void* pointer, size_t size)
+{
+	large_freed_bytes += size;
+	large_freed_blocks++;
+	large_free(pointer, size);
+}
+
+// Releases the large blocks that weren't reached, if the last marking wasn't a minor one
+static void sweep_large_blocks()
+{
+	if (!large_sweep_pending) return;
+	uint64_t start = get_nanoseconds();
+	deallocate_lost_references(allocation_map, sweep_large_block);
+	large_sweep_pending = FALSE;
+	large_sweep_time += get_nanoseconds() - start;
+}
+
+// Returns the empty pages that stayed unused for the decay time to the OS and schedules the next
+// release, the lock must be held
+static void decommit_decayed_pages()
+{
+	uint64_t deadline = 0;
+	if (page_decay >= 0)
+	{
+		uint64_t now = get_nanoseconds(), decay = (uint64_t)page_decay * 1000000;
+		uint64_t oldest = heap_decommit_empty_pages(now > decay ? now - decay : 0);
+		if (oldest != 0) deadline = oldest + decay;
+	}
+	ATOMIC_STORE(&page_decay_deadline, deadline);
+}
+
+// Sweeps the large blocks and the heap pages that weren't swept yet
+static void finish_sweep()
+{
+	heap_finish_sweep();
+	sweep_large_blocks();
+	decommit_decayed_pages();
+}
+
+#if defined POSIX_THREADS || defined WIN_THREADS
+
+// Wakes up the background thread to sweep the heap
+static void request_sweep()
+{
+	MUTEX_LOCK(sweeper_lock);
+	sweep_requested = TRUE;
+	COND_BROADCAST(sweeper_wakeup);
+	MUTEX_UNLOCK(sweeper_lock);
+}
+
+// Waits for each collection, then sweeps a batch of pages at a time so that the lock is never held for long.
+// While the thread is idle it also wakes up to return the empty pages to the OS when they decay
+static void run_sweeper()
+{
+	for (;;)
+	{
+		MUTEX_LOCK(sweeper_lock);
+		while (!sweep_requested && !mark_requested)
+		{
+			uint64_t deadline = ATOMIC_LOAD(&page_decay_deadline), now = get_nanoseconds();
+			if (deadline == 0) COND_WAIT(sweeper_wakeup, sweeper_lock);
+			else if (now < deadline) COND_TIMED_WAIT(sweeper_wakeup, sweeper_lock, (unsigned long)((deadline - now) / 1000000 + 1));
+			else
+			{
+				// The lock of the GC is always taken before this one
+				MUTEX_UNLOCK(sweeper_lock);
+				GET_LOCK;
+				decommit_decayed_pages();
+				RELEASE_LOCK;
+				MUTEX_LOCK(sweeper_lock);
+			}
+		}
+
+		// Concurrent marking, the program keeps running and the lock isn't needed
+		if (mark_requested)
+		{
+			mark_requested = FALSE;
+			MUTEX_UNLOCK(sweeper_lock);
+			uint64_t start = get_nanoseconds();
+			bool_t overflowed = mark_from_roots_concurrently(&concurrent_roots, 1);
+			uint64_t elapsed = get_nanoseconds() - start;
+			MUTEX_LOCK(sweeper_lock);
+			concurrent_overflow = overflowed;
+			concurrent_mark_time = elapsed;
+			ATOMIC_STORE(&marking_state, MARKING_DONE);
+			COND_BROADCAST(marking_done);
+			MUTEX_UNLOCK(sweeper_lock);
+			continue;
+		}
+		sweep_requested = FALSE;
+		MUTEX_UNLOCK(sweeper_lock);
+
+		bool_t pending = TRUE;
+		while (pending)
+		{
+			GET_LOCK;
+			sweep_large_blocks();
+			pending = heap_sweep_step(SWEEP_BATCH_PAGES);
+			if (!pending) decommit_decayed_pages();
+			RELEASE_LOCK;
+		}
+	}
+}
+
+// Entry point of the sweeper thread
+#if defined WIN_THREADS
+static DWORD WINAPI sweeper_thread(LPVOID lparam)
+{
+	(void)lparam;
+	run_sweeper();
+	return 0;
+}
+#else
+static void* sweeper_thread(void* lparam)
+{
+	(void)lparam;
+	run_sweeper();
+	return NULL;
+}
+#endif
+
+// Starts the sweeper thread, it lives as long as the process
+static bool_t start_sweeper()
+{
+#if defined WIN_THREADS
+	HANDLE thread = CreateThread(NULL, 0, sweeper_thread, NULL, 0, NULL);
+	if (thread == NULL) return FALSE;
+	CloseHandle(thread);
+#else
+	pthread_t thread;
+	if (pthread_create(&thread, NULL, sweeper_thread, NULL) != 0) return FALSE;
+	pthread_detach(thread);
+#endif
+	return TRUE;
+}
+#endif
+
 // Initializes the GarbageCollector
 void GC_init()
 {
@@ -70,17 +349,29 @@ void GC_init()
 		ERROR_HELPER("The GarbageCollector can't be initialized twice");
 	}
 
-	// Saves the stack pointer, it will be used during the sweep process
-	stack_bottom = get_stack_pointer();
-
-	// Allocate the hashmap to hold the references to the allocated memory
+	// Allocate the hashmap to hold the references to the large memory blocks
 	allocation_map = hash_map_init();
+	marking_allocations = hash_map_init();
+	deferred_frees = hash_map_init();
+	if (allocation_map == NULL || marking_allocations == NULL || deferred_frees == NULL || !marker_init(allocation_map) || !page_map_init() || !barrier_init())
+	{
+		ERROR_HELPER("Error allocating the GC data structures");
+	}
+
+	// The calling thread is registered, its stack base is saved so that the frames of the callers are scanned as well
+	if (!registry_init() || registry_add() == NULL)
+	{
+		ERROR_HELPER("Error registering the main thread");
+	}
+
+	// Prepare the size classes used for all the other blocks
+	heap_init();
 
 	// Mutex initialization
 #if defined POSIX_THREADS
 	if (pthread_mutex_init(&shared_lock, NULL) != 0)
 #elif defined WIN_THREADS
-	if (CreateMutex(NULL, FALSE, NULL) == NULL)
+	if ((shared_lock = CreateMutex(NULL, FALSE, NULL)) == NULL)
 #endif
 #if defined POSIX_THREADS || defined WIN_THREADS
 	{
@@ -88,66 +379,501 @@ void GC_init()
 	};
 #endif
 
+	// Start the background sweeper, it waits for the first collection
+#if defined POSIX_THREADS || defined WIN_THREADS
+	if (!MUTEX_INIT(sweeper_lock) || !COND_INIT(sweeper_wakeup) || !COND_INIT(marking_done) || !start_sweeper())
+	{
+		ERROR_HELPER("Error creating the sweeper thread");
+	}
+
+	// The collector thread is created once as well, so the collections never need a new thread
+	if (!MUTEX_INIT(collector_lock) || !COND_INIT(collector_wakeup) || !COND_INIT(collection_finished) || !start_collector())
+	{
+		ERROR_HELPER("Error creating the collector thread");
+	}
+#endif
+
+	// The soft memory limit defaults to the one of the container, if there is one
+	memory_limit = get_memory_limit();
+	compute_collection_budget();
+
 	// Makes sure this function can only be called once
 	initialized = TRUE;
 }
 
-// Wraps the malloc function
-void* GC_alloc(size_t size)
+/* ============================================================================
+*  Collection pacing
+*  ========================================================================= */
+
+// Computes how many bytes can be allocated before the next collection
+static void compute_collection_budget()
+{
+	size_t budget = SIZE_MAX;
+	if (heap_growth >= 0)
+	{
+		budget = live_bytes / 100 * (size_t)heap_growth;
+		if (budget < MIN_COLLECTION_BUDGET) budget = MIN_COLLECTION_BUDGET;
+	}
+
+	// Near the limit the collections get more frequent, but they never run back to back
+	if (memory_limit != 0)
+	{
+		size_t headroom = memory_limit > live_bytes ? memory_limit - live_bytes : 0;
+		if (headroom < MIN_LIMIT_BUDGET) headroom = MIN_LIMIT_BUDGET;
+		if (headroom < budget) budget = headroom;
+	}
+	collection_budget = budget;
+}
+
+// Sets the flag read by the allocations when the budget is used up, the lock must be held.
+// The concurrent cycles are left running until they are done
+static void check_collection_budget()
 {
+	struct heap_counters_s counters;
+	heap_get_counters(&counters);
+	size_t allocated = counters.allocated_bytes - heap_bytes_at_cycle + large_bytes_since_cycle;
+	if (allocated >= collection_budget && marking_state == MARKING_IDLE) ATOMIC_STORE(&collection_due, TRUE);
+}
+
+// Adds the size of a valid large block to the live memory
+static void count_live_block(void* pointer, size_t size)
+{
+	(void)pointer;
+	live_bytes += size;
+	stats.live_blocks++;
+}
+
+// Measures the live memory after a marking and starts counting the allocations again. A minor
+// collection doesn't release the old blocks that died since the last full one, so the budget
+// keeps the live memory measured by the last full marking
+static void reset_collection_budget(bool_t full)
+{
+	struct heap_counters_s counters;
+	size_t full_live_bytes = live_bytes;
+	live_bytes = heap_marked_bytes(&stats.live_blocks);
+	visit_valid_entries(allocation_map, count_live_block);
+	stats.live_bytes = live_bytes;
+	if (!full) live_bytes = full_live_bytes;
+	heap_get_counters(&counters);
+	heap_bytes_at_cycle = counters.allocated_bytes;
+	large_bytes_since_cycle = 0;
+	compute_collection_budget();
+	ATOMIC_STORE(&collection_due, FALSE);
+}
+
+// Runs a full collection and its sweep after an allocation failed, so that it can be retried.
+// Returns FALSE if the calling thread can't collect
+static bool_t reclaim_memory()
+{
+	if (registry_current() == NULL) return FALSE;
+	start_collection(FALSE, TRUE, NULL);
 	GET_LOCK;
+	finish_sweep();
+	RELEASE_LOCK;
+	return TRUE;
+}
 
-	// Calls the standard malloc function to allocate memory
-	void* pointer = malloc(size);
+/* ============================================================================
+*  Allocation functions
+*  ========================================================================= */
 
-	// Stores the reference and the amount of allocated memory
-	if (!insert_key(allocation_map, pointer, size))
+// Returns the page map entry of a large block, the tag tells the marker whether to scan it
+static uintptr_t large_owner(void* pointer, unsigned int kind)
+{
+	uintptr_t owner = (uintptr_t)pointer | PAGE_MAP_LARGE_BLOCK;
+	if (kind == HEAP_POINTER_FREE) owner |= PAGE_MAP_POINTER_FREE;
+	else if (kind == HEAP_TYPED) owner |= PAGE_MAP_TYPED;
+	return owner;
+}
+
+// Returns the memory of a large block to the OS or to the libc allocator
+static void release_large_memory(void* pointer, size_t size)
+{
+	if (IS_MAPPED(size)) release_pages(pointer, ROUND_TO_GRANULE(size));
+	else aligned_block_free(pointer);
+}
+
+// Maps the memory of a large block, avoiding the addresses that the last markings found in false
+// pointers. The rejected mappings are only released at the end, or the OS would return them again
+static void* map_large_memory(size_t reserved)
+{
+	void* rejected[LARGE_MAPPING_ATTEMPTS];
+	int count = 0;
+	void* pointer = reserve_aligned_pages(reserved, PAGE_MAP_GRANULE);
+	while (pointer != NULL && count < LARGE_MAPPING_ATTEMPTS - 1 &&
+		blacklist_contains(pointer, interior_pointers ? reserved : 1))
+	{
+		rejected[count++] = pointer;
+		pointer = reserve_aligned_pages(reserved, PAGE_MAP_GRANULE);
+	}
+	if (pointer == NULL && count > 0) pointer = rejected[--count];
+	while (count > 0) release_pages(rejected[--count], reserved);
+	return pointer;
+}
+
+// Allocates a block bigger than the size classes and stores it into the hash map. During a concurrent
+// marking it goes into a separate one, the marker doesn't see it so it survives the cycle
+static void* large_alloc(size_t size, unsigned int kind)
+{
+	size_t reserved = ROUND_TO_GRANULE(size);
+	void* pointer = IS_MAPPED(size) ? map_large_memory(reserved) : aligned_block_alloc(reserved, PAGE_MAP_GRANULE);
+	if (pointer == NULL) return NULL;
+	hash_map_t map = marking_state != MARKING_IDLE ? marking_allocations : allocation_map;
+	if (!insert_key(map, pointer, size))
 	{
 		ERROR_HELPER("Error inserting a new entry into the hashmap");
 	}
 
+	// All the granules of the block resolve to its first address
+	if (!page_map_set(pointer, reserved, large_owner(pointer, kind)))
+	{
+		// Some granules may already point to the block
+		page_map_set(pointer, reserved, 0);
+		remove_key(map, pointer);
+		release_large_memory(pointer, size);
+		return NULL;
+	}
+	large_bytes_since_cycle += size;
+	large_allocated_bytes += size;
+	return pointer;
+}
+
+// Releases a large block, it must have already been removed from the hash map
+static void large_free(void* pointer, size_t size)
+{
+	page_map_set(pointer, ROUND_TO_GRANULE(size), 0);
+	release_large_memory(pointer, size);
+}
+
+// Notifies the write barrier of a copy into a block, the copied pointers must be scanned. The
+// first card is recorded at the block itself, as its first address may belong to another block
+static void record_writes(void* pointer, size_t size)
+{
+	uintptr_t slot = (uintptr_t)pointer;
+	for (; slot < (uintptr_t)pointer + size; slot = (slot & ~(uintptr_t)(PAGE_MAP_GRANULE - 1)) + PAGE_MAP_GRANULE)
+	{
+		barrier_record((void*)slot);
+	}
+}
+
+// Resizes a large block of the given hash map: the blocks that keep their granules and the shrinking ones stay where they are,
+// the mapped ones are resized by the OS, which moves their pages if it can't grow them in place.
+// Returns NULL if the OS can't resize it, the block is left untouched in that case
+static void* large_resize(hash_map_t map, void* pointer, size_t old_size, size_t new_size, unsigned int kind)
+{
+	size_t old_reserved = ROUND_TO_GRANULE(old_size), new_reserved = ROUND_TO_GRANULE(new_size);
+	size_t extra = kind == HEAP_TYPED ? sizeof(type_descriptor_t) : 0;
+	type_descriptor_t descriptor = kind == HEAP_TYPED ? *DESCRIPTOR_SLOT(pointer, old_size) : NULL;
+	void* new_pointer = new_reserved == old_reserved || !IS_MAPPED(old_size) ? pointer : resize_pages(pointer, old_reserved, new_reserved);
+	if (new_pointer == NULL) return NULL;
+	if (new_pointer == pointer)
+	{
+		// Only the granules past the shorter end change, the entry keeps its slot in the hash map
+		bool_t updated = new_reserved >= old_reserved ||
+			page_map_set((char*)pointer + new_reserved, old_reserved - new_reserved, 0);
+		if (new_reserved > old_reserved)
+		{
+			updated = page_map_set((char*)pointer + old_reserved, new_reserved - old_reserved, large_owner(pointer, kind));
+		}
+		if (!updated || !update_key(map, pointer, new_size))
+		{
+			ERROR_HELPER("Error updating the entry of a resized block");
+		}
+	}
+	else
+	{
+		page_map_set(pointer, old_reserved, 0);
+		if (!page_map_set(new_pointer, new_reserved, large_owner(new_pointer, kind)) ||
+			!replace_key(map, pointer, new_pointer, new_size))
+		{
+			ERROR_HELPER("Error updating the entry of a resized block");
+		}
+	}
+
+	// The new pages are zeroed, but the old descriptor and the bytes left in the last page by
+	// a previous shrink are not, and they must not keep stale blocks alive
+	size_t kept = old_size - extra;
+	if (kept < new_size) memset((char*)new_pointer + kept, 0, (old_reserved < new_size ? old_reserved : new_size) - kept);
+	if (kind == HEAP_TYPED) *DESCRIPTOR_SLOT(new_pointer, new_size) = descriptor;
+	if (kind != HEAP_POINTER_FREE && new_pointer != pointer) record_writes(new_pointer, kept < new_size ? kept : new_size);
+	if (new_size > old_size)
+	{
+		large_bytes_since_cycle += new_size - old_size;
+		large_allocated_bytes += new_size - old_size;
+	}
+	return new_pointer;
+}
+
+// Allocates a block from the size-class pages, the registered threads take it from their cache
+// without the lock and only lock the heap to refill it
+static void* small_alloc(size_t size, unsigned int kind)
+{
+	gc_thread_t self = registry_current();
+	void* pointer = self == NULL ? NULL : thread_cache_alloc(registry_cache(self), size, kind);
+	if (pointer != NULL) return pointer;
+
+	// The refills start the collections that are due, the threads that aren't registered can't
+	if (self != NULL && ATOMIC_LOAD(&collection_due)) start_collection(TRUE, FALSE, NULL);
+	GET_LOCK;
+
+	// The allocations are the safepoints where a concurrent marking is completed
+	if (ATOMIC_LOAD(&marking_state) == MARKING_DONE) FINISH_MARKING;
+	pointer = self == NULL ? heap_alloc(size, kind) : thread_cache_refill(registry_cache(self), size, kind);
+	check_collection_budget();
+
 	RELEASE_LOCK;
 	return pointer;
 }
 
-// Wraps the calloc function
-void* GC_calloc(size_t nitems, size_t size)
+// Allocates a block of any kind, without retrying if the memory isn't available
+static void* try_allocate(size_t size, unsigned int kind)
 {
+	if (size <= HEAP_MAX_SMALL_SIZE) return small_alloc(size, kind);
+
+	// The other blocks come from the standard malloc
+	if (registry_current() != NULL && ATOMIC_LOAD(&collection_due)) start_collection(TRUE, FALSE, NULL);
 	GET_LOCK;
+	if (ATOMIC_LOAD(&marking_state) == MARKING_DONE) FINISH_MARKING;
+	void* pointer = large_alloc(size, kind);
+	check_collection_budget();
+	RELEASE_LOCK;
+	return pointer;
+}
+
+// Allocates a block of any kind, a failed allocation is retried once after a full collection
+static void* allocate(size_t size, unsigned int kind)
+{
+	void* pointer = try_allocate(size, kind);
+	if (pointer == NULL && reclaim_memory()) pointer = try_allocate(size, kind);
+	return pointer;
+}
+
+// Allocates a zeroed array of either kind
+static void* allocate_zeroed(size_t nitems, size_t size, unsigned int kind)
+{
+	// Check for overflows in the total size
+	size_t total = nitems * size;
+	if (size != 0 && total / size != nitems) return NULL;
+
+	// Recycled blocks still hold their previous content
+	void* pointer = allocate(total, kind);
+	if (pointer != NULL) memset(pointer, 0, total);
+	return pointer;
+}
 
-	// Calls the standard calloc function to allocate memory
-	void* pointer = calloc(nitems, size);
+// Wraps the malloc function
+void* GC_alloc(size_t size)
+{
+	return allocate(size, HEAP_SCANNED);
+}
 
-	// Stores the reference and the amount of allocated memory
-	if (!insert_key(allocation_map, pointer, nitems * size))
+// Allocates blocks of the same size under a single lock, without retrying if the memory isn't available
+static size_t try_allocate_many(size_t count, size_t size, void** blocks)
+{
+	if (registry_current() != NULL && ATOMIC_LOAD(&collection_due)) start_collection(TRUE, FALSE, NULL);
+	GET_LOCK;
+	size_t allocated = 0;
+	if (size <= HEAP_MAX_SMALL_SIZE)
 	{
-		ERROR_HELPER("Error inserting a new entry into the hashmap");
+		// The small blocks are carved together from the pages of their size class, bypassing the thread cache
+		if (ATOMIC_LOAD(&marking_state) == MARKING_DONE) FINISH_MARKING;
+		allocated = heap_alloc_many(size, HEAP_SCANNED, blocks, count);
 	}
-
+	else
+	{
+		if (ATOMIC_LOAD(&marking_state) == MARKING_DONE) FINISH_MARKING;
+		while (allocated < count && (blocks[allocated] = large_alloc(size, HEAP_SCANNED)) != NULL) allocated++;
+	}
+	check_collection_budget();
 	RELEASE_LOCK;
+	return allocated;
+}
+
+// Allocates several blocks like GC_alloc, the missing ones are retried once after a full collection
+size_t GC_alloc_many(size_t count, size_t size, void** blocks)
+{
+	size_t allocated = try_allocate_many(count, size, blocks);
+	if (allocated < count && reclaim_memory()) allocated += try_allocate_many(count - allocated, size, blocks + allocated);
+	size_t i;
+	for (i = allocated; i < count; i++)
+	{
+		blocks[i] = NULL;
+	}
+	return allocated;
+}
+
+// Wraps the calloc function
+void* GC_calloc(size_t nitems, size_t size)
+{
+	return allocate_zeroed(nitems, size, HEAP_SCANNED);
+}
+
+// Allocates a block that is never scanned for pointers
+void* GC_alloc_atomic(size_t size)
+{
+	return allocate(size, HEAP_POINTER_FREE);
+}
+
+// Allocates a zeroed array that is never scanned for pointers
+void* GC_calloc_atomic(size_t nitems, size_t size)
+{
+	return allocate_zeroed(nitems, size, HEAP_POINTER_FREE);
+}
+
+// Creates a descriptor from the offsets of the pointer fields of a type
+GC_descriptor_t GC_make_descriptor(const size_t* offsets, size_t count)
+{
+	return descriptor_from_offsets(offsets, count);
+}
+
+// Creates a descriptor from a bitmap of the pointer words of a type
+GC_descriptor_t GC_make_descriptor_from_bitmap(const uintptr_t* bitmap, size_t words)
+{
+	return descriptor_from_bitmap(bitmap, words);
+}
+
+// Allocates a zeroed block that is only scanned at the words its descriptor lists
+void* GC_alloc_typed(size_t size, GC_descriptor_t descriptor)
+{
+	if (descriptor == NULL || size > SIZE_MAX - sizeof(type_descriptor_t)) return NULL;
+
+	// The descriptor is stored into the last word of the block, past the requested size
+	size_t total = size + sizeof(type_descriptor_t);
+	size_t block_size = total;
+	if (total <= HEAP_MAX_SMALL_SIZE) heap_size_class(total, HEAP_TYPED, &block_size);
+	void* pointer = allocate_zeroed(1, total, HEAP_TYPED);
+	if (pointer != NULL) *DESCRIPTOR_SLOT(pointer, block_size) = descriptor;
 	return pointer;
 }
 
-// Wraps the realloc function
-void* GC_realloc(void* pointer, size_t size)
+// Returns the size of a large block and the hash map that holds it, 0 if it isn't one
+static size_t find_large_block(void* pointer, hash_map_t* map)
+{
+	size_t size = marking_state != MARKING_IDLE ? find_key(marking_allocations, pointer) : 0;
+	*map = size != 0 ? marking_allocations : allocation_map;
+	return size != 0 ? size : find_key(allocation_map, pointer);
+}
+
+// Releases a block of any kind, the lock must be held. The large blocks that the background
+// marker may be reading stay in the hash map until the final pause of the marking
+static void free_block(void* pointer)
+{
+	if (heap_free(pointer)) return;
+	hash_map_t map;
+	size_t size = find_large_block(pointer, &map);
+	if (size == 0) return;
+	if (map == allocation_map && marking_state != MARKING_IDLE)
+	{
+		if (find_key(deferred_frees, pointer) != 0 || insert_key(deferred_frees, pointer, size)) return;
+
+		// There's no memory left to defer the release
+		finish_concurrent_cycle();
+	}
+	if (remove_key(map, pointer)) large_free(pointer, size);
+}
+
+// Moves a block into a bigger one if needed, without retrying if the memory isn't available
+static void* try_reallocate(void* pointer, size_t size, bool_t* out_of_memory)
 {
+	*out_of_memory = FALSE;
+	if (registry_current() != NULL && ATOMIC_LOAD(&collection_due)) start_collection(TRUE, FALSE, NULL);
 	GET_LOCK;
+	if (ATOMIC_LOAD(&marking_state) == MARKING_DONE) FINISH_MARKING;
 
-	// Calls the standard realloc function
-	void* new_pointer = realloc(pointer, size);
+	// Get the size and the kind of the previous block, from the heap or from the hash map
+	unsigned int kind = HEAP_SCANNED;
+	size_t old_size = heap_block_size(pointer, &kind);
+	bool_t small = old_size != 0;
+	hash_map_t map = allocation_map;
+	if (!small)
+	{
+		old_size = find_large_block(pointer, &map);
+		uintptr_t owner = page_map_get(pointer);
+		if (owner & PAGE_MAP_POINTER_FREE) kind = HEAP_POINTER_FREE;
+		else if (owner & PAGE_MAP_TYPED) kind = HEAP_TYPED;
+	}
 
-	// Updates the reference in the hash map
-	replace_key(allocation_map, pointer, new_pointer);
+	// The pointer doesn't come from the GC, or it was already released
+	if (old_size == 0)
+	{
+		RELEASE_LOCK;
+		return NULL;
+	}
+
+	// The typed blocks keep their descriptor in their last word, past the requested size
+	size_t extra = kind == HEAP_TYPED ? sizeof(type_descriptor_t) : 0;
+	if (size > SIZE_MAX - extra)
+	{
+		RELEASE_LOCK;
+		return NULL;
+	}
+	size_t new_size = size + extra;
+
+	// Small blocks that still fit into their size class don't need to move, the mapped ones are resized by the OS
+	// and the other large ones stay in place while they don't outgrow their granules or shrink into a size class.
+	// The entries read by the background marker can't change, so those blocks move during the marking
+	void* new_pointer = NULL;
+	if (small && new_size <= old_size) new_pointer = pointer;
+	else if (!small && (map != allocation_map || marking_state == MARKING_IDLE) && (IS_MAPPED(old_size) ? IS_MAPPED(new_size) :
+		new_size > HEAP_MAX_SMALL_SIZE && ROUND_TO_GRANULE(new_size) <= ROUND_TO_GRANULE(old_size)))
+	{
+		new_pointer = large_resize(map, pointer, old_size, new_size, kind);
+	}
+	if (new_pointer == NULL)
+	{
+		// The new block keeps the kind of the previous one
+		new_pointer = new_size <= HEAP_MAX_SMALL_SIZE ? heap_alloc(new_size, kind) : large_alloc(new_size, kind);
+		*out_of_memory = new_pointer == NULL;
+		if (new_pointer != NULL)
+		{
+			size_t copied = old_size - extra < size ? old_size - extra : size;
+			memcpy(new_pointer, pointer, copied);
+			if (kind != HEAP_POINTER_FREE) record_writes(new_pointer, copied);
+			if (kind == HEAP_TYPED)
+			{
+				// The descriptor may list the words past the copied ones, they must not keep stale blocks alive
+				memset((char*)new_pointer + copied, 0, size - copied);
+				size_t block_size = new_size <= HEAP_MAX_SMALL_SIZE ? heap_block_size(new_pointer, NULL) : new_size;
+				*DESCRIPTOR_SLOT(new_pointer, block_size) = *DESCRIPTOR_SLOT(pointer, old_size);
+			}
+			free_block(pointer);
+		}
+	}
+	check_collection_budget();
 
 	RELEASE_LOCK;
 	return new_pointer;
 }
 
+// Wraps the realloc function
+void* GC_realloc(void* pointer, size_t size)
+{
+	if (pointer == NULL) return GC_alloc(size);
+
+	// The previous block is still referenced by this frame during the collection
+	bool_t out_of_memory;
+	void* new_pointer = try_reallocate(pointer, size, &out_of_memory);
+	if (out_of_memory && reclaim_memory()) new_pointer = try_reallocate(pointer, size, &out_of_memory);
+	return new_pointer;
+}
+
 // Wraps the free function
 void GC_free(void* pointer)
 {
 	GET_LOCK;
-	remove_key(allocation_map, pointer);
+	free_block(pointer);
+	RELEASE_LOCK;
+}
+
+// Releases several blocks under a single lock
+void GC_free_many(void** blocks, size_t count)
+{
+	GET_LOCK;
+	size_t i;
+	for (i = 0; i < count; i++)
+	{
+		free_block(blocks[i]);
+	}
 	RELEASE_LOCK;
 }
 
@@ -171,120 +897,743 @@ void GC_free(void* pointer)
 
 ========================================== */
 
-// Explores a graph of allocated memory nodes and marks all of them as valid
-static void recursive_graph_mark(void* pointer, size_t allocated_space)
+// Marks the blocks reachable from the static roots and from the stacks of the threads
+static void mark_roots(root_range_t* stacks, int count)
+{
+	mark_from_roots(static_roots, static_roots_count);
+	mark_from_roots(stacks, count);
+}
+
+// The memory kept alive by each root range, measured by GC_report_roots. The ranges are copied in
+// pages reserved from the OS, as the libc allocator may be locked by a stopped thread
+struct root_report_s
+{
+	root_range_t* ranges;
+	size_t* bytes;
+	int count;
+	size_t reserved;
+};
+
+// Adds the size of a valid large block to the memory marked so far
+static size_t marked_large_bytes;
+static void count_marked_large_block(void* pointer, size_t size)
+{
+	(void)pointer;
+	marked_large_bytes += size;
+}
+
+// Returns the size of all the blocks marked so far
+static size_t marked_memory()
+{
+	size_t blocks;
+	marked_large_bytes = 0;
+	visit_valid_entries(allocation_map, count_marked_large_block);
+	return heap_marked_bytes(&blocks) + marked_large_bytes;
+}
+
+// Marks the roots like mark_roots, but one range at a time, and stores the memory newly reached by
+// each one. The memory reachable from several ranges is counted for the first one
+static void mark_roots_by_range(root_range_t* stacks, int count, struct root_report_s* report)
 {
-	void* upper_bound = pointer + allocated_space - sizeof(void*);
-	while (pointer < upper_bound)
+	int total = static_roots_count + count, i;
+	report->reserved = ROUND_TO_GRANULE(total * (sizeof(root_range_t) + sizeof(size_t)));
+	report->ranges = total == 0 ? NULL : (root_range_t*)reserve_aligned_pages(report->reserved, PAGE_MAP_GRANULE);
+	if (report->ranges == NULL)
 	{
-		size_t allocated_size = find_key(allocation_map, address);
-		if ((allocated_size != 0) && !check_if_marked(allocation_map, pointer))
-		{
-			mark_as_valid_if_present(allocation_map, pointer);
-			recursive_graph_mark(pointer, allocated_size);
-		}
-		pointer++;
+		mark_roots(stacks, count);
+		return;
+	}
+	report->bytes = (size_t*)(report->ranges + total);
+	report->count = total;
+	size_t marked = marked_memory();
+	for (i = 0; i < total; i++)
+	{
+		report->ranges[i] = i < static_roots_count ? static_roots[i] : stacks[i - static_roots_count];
+		mark_from_roots(report->ranges + i, 1);
+		size_t now = marked_memory();
+		report->bytes[i] = now - marked;
+		marked = now;
 	}
 }
 
-// Main function for the collect operation
-#if WIN_THREADS
-DWORD WINAPI collect(LPVOID lparam)
+// Minor collection: the old blocks keep their marks, so the marking stops at them and only the
+// young blocks reached from the roots or from the cards written since the last collection survive
+static void mark_young_blocks(root_range_t* roots, int roots_count)
 {
-	// Explicit argument cast
-	void* address = (void*)lparam;
-#else
-static void collect(void* address)
+	int count;
+	bool_t overflowed;
+	root_range_t* cards = barrier_take_dirty_cards(&count, &overflowed);
+	mark_roots(roots, roots_count);
+	if (count > 0) mark_from_cards(cards, count);
+	if (overflowed) marker_rescan();
+}
+
+// Flipping the colour would make the young blocks look marked and stop the marking at them,
+// so the reachable ones become old first and the others are released
+static void promote_young_blocks(root_range_t* roots, int count)
+{
+	if (!young_blocks) return;
+	mark_young_blocks(roots, count);
+	heap_start_sweep();
+	heap_finish_sweep();
+
+	// The barrier was kept on until now if the generational collections were disabled
+	young_blocks = generational_enabled;
+	if (!young_blocks) barrier_disable();
+}
+
+// Moves the blocks of the sparse pages that weren't pinned by the marking and updates the
+// precise pointers to them, the program must be stopped
+static void compact_heap()
+{
+	if (heap_evacuate() == 0) return;
+	marker_forward_pointers();
+	heap_release_evacuated();
+}
+
+// Takes the counters at the start of a cycle, the freed blocks and the sweep time of the cycle
+// are the ones counted from now on
+static void begin_cycle_stats()
+{
+	heap_get_counters(&cycle_heap_counters);
+	cycle_large_freed_bytes = large_freed_bytes;
+	cycle_large_freed_blocks = large_freed_blocks;
+	cycle_large_sweep_time = large_sweep_time;
+	stats.collections++;
+	stats.last_pause_time = 0;
+	stats.last_roots_time = 0;
+	stats.last_mark_time = 0;
+}
+
+// Adds the phases of a pause to the last cycle and to the totals: the roots are gathered
+// and the threads stopped from the start, the marking runs from the second time to the third
+static void record_pause(uint64_t start, uint64_t marking, uint64_t marked, uint64_t end)
+{
+	stats.last_roots_time += marking - start;
+	stats.last_mark_time += marked - marking;
+	stats.last_pause_time += end - start;
+	stats.total_roots_time += marking - start;
+	stats.total_mark_time += marked - marking;
+	stats.total_pause_time += end - start;
+}
+
+// A collection requested by a thread: the thread and the top of its stack, NULL if nobody waits for it,
+// the kind of collection, where to measure the memory kept by each root range if it was requested,
+// whether it's over and the next request in the queue of the collector thread
+struct collect_request_s
+{
+	gc_thread_t thread;
+	char* address;
+	bool_t paced;
+	bool_t full;
+	struct root_report_s* report;
+	bool_t done;
+	struct collect_request_s* next;
+};
+
+// Main function for the collect operation, the lock must be held
+static void collect(struct collect_request_s* request)
+{
+	// The marks of the previous collection are still needed by the pages that weren't swept
+	finish_sweep();
+	begin_cycle_stats();
+
+	// The stacks of all the registered threads are the roots, so they can't change during the marking
+	int count;
+	uint64_t start = get_nanoseconds();
+	static_roots = root_set_gather(&static_roots_count);
+	root_range_t* roots = registry_stop_world(request->thread, request->address, &count);
+	uint64_t marking = get_nanoseconds();
+
+	// The blocks handed out by the caches must be young, so the cached ones can't be marked
+	if (young_blocks) registry_flush_caches();
+	bool_t minor = generational_enabled && minor_collections < MINOR_COLLECTIONS_PER_MAJOR;
+	if (minor)
+	{
+		// The large blocks are all old, only the young heap blocks can be released
+		minor_collections++;
+		stats.minor_collections++;
+		mark_young_blocks(roots, count);
+	}
+	else
+	{
+		minor_collections = 0;
+		promote_young_blocks(roots, count);
+
+		// Set all the pointers as invalid, this just flips the meaning of the mark bits
+		heap_clear_marks();
+		mark_pointers_as_invalid(allocation_map);
+		blacklist_rotate();
+
+		// Use the globals and the whole stacks as the roots and mark all the memory graph as reachable
+		if (compaction_enabled) heap_start_pinning();
+		if (request->report != NULL) mark_roots_by_range(roots, count, request->report);
+		else mark_roots(roots, count);
+		large_sweep_pending = TRUE;
+		if (compaction_enabled) compact_heap();
+	}
+	uint64_t marked = get_nanoseconds();
+	registry_start_world(request->thread);
+	record_pause(start, marking, marked, get_nanoseconds());
+	reset_collection_budget(!minor);
+
+	// The heap pages are swept later, by the allocations and by the background sweeper
+	heap_start_sweep();
+#if !defined POSIX_THREADS && !defined WIN_THREADS
+	sweep_large_blocks();
 #endif
+}
+
+// Flips the marks and hands the roots to the background thread, the lock must be held
+static void start_concurrent_cycle(gc_thread_t self, char* address)
 {
-	// Set all the pointers in the allocation map as invalid
+#if defined POSIX_THREADS || defined WIN_THREADS
+	finish_sweep();
+	begin_cycle_stats();
+	if (young_blocks)
+	{
+		int count;
+		uint64_t start = get_nanoseconds();
+		static_roots = root_set_gather(&static_roots_count);
+		root_range_t* roots = registry_stop_world(self, address, &count);
+		uint64_t marking = get_nanoseconds();
+		promote_young_blocks(roots, count);
+		uint64_t marked = get_nanoseconds();
+		registry_start_world(self);
+		record_pause(start, marking, marked, get_nanoseconds());
+	}
+	heap_clear_marks();
 	mark_pointers_as_invalid(allocation_map);
+	blacklist_rotate();
 
-	// Calculate the upper address, sizeof(void*) is 4 on 32 bit systems and 8 on 64 bit systems
-	void* upper_bound = stack_bottom - sizeof(void*);
+	// The writes done from now on are scanned again when the marking is over, together
+	// with the stacks of all the threads, so only the requesting one is marked concurrently
+	barrier_enable(FALSE);
+	concurrent_roots.start = address;
+	concurrent_roots.end = precise_roots || self == NULL ? address : registry_stack_bottom(self);
+	marking_state = MARKING_CONCURRENT;
+	ATOMIC_STORE(&collection_due, FALSE);
+	MUTEX_LOCK(sweeper_lock);
+	mark_requested = TRUE;
+	COND_BROADCAST(sweeper_wakeup);
+	MUTEX_UNLOCK(sweeper_lock);
+#endif
+}
 
-	// Sweep the stack
-	while (address < upper_bound)
+#if defined POSIX_THREADS || defined WIN_THREADS
+// Moves a block allocated during the concurrent marking into the hash map of the large blocks
+static void adopt_large_block(void* pointer, size_t size)
+{
+	if (!insert_key(allocation_map, pointer, size))
 	{
-		// Check if the current location is a pointer to an dynamically allocated memory bshared_lock
-		size_t allocated_size = find_key(allocation_map, address)
-			if (allocated_size != 0)
-			{
-				// Use that bshared_lock as the root and mark all the memory graph as reachable
-				recursive_graph_mark(address, allocated_size);
-			}
-		address++;
+		ERROR_HELPER("Error inserting a new entry into the hashmap");
 	}
+}
 
-	// Deallocate all the references that are definitively lost
-	deallocate_lost_references(allocation_map);
+// Releases a block freed by the program during the concurrent marking
+static void release_deferred_block(void* pointer, size_t size)
+{
+	if (remove_key(allocation_map, pointer)) large_free(pointer, size);
+}
+#endif
 
+// Completes the running concurrent cycle with a short pause, the lock must be held
+static void finish_concurrent_cycle()
+{
+#if defined POSIX_THREADS || defined WIN_THREADS
+	// The background thread may need the lock to end its sweep before marking, so release it while waiting
 	RELEASE_LOCK;
+	MUTEX_LOCK(sweeper_lock);
+	while (ATOMIC_LOAD(&marking_state) == MARKING_CONCURRENT)
+	{
+		COND_WAIT(marking_done, sweeper_lock);
+	}
+	MUTEX_UNLOCK(sweeper_lock);
+	GET_LOCK;
+
+	// Another thread may have finished the cycle in the meantime
+	if (marking_state != MARKING_DONE) return;
+
+	// The background thread is done with the hash map, the blocks allocated meanwhile join it already marked
+	visit_valid_entries(marking_allocations, adopt_large_block);
+	hash_map_clear(marking_allocations);
+
+	// The registers and the stacks changed while the heap was marked, so they are scanned again
+	jmp_buf registers_backup;
+	setjmp(registers_backup);
+	gc_thread_t self = registry_current();
+	int count;
+	uint64_t start = get_nanoseconds();
+	static_roots = root_set_gather(&static_roots_count);
+	root_range_t* roots = registry_stop_world(self, (char*)get_stack_pointer(), &count);
+	uint64_t marking = get_nanoseconds();
+	barrier_disable();
+	mark_roots(roots, count);
+
+	// Then the blocks written by the program, or all the marked ones if some writes were lost
+	bool_t overflowed;
+	root_range_t* cards = barrier_take_dirty_cards(&count, &overflowed);
+	if (count > 0) mark_from_cards(cards, count);
+	if (overflowed || concurrent_overflow) marker_rescan();
+	uint64_t marked = get_nanoseconds();
+	registry_start_world(self);
+	record_pause(start, marking, marked, get_nanoseconds());
+	visit_valid_entries(deferred_frees, release_deferred_block);
+	hash_map_clear(deferred_frees);
+
+	// The marking done by the background thread doesn't pause the program
+	stats.last_mark_time += concurrent_mark_time;
+	stats.total_mark_time += concurrent_mark_time;
+	reset_collection_budget(TRUE);
+
+	heap_start_sweep();
+	large_sweep_pending = TRUE;
+	marking_state = MARKING_IDLE;
+	request_sweep();
+#endif
 }
 
-// Backups the content of the general purpose registers into a target array
-static void populate_registers_array(void* target[])
+// Runs a requested collection. A full one ignores the minor collections and doesn't leave
+// a concurrent cycle running. The requesting thread isn't stopped, it waits for the collection
+static void run_collection(struct collect_request_s* request)
 {
-// The buffer will contain "movl/q %0xADDRESS, %xxx"
-#define COMMAND_BUFFER_LENGTH = 64
+	GET_LOCK;
 
-// Enumerate the fourteen 64 bit registers
-#if defined(__x86_64__) || defined(_M_X64)
-#define REG_NUMBER 16
-#define MOV_COMMAND "movq"
-	char* registers[] = { "rax", "rbx", "rcx", "rdx", "rdi", "rsi", 
-						"r8", "r9", "r10", "r11", "r12", "r13", "r14", "r15" };
-#else
+	// Concurrent collections only pause the program at the start and at the end of the marking.
+	// The memory kept by each root range can only be measured by a marking that stops it
+	if (concurrent_enabled && request->report == NULL)
+	{
+		if (marking_state != MARKING_IDLE) finish_concurrent_cycle();
+		else start_concurrent_cycle(request->thread, request->address);
+		if (request->full && marking_state != MARKING_IDLE) finish_concurrent_cycle();
+		RELEASE_LOCK;
+		return;
+	}
+	if (marking_state != MARKING_IDLE) finish_concurrent_cycle();
+	if (request->full) minor_collections = MINOR_COLLECTIONS_PER_MAJOR;
+	collect(request);
+	RELEASE_LOCK;
 
-// 32 bit systems only have 6 general purpose registers
-#define REG_NUMBER 8
-#define MOV_COMMAND "movl"
-	char* registers[] = { "eax", "ebx", "ecx", "edx", "edi", "esi" };
-	void* registers[8];
+	// Let the sweeper release the garbage in the background
+#if defined POSIX_THREADS || defined WIN_THREADS
+	request_sweep();
 #endif
+}
 
-	// Run the asm commands to copy the registers content into the array
-	int i;
-	for (i = 0; i < REG_NUMBER; i++)
+// Requests a collection from the calling thread and waits for it. A paced one is skipped if another
+// thread already collected, a full one ignores the minor collections. The report is NULL if not needed
+static void start_collection(bool_t paced, bool_t full, struct root_report_s* report)
+{
+	// Spill the content of the general purpose registers into the stack
+	jmp_buf registers_backup;
+	setjmp(registers_backup);
+
+	// Get the pointer to the top of the stack
+	void* address = get_stack_pointer();
+	struct collect_request_s request = { registry_current(), (char*)address, paced, full, report, FALSE, NULL };
+	if (request.thread == NULL)
 	{
-		char command[COMMAND_BUFFER_LENGTH];
-		sprintf(command, "%s %s, \%%p", MOV_COMMAND, registers[i], target + i);
-		asm(command);
+		ERROR_HELPER("The thread isn't registered");
 	}
+
+	// The collector thread scans this stack, so wait for it: the frames and the
+	// registers saved above must stay untouched until the marking is over
+#if defined POSIX_THREADS || defined WIN_THREADS
+	MUTEX_LOCK(collector_lock);
+	request.next = collect_requests;
+	collect_requests = &request;
+	COND_BROADCAST(collector_wakeup);
+	while (!request.done) COND_WAIT(collection_finished, collector_lock);
+	MUTEX_UNLOCK(collector_lock);
+#else
+	if (paced && !collection_due) return;
+	collections_started++;
+	run_collection(&request);
+	collections_completed = collections_started;
+	if (collection_callback != NULL) collection_callback(collections_completed);
+#endif
 }
 
-// Automatically deallocates all the memory bshared_locks that can no longer be reached
+#if defined POSIX_THREADS || defined WIN_THREADS
+
+// Runs the queued collections one at a time, then the one requested without waiting if it's still
+// needed. A collection that starts after GC_collect_async was called completes its ticket
+static void run_collector()
+{
+	for (;;)
+	{
+		MUTEX_LOCK(collector_lock);
+		while (collect_requests == NULL && !async_requested)
+		{
+			COND_WAIT(collector_wakeup, collector_lock);
+		}
+		struct collect_request_s async_request = { NULL, NULL, FALSE, TRUE, NULL, FALSE, NULL };
+		struct collect_request_s* request = collect_requests;
+		if (request == NULL) request = &async_request;
+		else
+		{
+			collect_requests = request->next;
+
+			// A paced request is skipped if another thread already collected, unless it completes the tickets
+			if (async_requested) request->full = TRUE;
+			else if (request->paced && !ATOMIC_LOAD(&collection_due))
+			{
+				request->done = TRUE;
+				COND_BROADCAST(collection_finished);
+				MUTEX_UNLOCK(collector_lock);
+				continue;
+			}
+		}
+		async_requested = FALSE;
+		uint64_t cycle = ++collections_started;
+		MUTEX_UNLOCK(collector_lock);
+
+		run_collection(request);
+
+		// The requesting thread returns as soon as it's woken up, so its request can't be used anymore
+		MUTEX_LOCK(collector_lock);
+		request->done = TRUE;
+		ATOMIC_STORE(&collections_completed, cycle);
+		GC_collection_callback_t callback = collection_callback;
+		COND_BROADCAST(collection_finished);
+		MUTEX_UNLOCK(collector_lock);
+		if (callback != NULL) callback(cycle);
+	}
+}
+
+// Entry point of the collector thread
+#if defined WIN_THREADS
+static DWORD WINAPI collector_thread(LPVOID lparam)
+{
+	(void)lparam;
+	run_collector();
+	return 0;
+}
+#else
+static void* collector_thread(void* lparam)
+{
+	(void)lparam;
+	run_collector();
+	return NULL;
+}
+#endif
+
+// Starts the collector thread, it lives as long as the process and isn't registered
+static bool_t start_collector()
+{
+#if defined WIN_THREADS
+	HANDLE thread = CreateThread(NULL, 0, collector_thread, NULL, 0, NULL);
+	if (thread == NULL) return FALSE;
+	CloseHandle(thread);
+#else
+	pthread_t thread;
+	if (pthread_create(&thread, NULL, collector_thread, NULL) != 0) return FALSE;
+	pthread_detach(thread);
+#endif
+	return TRUE;
+}
+#endif
+
+// Automatically deallocates all the memory blocks that can no longer be reached
 void GC_collect()
 {
-	// Backup the content of the general purpose registers into the stack
-#if defined(__x86_64__) || defined(_M_X64)
-	void* registers_backup[16];
+	start_collection(FALSE, FALSE, NULL);
+}
+
+// Requests a full collection without waiting for it
+GC_ticket_t GC_collect_async()
+{
+#if defined POSIX_THREADS || defined WIN_THREADS
+	MUTEX_LOCK(collector_lock);
+	async_requested = TRUE;
+	GC_ticket_t ticket = collections_started + 1;
+	COND_BROADCAST(collector_wakeup);
+	MUTEX_UNLOCK(collector_lock);
+	return ticket;
 #else
-	void* registers_backup[8];
+	start_collection(FALSE, TRUE, NULL);
+	return collections_completed;
 #endif
-	populate_registers_array(registers_backup);
+}
 
-	// Get the pointer to the top of the stack
-	void* address = get_stack_pointer();
+// Waits until the collection of a ticket is completed
+void GC_wait(GC_ticket_t ticket)
+{
+#if defined POSIX_THREADS || defined WIN_THREADS
+	MUTEX_LOCK(collector_lock);
+	while (collections_completed < ticket) COND_WAIT(collection_finished, collector_lock);
+	MUTEX_UNLOCK(collector_lock);
+#endif
+}
 
-#if defined POSIX_THREADS
+// Checks whether the collection of a ticket is completed
+bool_t GC_poll(GC_ticket_t ticket)
+{
+	return ATOMIC_LOAD(&collections_completed) >= ticket;
+}
+
+// Sets the function called at the end of each collection
+void GC_set_collection_callback(GC_collection_callback_t callback)
+{
+#if defined POSIX_THREADS || defined WIN_THREADS
+	MUTEX_LOCK(collector_lock);
+	collection_callback = callback;
+	MUTEX_UNLOCK(collector_lock);
+#else
+	collection_callback = callback;
+#endif
+}
+
+// Runs a full collection that measures the memory kept alive by each root range
+void GC_report_roots(GC_root_visitor_t visitor)
+{
+	struct root_report_s report = { NULL, NULL, 0, 0 };
+	start_collection(FALSE, TRUE, &report);
+	int i;
+	for (i = 0; i < report.count; i++)
+	{
+		visitor(report.ranges[i].start, report.ranges[i].end, report.bytes[i]);
+	}
+	if (report.ranges != NULL) release_pages(report.ranges, report.reserved);
+}
+
+// Adds a memory area to the roots
+bool_t GC_add_roots(void* start, void* end)
+{
 	GET_LOCK;
+	bool_t result = root_set_add(start, end);
+	RELEASE_LOCK;
+	return result;
+}
 
-	// Thread initialization and call to GC_main
-	pthread_t* gc_main_thread = malloc(sizeof(pthread_t));
-	if (pthread_create(gc_main_thread, NULL, GC_main, address) != 0)
+// Removes the manual roots inside a range
+void GC_remove_roots(void* start, void* end)
+{
+	GET_LOCK;
+	root_set_remove(start, end);
+	RELEASE_LOCK;
+}
+
+// Chooses between the shadow stacks and the conservative scan of the stacks
+void GC_set_precise_roots(bool_t enabled)
+{
+	GET_LOCK;
+	FINISH_MARKING;
+	precise_roots = enabled;
+	registry_set_precise_roots(enabled);
+	RELEASE_LOCK;
+}
+
+// Pushes a root on the shadow stack of the calling thread
+void GC_push_root(void* slot)
+{
+	gc_thread_t self = registry_current();
+	if (self == NULL)
 	{
-		ERROR_HELPER("Error creating the thread");
+		ERROR_HELPER("The thread isn't registered");
 	}
-#elif defined WIN_THREADS
+	registry_push_root(self, (void**)slot);
+}
+
+// Pops roots from the shadow stack of the calling thread
+void GC_pop_roots(unsigned int count)
+{
+	gc_thread_t self = registry_current();
+	if (self == NULL)
+	{
+		ERROR_HELPER("The thread isn't registered");
+	}
+	registry_pop_roots(self, count);
+}
+
+// Registers the calling thread, so that its stack is scanned
+bool_t GC_register_thread()
+{
+	GET_LOCK;
+	bool_t result = registry_add() != NULL;
+	RELEASE_LOCK;
+	return result;
+}
+
+// Removes the calling thread from the registry, its cached blocks go back to the heap
+void GC_unregister_thread()
+{
 	GET_LOCK;
 
-	HANDLE gc_main_thread = CreateThread(NULL, 0, collect, address, 0, NULL);
-	if (gc_main_thread == NULL)
+	// The background marker may be scanning the stack of the thread
+	FINISH_MARKING;
+	gc_thread_t self = registry_current();
+	if (self != NULL)
 	{
-		ERROR_HELPER("Error creating the thread");
+		thread_cache_flush(registry_cache(self));
+		registry_remove(self);
 	}
+	RELEASE_LOCK;
+}
+
+// Enables or disables the recognition of pointers to the inside of the blocks
+void GC_set_interior_pointers(bool_t enabled)
+{
+	GET_LOCK;
+	FINISH_MARKING;
+	marker_set_interior_pointers(enabled);
+	interior_pointers = enabled;
+	RELEASE_LOCK;
+}
+
+// Sets whether the pointers can be stored at misaligned addresses
+void GC_set_misaligned_pointers(bool_t enabled)
+{
+	GET_LOCK;
+	FINISH_MARKING;
+	marker_set_misaligned_pointers(enabled);
+	RELEASE_LOCK;
+}
+
+// Sets the number of threads used to mark the heap
+bool_t GC_set_marker_threads(unsigned int count)
+{
+	GET_LOCK;
+	FINISH_MARKING;
+	bool_t result = marker_set_threads(count);
+	RELEASE_LOCK;
+	return result;
+}
+
+// Enables or disables the concurrent marking
+bool_t GC_set_concurrent(bool_t enabled)
+{
+#if defined POSIX_THREADS || defined WIN_THREADS
+	GET_LOCK;
+	if (!enabled) FINISH_MARKING;
+	bool_t result = !enabled || (!generational_enabled && !compaction_enabled);
+	if (result) concurrent_enabled = enabled;
+	RELEASE_LOCK;
+	return result;
 #else
-	collect(address);
+	return !enabled;
 #endif
-}
\ No newline at end of file
+}
+
+// Records a write into the GC memory
+void GC_write_barrier(void* slot)
+{
+	barrier_record(slot);
+}
+
+// Enables or disables the generational collections
+bool_t GC_set_generational(bool_t enabled)
+{
+	GET_LOCK;
+
+	// The concurrent marking needs the new blocks to be allocated marked, and the minor
+	// collections don't scan the old blocks that would point to the moved ones
+	bool_t result = !enabled || (!concurrent_enabled && !compaction_enabled);
+	if (result && enabled != generational_enabled)
+	{
+		// The blocks allocated so far are old, the barrier stays on until the young ones are promoted
+		if (enabled && !young_blocks) barrier_enable(TRUE);
+		if (enabled) young_blocks = TRUE;
+		generational_enabled = enabled;
+		minor_collections = 0;
+		heap_set_young_allocations(enabled);
+	}
+	RELEASE_LOCK;
+	return result;
+}
+
+// Enables or disables the compaction of the full collections
+bool_t GC_set_compaction(bool_t enabled)
+{
+	GET_LOCK;
+
+	// The blocks can only move while the program is stopped and every marked block was scanned
+	bool_t result = !enabled || (!concurrent_enabled && !generational_enabled);
+	if (result) compaction_enabled = enabled;
+	RELEASE_LOCK;
+	return result;
+}
+
+// Sets the growth of the heap that triggers the next collection
+void GC_set_heap_growth(int percent)
+{
+	GET_LOCK;
+	heap_growth = percent;
+	compute_collection_budget();
+	check_collection_budget();
+	RELEASE_LOCK;
+}
+
+// Sets how long the empty pages stay resident
+void GC_set_page_decay(int milliseconds)
+{
+	GET_LOCK;
+	page_decay = milliseconds;
+	decommit_decayed_pages();
+	RELEASE_LOCK;
+
+	// The sweeper may be waiting for the previous deadline
+#if defined POSIX_THREADS || defined WIN_THREADS
+	MUTEX_LOCK(sweeper_lock);
+	COND_BROADCAST(sweeper_wakeup);
+	MUTEX_UNLOCK(sweeper_lock);
+#endif
+}
+
+// Returns the free memory to the OS right away
+void GC_trim()
+{
+	GET_LOCK;
+	finish_sweep();
+	heap_decommit_empty_pages(UINT64_MAX);
+	ATOMIC_STORE(&page_decay_deadline, 0);
+	trim_libc_heap();
+	RELEASE_LOCK;
+}
+
+// Sets the soft memory limit
+void GC_set_memory_limit(size_t bytes)
+{
+	GET_LOCK;
+	memory_limit = bytes;
+	compute_collection_budget();
+	check_collection_budget();
+	RELEASE_LOCK;
+}
+
+// Reads the statistics, the counters of the last cycle include the sweep done so far
+struct GC_stats_s GC_get_stats()
+{
+	GET_LOCK;
+	struct GC_stats_s result = stats;
+	struct heap_counters_s counters;
+	heap_get_counters(&counters);
+	result.total_allocated_bytes = counters.allocated_bytes + large_allocated_bytes;
+	result.total_freed_bytes = counters.freed_bytes + large_freed_bytes;
+	result.total_freed_blocks = counters.freed_blocks + large_freed_blocks;
+	result.total_sweep_time = counters.sweep_time + large_sweep_time;
+	result.last_freed_bytes = counters.freed_bytes - cycle_heap_counters.freed_bytes + large_freed_bytes - cycle_large_freed_bytes;
+	result.last_freed_blocks = counters.freed_blocks - cycle_heap_counters.freed_blocks + large_freed_blocks - cycle_large_freed_blocks;
+	result.last_sweep_time = counters.sweep_time - cycle_heap_counters.sweep_time + large_sweep_time - cycle_large_sweep_time;
+	result.total_moved_bytes = counters.moved_bytes;
+	result.last_moved_bytes = counters.moved_bytes - cycle_heap_counters.moved_bytes;
+	result.total_decommitted_bytes = counters.decommitted_bytes;
+
+	uintptr_t candidates, hits;
+	marker_get_counters(&candidates, &hits);
+	result.scanned_candidates = candidates;
+	result.candidate_hits = hits;
+	result.blacklisted_pages = blacklist_count();
+
+	size_t capacity, rehashes;
+	hash_map_get_stats(allocation_map, &result.large_blocks, &capacity, &rehashes);
+	result.large_blocks_load_factor = (double)result.large_blocks / capacity;
+	result.large_blocks_rehashes = rehashes;
+
+	// The blocks allocated during a concurrent marking aren't in the hash map yet
+	size_t marking_blocks, marking_capacity, marking_rehashes;
+	hash_map_get_stats(marking_allocations, &marking_blocks, &marking_capacity, &marking_rehashes);
+	result.large_blocks += marking_blocks;
+	RELEASE_LOCK;
+	return result;
+}
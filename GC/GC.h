@@ -2,7 +2,8 @@
 #define GC_H
 
 // Main header file with all the used definitions
-#include "..\Misc\GC_definitions"
+#include <stdint.h>
+#include "../Misc/GC_definitions.h"
 
 /* ---------------------------------------------------------------------
 *  GC_init
@@ -34,13 +35,105 @@ void* GC_alloc(size_t size);
 *    size ---> The size of each item */
 void* GC_calloc(size_t nitems, size_t size);
 
+/* ---------------------------------------------------------------------
+*  GC_alloc_atomic
+*  ---------------------------------------------------------------------
+*  Description:
+*    Allocates a block like GC_alloc, but the collector never scans its
+*    content for pointers. Use it for strings, pixel buffers and numeric
+*    arrays: their values can't keep other blocks alive by accident and
+*    the marker skips them. The block must never hold the only pointer
+*    to another block
+*  Parameters:
+*    size ---> The size of the memory block to allocate */
+void* GC_alloc_atomic(size_t size);
+
+/* ---------------------------------------------------------------------
+*  GC_calloc_atomic
+*  ---------------------------------------------------------------------
+*  Description:
+*    Allocates a zeroed array like GC_calloc, but the collector never
+*    scans its content for pointers
+*  Parameters:
+*    nitems ---> The number of items to request allocated space for
+*    size ---> The size of each item */
+void* GC_calloc_atomic(size_t nitems, size_t size);
+
+/* ---------------------------------------------------------------------
+*  GC_alloc_many
+*  ---------------------------------------------------------------------
+*  Description:
+*    Allocates count blocks like GC_alloc, taking the lock only once.
+*    The small blocks are carved together from the pages of their size
+*    class, so a burst of nodes of the same type costs much less than
+*    a GC_alloc call for each one. Returns the number of blocks
+*    allocated, the slots of the missing ones are set to NULL. The
+*    array must be visible to the collector, like any other pointer
+*  Parameters:
+*    count ---> The number of blocks to allocate
+*    size ---> The size of each block
+*    blocks ---> The array that receives the new blocks */
+size_t GC_alloc_many(size_t count, size_t size, void** blocks);
+
+/* ---------------------------------------------------------------------
+*  GC_descriptor_t
+*  ---------------------------------------------------------------------
+*  Description:
+*    The layout of a type allocated with GC_alloc_typed: it tells the
+*    collector which words of the blocks may hold pointers. Descriptors
+*    are usually created once for each type and live as long as the
+*    process */
+typedef struct type_descriptor_s* GC_descriptor_t;
+
+/* ---------------------------------------------------------------------
+*  GC_make_descriptor
+*  ---------------------------------------------------------------------
+*  Description:
+*    Creates the descriptor of a type from the offsets of its pointer
+*    fields, usually obtained with offsetof. Returns NULL if an offset
+*    isn't a multiple of the size of a pointer
+*  Parameters:
+*    offsets ---> The offsets in bytes of the pointer fields
+*    count ---> The number of offsets */
+GC_descriptor_t GC_make_descriptor(const size_t* offsets, size_t count);
+
+/* ---------------------------------------------------------------------
+*  GC_make_descriptor_from_bitmap
+*  ---------------------------------------------------------------------
+*  Description:
+*    Creates the descriptor of a type from a bitmap with one bit for
+*    each word of the type, set if the word may hold a pointer. The
+*    lowest bit of the first bitmap word is the first word of the type
+*  Parameters:
+*    bitmap ---> The bitmap, it is copied into the descriptor
+*    words ---> The number of words described by the bitmap */
+GC_descriptor_t GC_make_descriptor_from_bitmap(const uintptr_t* bitmap, size_t words);
+
+/* ---------------------------------------------------------------------
+*  GC_alloc_typed
+*  ---------------------------------------------------------------------
+*  Description:
+*    Allocates a zeroed block whose layout is given by a descriptor:
+*    the collector only reads the words listed by the descriptor, so
+*    the integers stored in the other words never keep blocks alive and
+*    the block is marked faster. The words past the ones described by
+*    the descriptor are never scanned. GC_realloc keeps the descriptor
+*  Parameters:
+*    size ---> The size of the memory block to allocate
+*    descriptor ---> The layout of the block */
+void* GC_alloc_typed(size_t size, GC_descriptor_t descriptor);
+
 /* ---------------------------------------------------------------------
 *  GC_realloc
 *  ---------------------------------------------------------------------
 *  Description:
-*    Wraps the realloc function: extends an allocated memory area by
-*    copying all the content of the given memory zone to another one and
-*    returns a pointer to the new area
+*    Wraps the realloc function: resizes an allocated memory area and
+*    returns a pointer to the new area. The block stays in place while
+*    it fits into its size class or into the memory it already takes,
+*    and the blocks of 128KB and more are resized by the OS, the other
+*    blocks are copied. Returns NULL if the pointer doesn't reference a
+*    block allocated by the GC. A block allocated with GC_alloc_atomic
+*    stays pointer-free
 *  Parameters:
 *    pointer ---> A pointer to the previous allocated space
 *    size ---> The size of the new memory block to allocate */
@@ -51,9 +144,71 @@ void* GC_realloc(void* pointer, size_t size);
 *  ---------------------------------------------------------------------
 *  Description:
 *    Automatically identifies all the memory blocks in the heap that
-*    can no longer be reached by user code and deallocates them */
+*    can no longer be reached by user code and deallocates them. The
+*    other registered threads are stopped while their stacks are
+*    scanned, the calling thread must be registered too. The
+*    allocations also start collections, see GC_set_heap_growth */
 void GC_collect();
 
+/* ---------------------------------------------------------------------
+*  GC_ticket_t
+*  ---------------------------------------------------------------------
+*  Description:
+*    The number of a collection, returned by GC_collect_async and
+*    passed to the callback set with GC_set_collection_callback */
+typedef uint64_t GC_ticket_t;
+
+/* ---------------------------------------------------------------------
+*  GC_collect_async
+*  ---------------------------------------------------------------------
+*  Description:
+*    Requests a full collection from the collector thread and returns
+*    without waiting for it. All the registered threads are stopped
+*    while their stacks are scanned, the calling thread doesn't need
+*    to be registered. The requests made before the collection starts
+*    share it. Returns the ticket of the collection */
+GC_ticket_t GC_collect_async();
+
+/* ---------------------------------------------------------------------
+*  GC_wait
+*  ---------------------------------------------------------------------
+*  Description:
+*    Waits until the collection of a ticket is completed, or any later
+*    one. The registered threads can still be stopped while they wait
+*  Parameters:
+*    ticket ---> A ticket returned by GC_collect_async */
+void GC_wait(GC_ticket_t ticket);
+
+/* ---------------------------------------------------------------------
+*  GC_poll
+*  ---------------------------------------------------------------------
+*  Description:
+*    Returns TRUE if the collection of a ticket is completed, without
+*    waiting for it
+*  Parameters:
+*    ticket ---> A ticket returned by GC_collect_async */
+bool_t GC_poll(GC_ticket_t ticket);
+
+/* ---------------------------------------------------------------------
+*  GC_collection_callback_t
+*  ---------------------------------------------------------------------
+*  Description:
+*    A function called at the end of each collection, with its ticket */
+typedef void (*GC_collection_callback_t)(GC_ticket_t ticket);
+
+/* ---------------------------------------------------------------------
+*  GC_set_collection_callback
+*  ---------------------------------------------------------------------
+*  Description:
+*    Sets the function called when a collection is completed, NULL to
+*    remove it. It runs on the collector thread after the program is
+*    resumed, that isn't registered: it must not allocate from the GC
+*    or start a collection but it can call GC_collect_async, and the
+*    next collection waits for it to return
+*  Parameters:
+*    callback ---> The function to call, or NULL */
+void GC_set_collection_callback(GC_collection_callback_t callback);
+
 /* ---------------------------------------------------------------------
 *  GC_free
 *  ---------------------------------------------------------------------
@@ -63,4 +218,352 @@ void GC_collect();
 *    pointer ---> The pointer to the first block of the memory area to free */
 void GC_free(void* pointer);
 
+/* ---------------------------------------------------------------------
+*  GC_free_many
+*  ---------------------------------------------------------------------
+*  Description:
+*    Manually frees several blocks of allocated memory, taking the lock
+*    only once. The pointers that don't reference a block allocated by
+*    the GC are ignored, like the NULL ones
+*  Parameters:
+*    blocks ---> The pointers to the first byte of the blocks to free
+*    count ---> The number of pointers in the array */
+void GC_free_many(void** blocks, size_t count);
+
+/* ---------------------------------------------------------------------
+*  GC_register_thread
+*  ---------------------------------------------------------------------
+*  Description:
+*    Registers the calling thread, so that its stack and its registers
+*    are scanned by the collections. The thread that calls GC_init is
+*    registered automatically, all the other threads must call this
+*    function before using the GC and GC_unregister_thread before they
+*    exit. Each registered thread allocates the small blocks from its
+*    own cache, without taking the lock. Returns FALSE on failure */
+bool_t GC_register_thread();
+
+/* ---------------------------------------------------------------------
+*  GC_unregister_thread
+*  ---------------------------------------------------------------------
+*  Description:
+*    Removes the calling thread from the threads scanned by the GC, the
+*    pointers it still holds no longer keep their blocks alive */
+void GC_unregister_thread();
+
+/* ---------------------------------------------------------------------
+*  GC_add_roots
+*  ---------------------------------------------------------------------
+*  Description:
+*    Adds a memory area that isn't managed by the GC to the roots, so
+*    that the blocks it references are kept alive. The global variables
+*    are already scanned on Linux, Windows and macOS, this is needed for
+*    the memory allocated with malloc or mapped by hand. Returns FALSE
+*    if the area couldn't be stored
+*  Parameters:
+*    start ---> The first address of the area
+*    end ---> The address past the end of the area */
+bool_t GC_add_roots(void* start, void* end);
+
+/* ---------------------------------------------------------------------
+*  GC_remove_roots
+*  ---------------------------------------------------------------------
+*  Description:
+*    Removes all the areas added with GC_add_roots that are entirely
+*    inside the given range
+*  Parameters:
+*    start ---> The first address of the range
+*    end ---> The address past the end of the range */
+void GC_remove_roots(void* start, void* end);
+
+/* ---------------------------------------------------------------------
+*  GC_set_precise_roots
+*  ---------------------------------------------------------------------
+*  Description:
+*    Enables or disables the precise roots. When enabled, the stacks
+*    and the registers of the threads are no longer scanned: only the
+*    variables pushed with GC_PUSH_ROOT keep their blocks alive, so the
+*    cost of the roots depends on their number and not on the depth of
+*    the stacks. The global variables are still scanned
+*  Parameters:
+*    enabled ---> TRUE to only scan the pushed roots, FALSE otherwise */
+void GC_set_precise_roots(bool_t enabled);
+
+/* ---------------------------------------------------------------------
+*  GC_push_root
+*  ---------------------------------------------------------------------
+*  Description:
+*    Pushes the address of a variable that holds a GC pointer on the
+*    shadow stack of the calling thread, its current value is read by
+*    each collection. Each thread can push up to 65536 roots
+*  Parameters:
+*    slot ---> The address of the variable */
+void GC_push_root(void* slot);
+
+/* ---------------------------------------------------------------------
+*  GC_pop_roots
+*  ---------------------------------------------------------------------
+*  Description:
+*    Removes the last roots pushed by the calling thread, the variables
+*    must be popped before they go out of scope
+*  Parameters:
+*    count ---> The number of roots to remove */
+void GC_pop_roots(unsigned int count);
+
+// Pushes a local variable on the shadow stack
+#define GC_PUSH_ROOT(variable) GC_push_root((void*)&(variable))
+
+/* ---------------------------------------------------------------------
+*  GC_set_interior_pointers
+*  ---------------------------------------------------------------------
+*  Description:
+*    Enables or disables the recognition of interior pointers. When
+*    enabled, an address anywhere inside an allocated block keeps the
+*    whole block alive, otherwise only its first address does. It is
+*    disabled by default
+*  Parameters:
+*    enabled ---> TRUE to recognize interior pointers, FALSE otherwise */
+void GC_set_interior_pointers(bool_t enabled);
+
+/* ---------------------------------------------------------------------
+*  GC_set_misaligned_pointers
+*  ---------------------------------------------------------------------
+*  Description:
+*    Enables or disables the misaligned pointers. By default the stacks
+*    and the blocks are only scanned at the addresses aligned to the
+*    pointer size, enable it if the program stores the only pointer to
+*    a block in a packed structure. The scans get several times slower
+*  Parameters:
+*    enabled ---> TRUE to look for pointers at every byte */
+void GC_set_misaligned_pointers(bool_t enabled);
+
+/* ---------------------------------------------------------------------
+*  GC_set_marker_threads
+*  ---------------------------------------------------------------------
+*  Description:
+*    Sets the number of threads that mark the heap during a collection.
+*    The root ranges are split among them and each one steals pending
+*    blocks from the others when it runs out of work. It is 1 by
+*    default, and it can only be 1 when threads aren't available.
+*    Returns FALSE if the count isn't valid
+*  Parameters:
+*    count ---> The number of marking threads, between 1 and 64 */
+bool_t GC_set_marker_threads(unsigned int count);
+
+/* ---------------------------------------------------------------------
+*  GC_set_concurrent
+*  ---------------------------------------------------------------------
+*  Description:
+*    Enables or disables the concurrent collections. When enabled,
+*    GC_collect only flips the marks and returns, a background thread
+*    marks the heap while the program runs and the cycle is completed
+*    with a short pause by the next allocation or GC_collect call.
+*    All the pointers stored into the GC memory must then go through
+*    GC_WRITE or GC_write_barrier. Returns FALSE if threads aren't
+*    available or if the generational collections or the compaction
+*    are enabled
+*  Parameters:
+*    enabled ---> TRUE to mark the heap concurrently, FALSE otherwise */
+bool_t GC_set_concurrent(bool_t enabled);
+
+/* ---------------------------------------------------------------------
+*  GC_write_barrier
+*  ---------------------------------------------------------------------
+*  Description:
+*    Notifies the GC that a pointer was stored at the given address,
+*    it is a no-op unless a concurrent marking is running or the
+*    generational collections are enabled
+*  Parameters:
+*    slot ---> The address that was written */
+void GC_write_barrier(void* slot);
+
+/* ---------------------------------------------------------------------
+*  GC_set_generational
+*  ---------------------------------------------------------------------
+*  Description:
+*    Enables or disables the generational collections. When enabled,
+*    the new blocks form a nursery and GC_collect only marks the young
+*    blocks reached from the stack or from the old blocks written since
+*    the previous collection, the survivors are promoted to the old
+*    ones. Every 8 minor collections a full one is done instead. All the
+*    pointers stored into the GC memory must go through GC_WRITE or
+*    GC_write_barrier. Returns FALSE if the concurrent collections or
+*    the compaction are enabled, the modes can't be used together
+*  Parameters:
+*    enabled ---> TRUE to collect the young blocks separately, FALSE otherwise */
+bool_t GC_set_generational(bool_t enabled);
+
+// Stores a value and notifies the write barrier
+#define GC_WRITE(slot, value) (*(slot) = (value), GC_write_barrier((void*)(slot)))
+
+/* ---------------------------------------------------------------------
+*  GC_set_compaction
+*  ---------------------------------------------------------------------
+*  Description:
+*    Enables or disables the compaction done by the full collections.
+*    The heap pages reached by a conservative scan (the stacks, the
+*    registers, the data segments and the blocks that aren't typed) are
+*    pinned, the blocks of the other pages that are less than half full
+*    are reached only through the pointer words of typed blocks: they
+*    are moved into the other pages of their size class and those
+*    pointers are updated, so the sparse pages can be reused. Pointers
+*    to GC blocks must never be hidden into the words that a descriptor
+*    doesn't mark as pointers. Returns FALSE if the concurrent or the
+*    generational collections are enabled
+*  Parameters:
+*    enabled ---> TRUE to move the blocks of the sparse pages, FALSE otherwise */
+bool_t GC_set_compaction(bool_t enabled);
+
+/* ---------------------------------------------------------------------
+*  GC_set_heap_growth
+*  ---------------------------------------------------------------------
+*  Description:
+*    Sets how much the heap can grow before a collection is started by
+*    the allocations, like GOGC: a collection runs once the bytes
+*    allocated since the previous one reach the given percentage of the
+*    live memory it found, with a minimum of 4MB. The default is 100.
+*    Only the registered threads start the collections
+*  Parameters:
+*    percent ---> The allowed growth in percent, or a negative value to
+*                 only collect when the memory limit is reached */
+void GC_set_heap_growth(int percent);
+
+/* ---------------------------------------------------------------------
+*  GC_set_memory_limit
+*  ---------------------------------------------------------------------
+*  Description:
+*    Sets a soft limit on the memory of the GC: the collections get
+*    more frequent as the live memory gets closer to it, regardless of
+*    the heap growth. It defaults to the memory.max value of the cgroup
+*    v2 of the process, when there is one. When the memory can't be
+*    reserved, the allocations always run a full collection and retry
+*  Parameters:
+*    bytes ---> The limit in bytes, 0 to remove it */
+void GC_set_memory_limit(size_t bytes);
+
+/* ---------------------------------------------------------------------
+*  GC_set_page_decay
+*  ---------------------------------------------------------------------
+*  Description:
+*    Sets how long the heap pages left empty by a sweep stay resident
+*    before their memory is returned to the OS, so that a heap that
+*    shrinks and grows back doesn't keep releasing and faulting in the
+*    same pages. The large blocks of 128KB and more are always returned
+*    as soon as they are released. The default is one second
+*  Parameters:
+*    milliseconds ---> The decay time, 0 to return the pages right after
+*                      the sweep, negative to only return them in GC_trim */
+void GC_set_page_decay(int milliseconds);
+
+/* ---------------------------------------------------------------------
+*  GC_trim
+*  ---------------------------------------------------------------------
+*  Description:
+*    Finishes the pending sweep and returns the memory of all the empty
+*    heap pages to the OS right away, together with the free memory of
+*    the libc allocator when it supports it. It doesn't collect: call
+*    GC_collect first to release the unreachable blocks too */
+void GC_trim();
+
+/* ---------------------------------------------------------------------
+*  GC_stats_s
+*  ---------------------------------------------------------------------
+*  Description:
+*    The statistics of the collections. The times are in nanoseconds,
+*    the last cycle is the latest collection that was started. The
+*    freed blocks and the sweep time of the last cycle grow while its
+*    sweep is still running in the background
+*  Fields:
+*    collections ---> The number of collections, minor ones included
+*    minor_collections ---> The number of minor generational collections
+*    last_pause_time ---> The time the program was paused by the last cycle
+*    last_roots_time ---> The part of the pause spent gathering the roots
+*                         and stopping the threads
+*    last_mark_time ---> The time spent marking, including the marking done
+*                        concurrently with the program
+*    last_sweep_time ---> The time spent sweeping the garbage of the last cycle
+*    total_pause_time ---> The sum of all the pause times
+*    total_roots_time ---> The sum of all the roots times
+*    total_mark_time ---> The sum of all the mark times
+*    total_sweep_time ---> The sum of all the sweep times
+*    live_bytes ---> The memory found reachable by the last marking
+*    live_blocks ---> The number of blocks found reachable by the last marking
+*    last_freed_bytes ---> The memory released by the sweep of the last cycle
+*    last_freed_blocks ---> The number of blocks released by the last sweep
+*    total_freed_bytes ---> The memory released by all the sweeps
+*    total_freed_blocks ---> The number of blocks released by all the sweeps
+*    total_allocated_bytes ---> The memory allocated since the GC was initialized
+*    last_moved_bytes ---> The memory moved by the compaction of the last cycle
+*    total_moved_bytes ---> The memory moved by all the compactions
+*    total_decommitted_bytes ---> The memory of the empty heap pages returned to the OS
+*    scanned_candidates ---> The words read as candidate pointers by all the markings
+*    candidate_hits ---> The candidates that fell into the GC memory and had
+*                        to be looked up, the others were rejected at once
+*    blacklisted_pages ---> The heap pages hit by false pointers during the
+*                           last marking, the blocks that may hold pointers
+*                           and the large ones are placed elsewhere
+*    large_blocks ---> The number of blocks in the hash map of the large blocks
+*    large_blocks_load_factor ---> The ratio of used slots in that hash map
+*    large_blocks_rehashes ---> The number of times that hash map was resized */
+struct GC_stats_s
+{
+	size_t collections;
+	size_t minor_collections;
+	uint64_t last_pause_time;
+	uint64_t last_roots_time;
+	uint64_t last_mark_time;
+	uint64_t last_sweep_time;
+	uint64_t total_pause_time;
+	uint64_t total_roots_time;
+	uint64_t total_mark_time;
+	uint64_t total_sweep_time;
+	size_t live_bytes;
+	size_t live_blocks;
+	size_t last_freed_bytes;
+	size_t last_freed_blocks;
+	size_t total_freed_bytes;
+	size_t total_freed_blocks;
+	size_t total_allocated_bytes;
+	size_t last_moved_bytes;
+	size_t total_moved_bytes;
+	size_t total_decommitted_bytes;
+	uint64_t scanned_candidates;
+	uint64_t candidate_hits;
+	size_t blacklisted_pages;
+	size_t large_blocks;
+	double large_blocks_load_factor;
+	size_t large_blocks_rehashes;
+};
+
+/* ---------------------------------------------------------------------
+*  GC_get_stats
+*  ---------------------------------------------------------------------
+*  Description:
+*    Returns the statistics of the collections. The counters are always
+*    updated, reading them only takes the lock of the GC */
+struct GC_stats_s GC_get_stats();
+
+/* ---------------------------------------------------------------------
+*  GC_root_visitor_t
+*  ---------------------------------------------------------------------
+*  Description:
+*    A function that receives a root range and the memory it keeps
+*    alive, see GC_report_roots */
+typedef void (*GC_root_visitor_t)(void* start, void* end, size_t bytes);
+
+/* ---------------------------------------------------------------------
+*  GC_report_roots
+*  ---------------------------------------------------------------------
+*  Description:
+*    Runs a full collection that marks from one root range at a time,
+*    then calls a function for each range with the bytes it keeps alive:
+*    the data segments and the areas added with GC_add_roots first, then
+*    the stack, the saved registers and the allocation cache of each
+*    registered thread. The memory reachable from several ranges is
+*    counted for the first one. The marking is much slower than the one
+*    of GC_collect, use it to find the roots that retain too much memory.
+*    The calling thread must be registered
+*  Parameters:
+*    visitor ---> The function to call, after the program is resumed */
+void GC_report_roots(GC_root_visitor_t visitor);
+
 #endif
\ No newline at end of file
@@ -0,0 +1,68 @@
+#include <string.h>
+#include "../../Misc/GC_definitions.h"
+#include "../../Misc/GC_atomic.h"
+#include "heap.h"
+#include "blacklist.h"
+
+/* =========== Local constants ===========*/
+
+// Number of pages remembered by each generation of the blacklist, a power of two. The table is
+// direct-mapped, a page that collides with another one replaces it and is just not avoided
+#define BLACKLIST_ENTRIES 4096
+
+/* =========== Global variables ===========*/
+
+// The pages found by the running or last marking and by the one before it, stored by their index:
+// the data segment is scanned too, so the tables can't hold addresses of the heap themselves.
+// The index of the current generation only changes while nobody marks
+static uintptr_t blacklists[2][BLACKLIST_ENTRIES];
+static unsigned int current = 0;
+
+/* ============================================================================
+*  Blacklist functions
+*  ========================================================================= */
+
+// Returns the slot of a page in the tables
+static inline size_t page_slot(uintptr_t page)
+{
+	return (size_t)((page ^ (page >> 12)) & (BLACKLIST_ENTRIES - 1));
+}
+
+// Adds the page of a false pointer to the current generation
+void blacklist_add(void* address)
+{
+	uintptr_t page = (uintptr_t)address >> HEAP_PAGE_SHIFT;
+	uintptr_t* slot = blacklists[current] + page_slot(page);
+	if (ATOMIC_LOAD(slot) != page) ATOMIC_STORE(slot, page);
+}
+
+// Forgets the oldest generation and starts filling it again
+void blacklist_rotate()
+{
+	current ^= 1;
+	memset(blacklists[current], 0, sizeof(blacklists[current]));
+}
+
+// Checks both generations for each page of the range
+bool_t blacklist_contains(void* start, size_t size)
+{
+	uintptr_t page = (uintptr_t)start >> HEAP_PAGE_SHIFT;
+	uintptr_t last = ((uintptr_t)start + size - 1) >> HEAP_PAGE_SHIFT;
+	for (; page <= last; page++)
+	{
+		size_t slot = page_slot(page);
+		if (ATOMIC_LOAD(blacklists[0] + slot) == page || ATOMIC_LOAD(blacklists[1] + slot) == page) return TRUE;
+	}
+	return FALSE;
+}
+
+// Counts the used slots of the current generation
+size_t blacklist_count()
+{
+	size_t count = 0, i;
+	for (i = 0; i < BLACKLIST_ENTRIES; i++)
+	{
+		if (blacklists[current][i] != 0) count++;
+	}
+	return count;
+}
@@ -0,0 +1,46 @@
+#ifndef BLACKLIST_H
+#define BLACKLIST_H
+
+#include <stdint.h>
+#include "../../Misc/GC_definitions.h"
+
+/* ---------------------------------------------------------------------
+*  blacklist_add
+*  ---------------------------------------------------------------------
+*  Description:
+*    Remembers the heap page of a word found by a conservative scan that
+*    points into the range of the GC memory but not to an allocated
+*    block: a block placed there later would be kept alive by it. It
+*    doesn't need the lock, the marking threads call it concurrently
+*  Parameters:
+*    address ---> The value of the false pointer */
+void blacklist_add(void* address);
+
+/* ---------------------------------------------------------------------
+*  blacklist_rotate
+*  ---------------------------------------------------------------------
+*  Description:
+*    Called at the start of each full marking: the pages found by the
+*    previous marking are kept until the end of this one, the older
+*    ones are forgotten. The marking threads must not be running */
+void blacklist_rotate();
+
+/* ---------------------------------------------------------------------
+*  blacklist_contains
+*  ---------------------------------------------------------------------
+*  Description:
+*    Returns TRUE if a false pointer was found by one of the last two
+*    markings in any heap page of an address range
+*  Parameters:
+*    start ---> The first address of the range
+*    size ---> The size of the range in bytes */
+bool_t blacklist_contains(void* start, size_t size);
+
+/* ---------------------------------------------------------------------
+*  blacklist_count
+*  ---------------------------------------------------------------------
+*  Description:
+*    Returns the number of pages blacklisted by the last marking */
+size_t blacklist_count();
+
+#endif
@@ -0,0 +1,877 @@
+#include <limits.h>
+#include <stdint.h>
+#include <string.h>
+#include "../../Misc/GC_definitions.h"
+#include "../../Misc/GC_atomic.h"
+#include "../MemoryHelper/memory_helper.h"
+#include "page_map.h"
+#include "blacklist.h"
+#include "heap.h"
+
+/* =========== Local constants ===========*/
+
+#define MIN_BLOCK_SIZE 16
+#define MAX_BLOCKS_PER_PAGE (HEAP_PAGE_SIZE / MIN_BLOCK_SIZE)
+#define WORD_BITS (sizeof(uintptr_t) * 8)
+#define BITMAP_WORDS (MAX_BLOCKS_PER_PAGE / WORD_BITS)
+#define SIZE_CLASSES_COUNT HEAP_SIZE_CLASSES
+#define ARENA_PAGES 64
+#define ARENA_SIZE (ARENA_PAGES * HEAP_PAGE_SIZE)
+
+// The metadata of the heap is reserved from the OS in whole granules, without the libc allocator
+#define ROUND_TO_GRANULE(size) (((size) + PAGE_MAP_GRANULE - 1) & ~(PAGE_MAP_GRANULE - 1))
+#define FORWARDING_BYTES(page) ROUND_TO_GRANULE((page)->block_count * sizeof(void*))
+
+// A page is evacuated when less than 1 / EVACUATION_RATIO of its blocks are marked
+#define EVACUATION_RATIO 2
+
+/* =========== Types used in the file ===========*/
+
+/* ---------------------------------------------------------------------
+*  heap_page_s
+*  ---------------------------------------------------------------------
+*  Description:
+*    The header of a heap page, it holds the metadata of all its blocks
+*  Fields:
+*    start ---> The first address of the page
+*    block_size ---> The size of the blocks in the page, 0 if the page is empty
+*    size_class ---> The index of the size class of the page
+*    kind ---> The kind of the blocks of the page
+*    reciprocal ---> 2^32 / block_size rounded up, to replace the divisions
+*    block_count ---> The number of blocks that fit into the page
+*    word_count ---> The number of bitmap words used by the blocks of the page
+*    used_count ---> The number of currently allocated blocks
+*    cursor ---> The first bitmap word that may still have a free block
+*    next_available ---> The next page of the same size class with free blocks
+*    next_in_class ---> The next page in the swept or unswept list of the size class,
+*                       or in the empty pages
+*    available ---> Indicates whether the page is in the available list
+*    swept ---> Indicates whether the page was swept since the last collection
+*    pinned ---> Set if a conservative scan reached one of its blocks, so they can't move
+*    decommitted ---> Set if the page is empty and its memory was returned to the OS
+*    empty_since ---> The time when the page was released, if it is empty
+*    forwarding ---> The new addresses of the blocks of an evacuated page, NULL otherwise
+*    allocated_bits ---> One bit per block, set if the block is allocated.
+*                        The bits past the last block are always set
+*    mark_bits ---> One bit per block, the block is marked if its bit
+*                   matches the current mark colour */
+struct heap_page_s
+{
+	char* start;
+	size_t block_size;
+	unsigned int size_class;
+	unsigned int kind;
+	uint64_t reciprocal;
+	unsigned int block_count;
+	unsigned int word_count;
+	unsigned int used_count;
+	unsigned int cursor;
+	struct heap_page_s* next_available;
+	struct heap_page_s* next_in_class;
+	bool_t available;
+	bool_t swept;
+	bool_t pinned;
+	bool_t decommitted;
+	uint64_t empty_since;
+	void** forwarding;
+	uintptr_t allocated_bits[BITMAP_WORDS];
+	uintptr_t mark_bits[BITMAP_WORDS];
+};
+
+// A contiguous area reserved from the OS and split into heap pages, with the headers of its pages
+struct heap_arena_s
+{
+	char* start;
+	unsigned int used_pages;
+	struct heap_page_s pages[ARENA_PAGES];
+};
+
+typedef struct heap_arena_s* heap_arena_t;
+
+// A size class, with the list of its pages that still have free blocks and the lists
+// of its pages that were already swept after the last collection and of those that weren't
+struct size_class_s
+{
+	size_t block_size;
+	heap_page_t available;
+	heap_page_t swept;
+	heap_page_t unswept;
+};
+
+/* =========== Global variables ===========*/
+
+static struct size_class_s size_classes[SIZE_CLASSES_COUNT];
+static unsigned char class_lookup[(HEAP_MAX_SMALL_SIZE / MIN_BLOCK_SIZE) + 1];
+
+// All the arenas reserved so far, the page map resolves the addresses
+static heap_arena_t* arenas = NULL;
+static int arenas_count = 0;
+static int arenas_capacity = 0;
+
+// The value of the mark bits of the marked blocks, either all zeros or all ones.
+// Flipping it turns all the marked blocks into unmarked ones
+static uintptr_t mark_colour = 0;
+
+// Whether the new blocks are allocated unmarked, so that the minor collections can find them
+static bool_t young_allocations = FALSE;
+
+// The counters read by the collection pacing and by the statistics
+static struct heap_counters_s counters = { 0, 0, 0, 0, 0, 0 };
+
+// Whether the marking pins the pages reached by conservative scans, and the pages being evacuated
+static bool_t pinning = FALSE;
+static heap_page_t evacuated_pages = NULL;
+
+// Pages released by the sweep that can be reused by any size class. The sweep may run
+// while the other threads are stopped, so the list doesn't need the allocator. The pages
+// are pushed at the head, so the ones that stayed empty for the longest time are at the end
+static heap_page_t empty_pages = NULL;
+
+/* ============================================================================
+*  Pages management
+*  ========================================================================= */
+
+// Builds the size classes: 16 bytes steps up to 128, then four classes per power of two.
+// The classes of the other kinds have the same sizes and follow the scanned ones
+void heap_init()
+{
+	size_t size, step = MIN_BLOCK_SIZE;
+	int count = 0, i;
+	for (size = MIN_BLOCK_SIZE; size <= HEAP_MAX_SMALL_SIZE; size += step)
+	{
+		for (i = 0; i < SIZE_CLASSES_COUNT; i += HEAP_BLOCK_SIZES)
+		{
+			size_classes[count + i].block_size = size;
+			size_classes[count + i].available = NULL;
+			size_classes[count + i].swept = NULL;
+			size_classes[count + i].unswept = NULL;
+		}
+		count++;
+		if (size >= 128 && (size & (size - 1)) == 0) step = size / 4;
+	}
+
+	// Map each 16 bytes step to the smallest class that can hold it
+	int current = 0;
+	for (i = 0; i <= HEAP_MAX_SMALL_SIZE / MIN_BLOCK_SIZE; i++)
+	{
+		while (size_classes[current].block_size < (size_t)i * MIN_BLOCK_SIZE) current++;
+		class_lookup[i] = (unsigned char)current;
+	}
+}
+
+// Returns the page that contains the given address, if any
+static inline heap_page_t find_page(void* address)
+{
+	uintptr_t owner = page_map_get(address);
+	return (owner & PAGE_MAP_LARGE_BLOCK) ? NULL : (heap_page_t)owner;
+}
+
+// Reserves a new arena from the OS and adds it to the arenas array. The headers and the array are
+// reserved from the OS too, as the compaction allocates pages while the other threads are stopped
+static heap_arena_t create_arena()
+{
+	char* memory = (char*)reserve_aligned_pages(ARENA_SIZE, HEAP_PAGE_SIZE);
+	if (memory == NULL) return NULL;
+
+	// The false pointers into the pages that aren't used yet must reach the blacklist
+	page_map_extend_bounds(memory, ARENA_SIZE);
+	heap_arena_t arena = (heap_arena_t)reserve_aligned_pages(ROUND_TO_GRANULE(sizeof(struct heap_arena_s)), PAGE_MAP_GRANULE);
+	if (arena == NULL)
+	{
+		release_pages(memory, ARENA_SIZE);
+		return NULL;
+	}
+	arena->start = memory;
+	arena->used_pages = 0;
+
+	// Grow the arenas array if needed
+	if (arenas_count == arenas_capacity)
+	{
+		int capacity = arenas_capacity == 0 ? (int)(PAGE_MAP_GRANULE / sizeof(heap_arena_t)) : arenas_capacity * 2;
+		heap_arena_t* resized = (heap_arena_t*)reserve_aligned_pages(capacity * sizeof(heap_arena_t), PAGE_MAP_GRANULE);
+		if (resized == NULL)
+		{
+			release_pages(memory, ARENA_SIZE);
+			release_pages(arena, ROUND_TO_GRANULE(sizeof(struct heap_arena_s)));
+			return NULL;
+		}
+		if (arenas != NULL)
+		{
+			memcpy(resized, arenas, arenas_count * sizeof(heap_arena_t));
+			release_pages(arenas, arenas_capacity * sizeof(heap_arena_t));
+		}
+		arenas = resized;
+		arenas_capacity = capacity;
+	}
+	arenas[arenas_count++] = arena;
+	return arena;
+}
+
+// Carves a new page from the last arena, or from a new one if it is full
+static heap_page_t carve_page()
+{
+	static heap_arena_t current_arena = NULL;
+	if (current_arena == NULL || current_arena->used_pages == ARENA_PAGES)
+	{
+		current_arena = create_arena();
+		if (current_arena == NULL) return NULL;
+	}
+	heap_page_t page = current_arena->pages + current_arena->used_pages;
+	page->start = current_arena->start + current_arena->used_pages * HEAP_PAGE_SIZE;
+	page->block_size = 0;
+	page->pinned = FALSE;
+	page->decommitted = FALSE;
+	page->forwarding = NULL;
+
+	// All the granules of the page resolve to its header
+	if (!page_map_set(page->start, HEAP_PAGE_SIZE, (uintptr_t)page))
+	{
+		// Some granules may already point to the header
+		page_map_set(page->start, HEAP_PAGE_SIZE, 0);
+		return NULL;
+	}
+	current_arena->used_pages++;
+	return page;
+}
+
+// Removes a page from the list of the empty pages, given the link that points to it
+static heap_page_t take_empty_page(heap_page_t* link)
+{
+	heap_page_t empty = *link;
+	if (empty->decommitted && !recommit_pages(empty->start, HEAP_PAGE_SIZE)) return NULL;
+	empty->decommitted = FALSE;
+	*link = empty->next_in_class;
+	return empty;
+}
+
+// Stores a page that no longer holds allocated blocks, so that any size class can reuse it
+static void release_empty_page(heap_page_t page)
+{
+	page->block_size = 0;
+	page->empty_since = get_nanoseconds();
+	page->next_in_class = empty_pages;
+	empty_pages = page;
+}
+
+// Returns an empty page for a kind of blocks, reusing a released one or carving a new one. The
+// blacklisted pages are left to the pointer-free blocks, which can't keep anything else alive,
+// and the other kinds only take them when no other memory is available
+static heap_page_t get_empty_page(unsigned int kind)
+{
+	bool_t avoid = kind != HEAP_POINTER_FREE;
+	heap_page_t* link = &empty_pages;
+	while (*link != NULL && avoid && blacklist_contains((*link)->start, HEAP_PAGE_SIZE))
+	{
+		link = &(*link)->next_in_class;
+	}
+	if (*link != NULL) return take_empty_page(link);
+	for (;;)
+	{
+		heap_page_t page = carve_page();
+		if (page == NULL) break;
+		if (!avoid || !blacklist_contains(page->start, HEAP_PAGE_SIZE)) return page;
+		release_empty_page(page);
+	}
+	return empty_pages == NULL ? NULL : take_empty_page(&empty_pages);
+}
+
+// Formats an empty page for the given size class
+static void format_page(heap_page_t page, unsigned int size_class)
+{
+	size_t block_size = size_classes[size_class].block_size;
+	page->block_size = block_size;
+	page->size_class = size_class;
+	page->kind = size_class / HEAP_BLOCK_SIZES;
+	page->block_count = (unsigned int)(HEAP_PAGE_SIZE / block_size);
+	page->reciprocal = (((uint64_t)1 << 32) + block_size - 1) / block_size;
+	page->word_count = (unsigned int)((page->block_count + WORD_BITS - 1) / WORD_BITS);
+	page->used_count = 0;
+	page->cursor = 0;
+	page->next_available = NULL;
+	page->available = FALSE;
+	page->swept = TRUE;
+	memset(page->allocated_bits, 0, page->word_count * sizeof(uintptr_t));
+
+	// Mark the bits past the last block as allocated, so that they are never handed out
+	unsigned int tail = page->block_count % WORD_BITS;
+	if (tail != 0) page->allocated_bits[page->word_count - 1] = ~(uintptr_t)0 << tail;
+
+	// The typed blocks end with their descriptor, a page reused from another kind must not leave garbage there
+	if (page->kind == HEAP_TYPED)
+	{
+		unsigned int i;
+		for (i = 0; i < page->block_count; i++)
+		{
+			*(void**)(page->start + (i + 1) * block_size - sizeof(void*)) = NULL;
+		}
+	}
+}
+
+// Returns the mask of the bits in a bitmap word that refer to existing blocks
+static inline uintptr_t blocks_mask(heap_page_t page, unsigned int word)
+{
+	unsigned int tail = page->block_count % WORD_BITS;
+	return (word != page->word_count - 1 || tail == 0) ? ~(uintptr_t)0 : ~(~(uintptr_t)0 << tail);
+}
+
+// Sets the mark bit of a block to the given colour
+static inline void set_mark_bit(heap_page_t page, unsigned int index, uintptr_t colour)
+{
+	// The concurrent marker may be setting other bits of the same word
+	uintptr_t bit = (uintptr_t)1 << (index % WORD_BITS);
+	if (colour) ATOMIC_FETCH_OR(&page->mark_bits[index / WORD_BITS], bit);
+	else ATOMIC_FETCH_AND(&page->mark_bits[index / WORD_BITS], ~bit);
+}
+
+// Returns the index of the block that contains the given address, the multiplication
+// is exact because both the offset and the block size are lower than 2^16
+static inline unsigned int block_index(heap_page_t page, char* address)
+{
+	return (unsigned int)(((uint64_t)(address - page->start) * page->reciprocal) >> 32);
+}
+
+// Releases the unmarked blocks of a page, then moves it to the swept list of its size class
+// and to the available one if it has free blocks, or to the empty pages if it has none left
+static void sweep_page(heap_page_t page)
+{
+	// A whole word of blocks is released at once: the allocated ones whose bit differs from the colour
+	uint64_t start = get_nanoseconds();
+	unsigned int w;
+	for (w = 0; w < page->word_count; w++)
+	{
+		uintptr_t garbage = page->allocated_bits[w] & (page->mark_bits[w] ^ mark_colour) & blocks_mask(page, w);
+		if (garbage == 0) continue;
+		page->allocated_bits[w] &= ~garbage;
+		unsigned int released = count_set_bits(garbage);
+		page->used_count -= released;
+		counters.freed_blocks += released;
+		counters.freed_bytes += released * page->block_size;
+	}
+	page->cursor = 0;
+	page->swept = TRUE;
+	counters.sweep_time += get_nanoseconds() - start;
+	struct size_class_s* size_class = size_classes + page->size_class;
+	if (page->used_count == 0) release_empty_page(page);
+	if (page->block_size == 0) return;
+	page->next_in_class = size_class->swept;
+	size_class->swept = page;
+	if (page->used_count < page->block_count && !page->available)
+	{
+		page->next_available = size_class->available;
+		size_class->available = page;
+		page->available = TRUE;
+	}
+}
+
+/* ============================================================================
+*  Allocation functions
+*  ========================================================================= */
+
+// Takes up to count blocks from the given size class, all the free blocks of a word of the
+// allocation bitmap are taken at once. Returns the number of blocks taken
+static size_t allocate_blocks(unsigned int class_index, void** blocks, size_t count)
+{
+	struct size_class_s* size_class = size_classes + class_index;
+	size_t taken = 0;
+	while (taken < count)
+	{
+		// Sweep the pages of the class left by the last collection until one has a free block
+		while (size_class->available == NULL && size_class->unswept != NULL)
+		{
+			heap_page_t unswept = size_class->unswept;
+			size_class->unswept = unswept->next_in_class;
+			sweep_page(unswept);
+		}
+		heap_page_t page = size_class->available;
+		if (page == NULL)
+		{
+			page = get_empty_page(class_index / HEAP_BLOCK_SIZES);
+			if (page == NULL) break;
+			format_page(page, class_index);
+			page->next_in_class = size_class->swept;
+			size_class->swept = page;
+			page->available = TRUE;
+			size_class->available = page;
+		}
+
+		// Take the free blocks of the first word that has any, the cursor skips the words that are known to be full
+		uintptr_t free_bits = ~page->allocated_bits[page->cursor];
+		while (free_bits == 0)
+		{
+			free_bits = ~page->allocated_bits[++page->cursor];
+		}
+		do
+		{
+			uintptr_t bit = free_bits & (~free_bits + 1);
+			unsigned int index = page->cursor * WORD_BITS + count_trailing_zeros(free_bits);
+			page->allocated_bits[page->cursor] |= bit;
+			free_bits ^= bit;
+
+			// The new block must look unmarked to the next collection. The young blocks
+			// are unmarked right away, as the minor collections don't flip the colour
+			set_mark_bit(page, index, young_allocations ? ~mark_colour : mark_colour);
+			blocks[taken++] = page->start + index * page->block_size;
+			page->used_count++;
+		} while (free_bits != 0 && taken < count);
+
+		// Remove the page from the available list when it gets full
+		if (page->used_count == page->block_count)
+		{
+			size_class->available = page->next_available;
+			page->next_available = NULL;
+			page->available = FALSE;
+		}
+	}
+	return taken;
+}
+
+// Allocates a block from the given size class
+static void* allocate_block(unsigned int class_index)
+{
+	void* block;
+	return allocate_blocks(class_index, &block, 1) == 1 ? block : NULL;
+}
+
+// Allocates a block from the size class that fits the requested size
+void* heap_alloc(size_t size, unsigned int kind)
+{
+	size_t block_size;
+	void* block = allocate_block(heap_size_class(size, kind, &block_size));
+	if (block != NULL) counters.allocated_bytes += block_size;
+	return block;
+}
+
+// Allocates several blocks from the size class that fits the requested size
+size_t heap_alloc_many(size_t size, unsigned int kind, void** blocks, size_t count)
+{
+	size_t block_size;
+	size_t taken = allocate_blocks(heap_size_class(size, kind, &block_size), blocks, count);
+	counters.allocated_bytes += taken * block_size;
+	return taken;
+}
+
+// Returns the page of an allocated block and its index, if the address is the start of one
+static heap_page_t find_allocated_block(void* pointer, unsigned int* index)
+{
+	heap_page_t page = find_page(pointer);
+	if (page == NULL || page->block_size == 0) return NULL;
+	*index = block_index(page, (char*)pointer);
+	if (*index >= page->block_count || page->start + *index * page->block_size != (char*)pointer) return NULL;
+	if (!(page->allocated_bits[*index / WORD_BITS] & ((uintptr_t)1 << (*index % WORD_BITS)))) return NULL;
+	return page;
+}
+
+// Clears the allocated bit of a block and moves the cursor back if needed
+static void release_block(heap_page_t page, unsigned int index)
+{
+	unsigned int word = index / WORD_BITS;
+	page->allocated_bits[word] &= ~((uintptr_t)1 << (index % WORD_BITS));
+	if (word < page->cursor) page->cursor = word;
+	page->used_count--;
+}
+
+// Returns the size class that serves a requested size
+unsigned int heap_size_class(size_t size, unsigned int kind, size_t* block_size)
+{
+	unsigned int index = class_lookup[(size + MIN_BLOCK_SIZE - 1) / MIN_BLOCK_SIZE] + kind * HEAP_BLOCK_SIZES;
+	*block_size = size_classes[index].block_size;
+	return index;
+}
+
+// Releases an allocated block
+bool_t heap_free(void* pointer)
+{
+	unsigned int index;
+	heap_page_t page = find_allocated_block(pointer, &index);
+	if (page == NULL) return FALSE;
+	release_block(page, index);
+
+	// A page that was full can serve new allocations again, the unswept ones wait for their sweep
+	if (!page->available && page->swept)
+	{
+		struct size_class_s* size_class = size_classes + page->size_class;
+		page->next_available = size_class->available;
+		size_class->available = page;
+		page->available = TRUE;
+	}
+	return TRUE;
+}
+
+// Returns the size of an allocated block
+size_t heap_block_size(void* pointer, unsigned int* kind)
+{
+	unsigned int index;
+	heap_page_t page = find_allocated_block(pointer, &index);
+	if (page == NULL) return 0;
+	if (kind != NULL) *kind = page->kind;
+	return page->block_size;
+}
+
+/* ============================================================================
+*  GC utility functions
+*  ========================================================================= */
+
+// Marks the allocated block that contains an address as reachable
+size_t heap_mark_block(heap_page_t page, void* address, bool_t interior, bool_t ambiguous, void** block)
+{
+	// An ambiguous word that points into an empty page is a false pointer
+	if (page->block_size == 0)
+	{
+		if (ambiguous) blacklist_add(address);
+		return 0;
+	}
+	unsigned int index = block_index(page, (char*)address);
+	if (index >= page->block_count) return 0;
+	char* start = page->start + index * page->block_size;
+	if (start != (char*)address && !interior) return 0;
+
+	// Only allocated blocks whose bit doesn't match the colour yet can be marked
+	unsigned int word = index / WORD_BITS;
+	uintptr_t bit = (uintptr_t)1 << (index % WORD_BITS);
+	if (!(page->allocated_bits[word] & bit)) return 0;
+
+	// A block reached by a conservative scan can't be moved, as the word may not be a pointer
+	if (ambiguous && pinning && !ATOMIC_LOAD(&page->pinned)) ATOMIC_STORE(&page->pinned, TRUE);
+	if (!((ATOMIC_LOAD(&page->mark_bits[word]) ^ mark_colour) & bit)) return 0;
+
+	// Other marking threads may share the word, only the one that sets the bit scans the block
+	uintptr_t previous = mark_colour
+		? ATOMIC_FETCH_OR(&page->mark_bits[word], bit)
+		: ATOMIC_FETCH_AND(&page->mark_bits[word], ~bit);
+	if (!((previous ^ mark_colour) & bit)) return 0;
+
+	// The pointer-free blocks are marked but never scanned
+	if (page->kind == HEAP_POINTER_FREE) return 0;
+	*block = page->kind == HEAP_TYPED ? (void*)((uintptr_t)start | HEAP_TYPED_BLOCK) : start;
+	return page->block_size;
+}
+
+// Checks the mark of the allocated block that contains an address
+bool_t heap_is_marked(heap_page_t page, void* address)
+{
+	if (page->block_size == 0) return FALSE;
+	unsigned int index = block_index(page, (char*)address);
+	if (index >= page->block_count) return FALSE;
+	unsigned int word = index / WORD_BITS;
+	uintptr_t bit = (uintptr_t)1 << (index % WORD_BITS);
+	return (page->allocated_bits[word] & bit) && !((ATOMIC_LOAD(&page->mark_bits[word]) ^ mark_colour) & bit);
+}
+
+// Sets the colour of the new blocks
+void heap_set_young_allocations(bool_t enabled)
+{
+	young_allocations = enabled;
+}
+
+// Copies the counters
+void heap_get_counters(struct heap_counters_s* result)
+{
+	*result = counters;
+}
+
+// Counts the allocated blocks of a page whose mark bit matches the colour
+static unsigned int count_marked_blocks(heap_page_t page)
+{
+	unsigned int w, marked = 0;
+	for (w = 0; w < page->word_count; w++)
+	{
+		marked += count_set_bits(page->allocated_bits[w] & ~(page->mark_bits[w] ^ mark_colour) & blocks_mask(page, w));
+	}
+	return marked;
+}
+
+// Counts the allocated blocks whose mark bit matches the colour
+size_t heap_marked_bytes(size_t* blocks)
+{
+	size_t total = 0;
+	*blocks = 0;
+	int i;
+	for (i = 0; i < arenas_count; i++)
+	{
+		heap_arena_t arena = arenas[i];
+		unsigned int p;
+		for (p = 0; p < arena->used_pages; p++)
+		{
+			heap_page_t page = arena->pages + p;
+			if (page->block_size == 0) continue;
+			unsigned int marked = count_marked_blocks(page);
+			total += marked * page->block_size;
+			*blocks += marked;
+		}
+	}
+	return total;
+}
+
+// Decommits the empty pages released before the given time, the list is ordered by release time
+// from the most recent one, so the walk stops at the first page that was already decommitted
+uint64_t heap_decommit_empty_pages(uint64_t released_before)
+{
+	uint64_t oldest = 0;
+	heap_page_t page;
+	for (page = empty_pages; page != NULL && !page->decommitted; page = page->next_in_class)
+	{
+		if (page->empty_since > released_before)
+		{
+			oldest = page->empty_since;
+			continue;
+		}
+		decommit_pages(page->start, HEAP_PAGE_SIZE);
+		page->decommitted = TRUE;
+		counters.decommitted_bytes += HEAP_PAGE_SIZE;
+	}
+	return oldest;
+}
+
+// Flips the mark colour, so that all the blocks become unmarked at once
+void heap_clear_marks()
+{
+	mark_colour = ~mark_colour;
+}
+
+// Visits the allocated blocks whose mark bit matches the colour
+void heap_visit_marked_blocks(block_visitor_t visitor)
+{
+	int i;
+	for (i = 0; i < arenas_count; i++)
+	{
+		heap_arena_t arena = arenas[i];
+		unsigned int p;
+		for (p = 0; p < arena->used_pages; p++)
+		{
+			heap_page_t page = arena->pages + p;
+			if (page->block_size == 0 || page->kind == HEAP_POINTER_FREE || page->forwarding != NULL) continue;
+			uintptr_t tag = page->kind == HEAP_TYPED ? HEAP_TYPED_BLOCK : 0;
+			unsigned int w;
+			for (w = 0; w < page->word_count; w++)
+			{
+				// Read the word again after each visit, as the visitor may mark more blocks in it
+				uintptr_t visited = 0, marked;
+				while ((marked = page->allocated_bits[w] & ~(page->mark_bits[w] ^ mark_colour) & blocks_mask(page, w) & ~visited) != 0)
+				{
+					uintptr_t bit = marked & (~marked + 1);
+					visited |= bit;
+					unsigned int index = w * WORD_BITS + count_trailing_zeros(bit);
+					visitor((void*)((uintptr_t)(page->start + index * page->block_size) | tag), page->block_size);
+				}
+			}
+		}
+	}
+}
+
+// Visits the marked blocks of a page that overlap a range
+void heap_visit_marked_range(heap_page_t page, char* start, char* end, block_visitor_t visitor)
+{
+	if (page->block_size == 0 || page->kind == HEAP_POINTER_FREE || page->forwarding != NULL) return;
+	uintptr_t tag = page->kind == HEAP_TYPED ? HEAP_TYPED_BLOCK : 0;
+	unsigned int index = block_index(page, start), last = block_index(page, end - 1);
+	if (last >= page->block_count) last = page->block_count - 1;
+	for (; index <= last; index++)
+	{
+		unsigned int word = index / WORD_BITS;
+		uintptr_t bit = (uintptr_t)1 << (index % WORD_BITS);
+		if (!(page->allocated_bits[word] & bit) || ((page->mark_bits[word] ^ mark_colour) & bit)) continue;
+		visitor((void*)((uintptr_t)(page->start + index * page->block_size) | tag), page->block_size);
+	}
+}
+
+// Moves all the pages into the unswept lists of their size classes, the available lists
+// are rebuilt while the pages are swept. Only the page headers are touched
+void heap_start_sweep()
+{
+	int c;
+	for (c = 0; c < SIZE_CLASSES_COUNT; c++)
+	{
+		struct size_class_s* size_class = size_classes + c;
+		heap_page_t page;
+		for (page = size_class->swept; page != NULL; page = page->next_in_class)
+		{
+			page->swept = FALSE;
+			page->available = FALSE;
+			page->next_available = NULL;
+		}
+
+		// The unswept list is empty here, as the previous sweep was finished before the marking
+		size_class->unswept = size_class->swept;
+		size_class->swept = NULL;
+		size_class->available = NULL;
+	}
+}
+
+// Sweeps up to the given number of pages, returns TRUE if some pages are still unswept
+bool_t heap_sweep_step(unsigned int pages)
+{
+	static int next_class = 0;
+	int checked;
+	for (checked = 0; checked < SIZE_CLASSES_COUNT && pages > 0;)
+	{
+		struct size_class_s* size_class = size_classes + next_class;
+		if (size_class->unswept == NULL)
+		{
+			next_class = (next_class + 1) % SIZE_CLASSES_COUNT;
+			checked++;
+			continue;
+		}
+		heap_page_t page = size_class->unswept;
+		size_class->unswept = page->next_in_class;
+		sweep_page(page);
+		pages--;
+		checked = 0;
+	}
+	for (checked = 0; checked < SIZE_CLASSES_COUNT; checked++)
+	{
+		if (size_classes[checked].unswept != NULL) return TRUE;
+	}
+	return FALSE;
+}
+
+// Sweeps all the pages that are still unswept
+void heap_finish_sweep()
+{
+	while (heap_sweep_step(UINT_MAX));
+}
+
+/* ============================================================================
+*  Compaction
+*  ========================================================================= */
+
+// Unpins all the pages, the next marking pins the ones reached by the conservative scans
+void heap_start_pinning()
+{
+	int i;
+	for (i = 0; i < arenas_count; i++)
+	{
+		unsigned int p;
+		for (p = 0; p < arenas[i]->used_pages; p++)
+		{
+			arenas[i]->pages[p].pinned = FALSE;
+		}
+	}
+	pinning = TRUE;
+}
+
+// Copies the marked blocks of a page into the other pages of its size class. If the heap is full
+// the copies are released and the page is left in place, returns FALSE in that case
+static bool_t evacuate_page(heap_page_t page)
+{
+	page->forwarding = (void**)reserve_aligned_pages(FORWARDING_BYTES(page), PAGE_MAP_GRANULE);
+	if (page->forwarding == NULL) return FALSE;
+	unsigned int w;
+	for (w = 0; w < page->word_count; w++)
+	{
+		uintptr_t marked = page->allocated_bits[w] & ~(page->mark_bits[w] ^ mark_colour) & blocks_mask(page, w);
+		while (marked != 0)
+		{
+			unsigned int index = w * WORD_BITS + count_trailing_zeros(marked);
+			marked &= marked - 1;
+
+			// The copy is allocated marked, so the sweep keeps it
+			void* copy = allocate_block(page->size_class);
+			if (copy == NULL)
+			{
+				unsigned int i;
+				for (i = 0; i < page->block_count; i++)
+				{
+					if (page->forwarding[i] != NULL) heap_free(page->forwarding[i]);
+				}
+				release_pages(page->forwarding, FORWARDING_BYTES(page));
+				page->forwarding = NULL;
+				return FALSE;
+			}
+			memcpy(copy, page->start + index * page->block_size, page->block_size);
+			page->forwarding[index] = copy;
+		}
+	}
+	return TRUE;
+}
+
+// Selects the sparse pages that weren't pinned and copies their marked blocks away. All the pages are
+// in the swept lists, as the previous sweep was finished before the marking, and only the pages that
+// stay are left in the available lists, so that the copies are never allocated in an evacuated page
+size_t heap_evacuate()
+{
+	size_t evacuated = 0;
+	pinning = FALSE;
+	int c;
+	for (c = 0; c < SIZE_CLASSES_COUNT; c++)
+	{
+		struct size_class_s* size_class = size_classes + c;
+		heap_page_t candidates = NULL, page, next;
+		heap_page_t* link = &size_class->swept;
+		while ((page = *link) != NULL)
+		{
+			if (!page->pinned && count_marked_blocks(page) * EVACUATION_RATIO < page->block_count)
+			{
+				*link = page->next_in_class;
+				page->next_in_class = candidates;
+				candidates = page;
+			}
+			else link = &page->next_in_class;
+		}
+		if (candidates == NULL) continue;
+
+		// Rebuild the available list without the candidates
+		size_class->available = NULL;
+		for (page = size_class->swept; page != NULL; page = page->next_in_class)
+		{
+			page->available = page->used_count < page->block_count;
+			page->next_available = page->available ? size_class->available : NULL;
+			if (page->available) size_class->available = page;
+		}
+
+		// The pages that can't be evacuated go back to their size class
+		for (page = candidates; page != NULL; page = next)
+		{
+			next = page->next_in_class;
+			page->available = FALSE;
+			page->next_available = NULL;
+			if (evacuate_page(page))
+			{
+				page->next_in_class = evacuated_pages;
+				evacuated_pages = page;
+				evacuated++;
+				continue;
+			}
+			page->next_in_class = size_class->swept;
+			size_class->swept = page;
+			if (page->used_count < page->block_count)
+			{
+				page->next_available = size_class->available;
+				size_class->available = page;
+				page->available = TRUE;
+			}
+		}
+	}
+	return evacuated;
+}
+
+// Returns the new address of a pointer into an evacuated block
+void* heap_forward(void* pointer)
+{
+	heap_page_t page = find_page(pointer);
+	if (page == NULL || page->forwarding == NULL) return pointer;
+	unsigned int index = block_index(page, (char*)pointer);
+	if (index >= page->block_count || page->forwarding[index] == NULL) return pointer;
+	return (char*)page->forwarding[index] + ((char*)pointer - (page->start + index * page->block_size));
+}
+
+// Releases the evacuated pages, their unmarked blocks are counted as freed like a sweep would do
+void heap_release_evacuated()
+{
+	while (evacuated_pages != NULL)
+	{
+		heap_page_t page = evacuated_pages;
+		evacuated_pages = page->next_in_class;
+		unsigned int i, moved = 0;
+		for (i = 0; i < page->block_count; i++)
+		{
+			if (page->forwarding[i] != NULL) moved++;
+		}
+		release_pages(page->forwarding, FORWARDING_BYTES(page));
+		page->forwarding = NULL;
+		counters.moved_bytes += moved * page->block_size;
+		counters.freed_blocks += page->used_count - moved;
+		counters.freed_bytes += (page->used_count - moved) * page->block_size;
+		page->used_count = 0;
+		release_empty_page(page);
+	}
+}
@@ -0,0 +1,306 @@
+#ifndef HEAP_H
+#define HEAP_H
+
+#include <stdint.h>
+#include "../../Misc/GC_definitions.h"
+
+// Size of a heap page, each page only holds blocks of a single size class
+#define HEAP_PAGE_SHIFT 16
+#define HEAP_PAGE_SIZE ((size_t)1 << HEAP_PAGE_SHIFT)
+
+// Biggest request served by the size-class pages, bigger blocks use the hash map
+#define HEAP_MAX_SMALL_SIZE 8192
+
+// The kinds of small blocks: the scanned ones may hold pointers anywhere, the pointer-free
+// ones are never scanned and the typed ones end with the descriptor of their pointer words
+#define HEAP_SCANNED 0
+#define HEAP_POINTER_FREE 1
+#define HEAP_TYPED 2
+#define HEAP_BLOCK_KINDS 3
+
+// Number of block sizes of the small blocks, each one has a size class for each kind
+#define HEAP_BLOCK_SIZES 32
+#define HEAP_SIZE_CLASSES (HEAP_BLOCK_KINDS * HEAP_BLOCK_SIZES)
+
+// Set in the addresses of the typed blocks returned to the marker
+#define HEAP_TYPED_BLOCK ((uintptr_t)1)
+
+// The header of a heap page, the page map resolves the addresses to them
+typedef struct heap_page_s* heap_page_t;
+
+/* ---------------------------------------------------------------------
+*  heap_counters_s
+*  ---------------------------------------------------------------------
+*  Description:
+*    The cumulative counters of the heap, they wrap around so only the
+*    differences between two readings are meaningful
+*  Fields:
+*    allocated_bytes ---> The total size of the allocated blocks
+*    freed_bytes ---> The total size of the blocks released by the sweeps
+*    freed_blocks ---> The number of blocks released by the sweeps
+*    sweep_time ---> The time spent sweeping the pages, in nanoseconds
+*    moved_bytes ---> The total size of the blocks moved by the compactions
+*    decommitted_bytes ---> The memory of the empty pages returned to the OS */
+struct heap_counters_s
+{
+	size_t allocated_bytes;
+	size_t freed_bytes;
+	size_t freed_blocks;
+	uint64_t sweep_time;
+	size_t moved_bytes;
+	size_t decommitted_bytes;
+};
+
+/* ============================================================================
+*  Heap setup and allocation
+*  ========================================================================= */
+
+/* ---------------------------------------------------------------------
+*  heap_init
+*  ---------------------------------------------------------------------
+*  Description:
+*    Builds the size classes table, no memory is requested to the OS
+*    until the first allocation */
+void heap_init();
+
+/* ---------------------------------------------------------------------
+*  heap_alloc
+*  ---------------------------------------------------------------------
+*  Description:
+*    Returns a block from the pages of the size class that fits the
+*    requested size, or NULL if no more memory is available
+*  Parameters:
+*    size ---> The requested size, at most HEAP_MAX_SMALL_SIZE
+*    kind ---> The kind of the block, one of the HEAP_ constants */
+void* heap_alloc(size_t size, unsigned int kind);
+
+/* ---------------------------------------------------------------------
+*  heap_alloc_many
+*  ---------------------------------------------------------------------
+*  Description:
+*    Fills the given array with blocks from the pages of the size class
+*    that fits the requested size, the blocks next to each other in a
+*    page are taken together. Returns the number of blocks allocated,
+*    which is less than count if no more memory is available
+*  Parameters:
+*    size ---> The requested size, at most HEAP_MAX_SMALL_SIZE
+*    kind ---> The kind of the blocks, one of the HEAP_ constants
+*    blocks ---> The array that receives the new blocks
+*    count ---> The number of blocks to allocate */
+size_t heap_alloc_many(size_t size, unsigned int kind, void** blocks, size_t count);
+
+/* ---------------------------------------------------------------------
+*  heap_size_class
+*  ---------------------------------------------------------------------
+*  Description:
+*    Returns the index of the size class that serves the given size
+*  Parameters:
+*    size ---> The requested size, at most HEAP_MAX_SMALL_SIZE
+*    kind ---> The kind of the block, one of the HEAP_ constants
+*    block_size ---> Set to the size of the blocks of the class */
+unsigned int heap_size_class(size_t size, unsigned int kind, size_t* block_size);
+
+/* ---------------------------------------------------------------------
+*  heap_free
+*  ---------------------------------------------------------------------
+*  Description:
+*    Returns a block to the free list of its page. Returns FALSE if the
+*    pointer isn't the first address of an allocated heap block
+*  Parameters:
+*    pointer ---> The first address of the block to release */
+bool_t heap_free(void* pointer);
+
+/* ---------------------------------------------------------------------
+*  heap_block_size
+*  ---------------------------------------------------------------------
+*  Description:
+*    Returns the usable size of the allocated block that starts at the
+*    given address, or 0 if the address isn't the start of a heap block
+*  Parameters:
+*    pointer ---> The first address of the block
+*    kind ---> If not NULL, set to the kind of the block */
+size_t heap_block_size(void* pointer, unsigned int* kind);
+
+/* ============================================================================
+*  GC utility functions
+*  ========================================================================= */
+
+/* ---------------------------------------------------------------------
+*  heap_mark_block
+*  ---------------------------------------------------------------------
+*  Description:
+*    Marks the allocated block that contains the given address as
+*    reachable. Returns the size of the block if it was not marked
+*    yet, 0 if it was already marked, if it isn't an allocated block or
+*    if it is pointer-free, as it doesn't need to be scanned. The start
+*    of a typed block is returned with HEAP_TYPED_BLOCK set. Several
+*    threads can mark the blocks of the heap at once
+*  Parameters:
+*    page ---> The page that contains the address, from the page map
+*    address ---> The candidate pointer found while scanning
+*    interior ---> Whether addresses past the start of a block are accepted
+*    ambiguous ---> Whether the address was found by a conservative scan,
+*                   the page is then pinned if a compaction is coming
+*    block ---> Set to the first address of the marked block */
+size_t heap_mark_block(heap_page_t page, void* address, bool_t interior, bool_t ambiguous, void** block);
+
+/* ---------------------------------------------------------------------
+*  heap_is_marked
+*  ---------------------------------------------------------------------
+*  Description:
+*    Returns TRUE if the address is inside an allocated block that is
+*    marked for the current cycle. Between the generational collections
+*    the marked blocks are the old ones
+*  Parameters:
+*    page ---> The page that contains the address, from the page map
+*    address ---> Any address inside the page */
+bool_t heap_is_marked(heap_page_t page, void* address);
+
+/* ---------------------------------------------------------------------
+*  heap_set_young_allocations
+*  ---------------------------------------------------------------------
+*  Description:
+*    Chooses whether the new blocks are allocated unmarked. The minor
+*    collections keep the marks of the old blocks, so only the young
+*    ones that aren't reached again are released
+*  Parameters:
+*    enabled ---> TRUE to allocate unmarked blocks, FALSE to allocate
+*                 them marked for the current cycle */
+void heap_set_young_allocations(bool_t enabled);
+
+/* ---------------------------------------------------------------------
+*  heap_get_counters
+*  ---------------------------------------------------------------------
+*  Description:
+*    Reads the cumulative counters of the heap
+*  Parameters:
+*    counters ---> Filled with the current values */
+void heap_get_counters(struct heap_counters_s* counters);
+
+/* ---------------------------------------------------------------------
+*  heap_marked_bytes
+*  ---------------------------------------------------------------------
+*  Description:
+*    Returns the total size of the allocated blocks that are currently
+*    marked, the live memory of the heap after a marking
+*  Parameters:
+*    blocks ---> Set to the number of marked blocks */
+size_t heap_marked_bytes(size_t* blocks);
+
+/* ---------------------------------------------------------------------
+*  heap_decommit_empty_pages
+*  ---------------------------------------------------------------------
+*  Description:
+*    Returns the memory of the empty pages to the OS, if they were
+*    released by a sweep before the given time. They stay reserved and
+*    are committed again when they are reused. Returns the release time
+*    of the oldest page left resident, or 0 if there are none
+*  Parameters:
+*    released_before ---> The time limit, from get_nanoseconds */
+uint64_t heap_decommit_empty_pages(uint64_t released_before);
+
+/* ---------------------------------------------------------------------
+*  heap_clear_marks
+*  ---------------------------------------------------------------------
+*  Description:
+*    Makes all the blocks unmarked before a collection. It just flips
+*    the meaning of the mark bits, so no page is touched */
+void heap_clear_marks();
+
+/* ---------------------------------------------------------------------
+*  heap_start_sweep
+*  ---------------------------------------------------------------------
+*  Description:
+*    Starts the sweep after a collection. No block is released here:
+*    each page is swept later, by the allocations of its size class
+*    that find no free block or by heap_sweep_step */
+void heap_start_sweep();
+
+/* ---------------------------------------------------------------------
+*  heap_sweep_step
+*  ---------------------------------------------------------------------
+*  Description:
+*    Sweeps some of the pages left by the last collection, releasing
+*    their unmarked blocks a bitmap word at a time. Returns TRUE if
+*    some pages are still unswept
+*  Parameters:
+*    pages ---> The highest number of pages to sweep */
+bool_t heap_sweep_step(unsigned int pages);
+
+/* ---------------------------------------------------------------------
+*  heap_finish_sweep
+*  ---------------------------------------------------------------------
+*  Description:
+*    Sweeps all the pages left by the last collection, it must be
+*    called before the marks are cleared for the next one */
+void heap_finish_sweep();
+
+/* ---------------------------------------------------------------------
+*  heap_visit_marked_blocks
+*  ---------------------------------------------------------------------
+*  Description:
+*    Invokes the visitor on every allocated block that is currently
+*    marked and may hold pointers, the typed ones are tagged like in
+*    heap_mark_block. The visitor can mark more blocks while the heap
+*    is visited
+*  Parameters:
+*    visitor ---> The function to call with each marked block */
+void heap_visit_marked_blocks(block_visitor_t visitor);
+
+/* ---------------------------------------------------------------------
+*  heap_visit_marked_range
+*  ---------------------------------------------------------------------
+*  Description:
+*    Invokes the visitor on the marked blocks of a page that overlap
+*    the given range and may hold pointers, like heap_visit_marked_blocks
+*  Parameters:
+*    page ---> The page that contains the range, from the page map
+*    start ---> The first address of the range
+*    end ---> The address past the end of the range
+*    visitor ---> The function to call with each marked block */
+void heap_visit_marked_range(heap_page_t page, char* start, char* end, block_visitor_t visitor);
+
+/* ============================================================================
+*  Compaction
+*  ========================================================================= */
+
+/* ---------------------------------------------------------------------
+*  heap_start_pinning
+*  ---------------------------------------------------------------------
+*  Description:
+*    Unpins all the pages, the next marking pins each page that has a
+*    block reached by a conservative scan. It is called after the marks
+*    are cleared, before a marking that is followed by heap_evacuate */
+void heap_start_pinning();
+
+/* ---------------------------------------------------------------------
+*  heap_evacuate
+*  ---------------------------------------------------------------------
+*  Description:
+*    Copies the marked blocks of the pages that weren't pinned and are
+*    less than half full into the other pages of their size class, and
+*    returns the number of evacuated pages. The old blocks stay readable
+*    until heap_release_evacuated, all the precise pointers to them must
+*    be updated with heap_forward before that. It must be called after
+*    a marking and before heap_start_sweep, with the program stopped */
+size_t heap_evacuate();
+
+/* ---------------------------------------------------------------------
+*  heap_forward
+*  ---------------------------------------------------------------------
+*  Description:
+*    Returns the new address of a pointer into an evacuated block, or
+*    the same pointer if its block didn't move
+*  Parameters:
+*    pointer ---> The pointer to update */
+void* heap_forward(void* pointer);
+
+/* ---------------------------------------------------------------------
+*  heap_release_evacuated
+*  ---------------------------------------------------------------------
+*  Description:
+*    Releases the pages emptied by heap_evacuate, so that any size
+*    class can reuse them */
+void heap_release_evacuated();
+
+#endif
@@ -0,0 +1,117 @@
+#include <stdint.h>
+#include "../../Misc/GC_definitions.h"
+#include "../../Misc/GC_atomic.h"
+#include "../MemoryHelper/memory_helper.h"
+#include "page_map.h"
+
+/* =========== Local constants ===========*/
+
+// Number of meaningful bits in a user space address
+#if UINTPTR_MAX > 0xFFFFFFFFu
+#define ADDRESS_BITS 48
+#else
+#define ADDRESS_BITS 32
+#endif
+
+// The granule index is split between the two levels of the map
+#define INDEX_BITS (ADDRESS_BITS - PAGE_MAP_GRANULE_SHIFT)
+#define LEAF_BITS (INDEX_BITS / 2)
+#define TOP_BITS (INDEX_BITS - LEAF_BITS)
+#define LEAF_ENTRIES ((size_t)1 << LEAF_BITS)
+#define TOP_ENTRIES ((size_t)1 << TOP_BITS)
+
+/* =========== Global variables ===========*/
+
+// The first level of the map, second level tables are only allocated when needed
+static uintptr_t** page_map_top = NULL;
+
+// One flag per granule, set when the granule is written while the heap is marked concurrently
+static uintptr_t** dirty_top = NULL;
+
+// The range of addresses that have ever been registered into the map
+static char* lower_bound = (char*)UINTPTR_MAX;
+static char* upper_bound = NULL;
+
+/* ============================================================================
+*  Page map functions
+*  ========================================================================= */
+
+// Reserves the first level of the map, the OS only commits the touched pages
+bool_t page_map_init()
+{
+	page_map_top = (uintptr_t**)reserve_aligned_pages(TOP_ENTRIES * sizeof(uintptr_t*), PAGE_MAP_GRANULE);
+	dirty_top = (uintptr_t**)reserve_aligned_pages(TOP_ENTRIES * sizeof(uintptr_t*), PAGE_MAP_GRANULE);
+	return page_map_top != NULL && dirty_top != NULL;
+}
+
+// Sets the owner of all the granules in the given range
+bool_t page_map_set(void* start, size_t size, uintptr_t owner)
+{
+	uintptr_t index = (uintptr_t)start >> PAGE_MAP_GRANULE_SHIFT;
+	uintptr_t last = index + (size >> PAGE_MAP_GRANULE_SHIFT);
+	for (; index < last; index++)
+	{
+		uintptr_t** slot = page_map_top + (index >> LEAF_BITS);
+		if (*slot == NULL)
+		{
+			if (owner == 0) continue;
+
+			// The dirty flags of the same granules are allocated along with the owners
+			uintptr_t** dirty_slot = dirty_top + (index >> LEAF_BITS);
+			if (*dirty_slot == NULL)
+			{
+				*dirty_slot = (uintptr_t*)reserve_aligned_pages(LEAF_ENTRIES * sizeof(uintptr_t), PAGE_MAP_GRANULE);
+				if (*dirty_slot == NULL) return FALSE;
+			}
+			uintptr_t* leaf = (uintptr_t*)reserve_aligned_pages(LEAF_ENTRIES * sizeof(uintptr_t), PAGE_MAP_GRANULE);
+			if (leaf == NULL) return FALSE;
+			ATOMIC_STORE(slot, leaf);
+		}
+		(*slot)[index & (LEAF_ENTRIES - 1)] = owner;
+	}
+
+	// The bounds only grow, they are just used to quickly reject foreign addresses
+	if (owner != 0) page_map_extend_bounds(start, size);
+	return TRUE;
+}
+
+// Includes an address range in the bounds
+void page_map_extend_bounds(void* start, size_t size)
+{
+	if ((char*)start < lower_bound) lower_bound = (char*)start;
+	if ((char*)start + size > upper_bound) upper_bound = (char*)start + size;
+}
+
+// Returns the owner of the given address
+uintptr_t page_map_get(void* address)
+{
+	if ((char*)address < lower_bound || (char*)address >= upper_bound) return 0;
+	uintptr_t index = (uintptr_t)address >> PAGE_MAP_GRANULE_SHIFT;
+	uintptr_t* leaf = page_map_top[index >> LEAF_BITS];
+	return leaf == NULL ? 0 : leaf[index & (LEAF_ENTRIES - 1)];
+}
+
+// Returns the range of the registered addresses
+void page_map_bounds(char** lower, char** upper)
+{
+	*lower = lower_bound;
+	*upper = upper_bound;
+}
+
+// Sets the dirty flag of the granule that contains the given address
+bool_t page_map_set_dirty(void* address)
+{
+	uintptr_t index = (uintptr_t)address >> PAGE_MAP_GRANULE_SHIFT;
+	uintptr_t* leaf = dirty_top[index >> LEAF_BITS];
+	if (leaf == NULL) return FALSE;
+	uintptr_t* flag = leaf + (index & (LEAF_ENTRIES - 1));
+	return ATOMIC_LOAD(flag) == 0 && ATOMIC_CAS(flag, 0, 1);
+}
+
+// Clears the dirty flag of a granule
+void page_map_clear_dirty(void* address)
+{
+	uintptr_t index = (uintptr_t)address >> PAGE_MAP_GRANULE_SHIFT;
+	uintptr_t* leaf = dirty_top[index >> LEAF_BITS];
+	if (leaf != NULL) leaf[index & (LEAF_ENTRIES - 1)] = 0;
+}
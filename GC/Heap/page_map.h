@@ -0,0 +1,96 @@
+#ifndef PAGE_MAP_H
+#define PAGE_MAP_H
+
+#include <stdint.h>
+#include "../../Misc/GC_definitions.h"
+
+// Size of the address ranges tracked by a single page map entry
+#define PAGE_MAP_GRANULE_SHIFT 12
+#define PAGE_MAP_GRANULE ((size_t)1 << PAGE_MAP_GRANULE_SHIFT)
+
+// Entries with this bit set hold the first address of a large block, the others a heap page header
+#define PAGE_MAP_LARGE_BLOCK ((uintptr_t)1)
+
+// Set along with the previous bit when the large block never holds pointers,
+// or when it ends with the descriptor of its pointer words
+#define PAGE_MAP_POINTER_FREE ((uintptr_t)2)
+#define PAGE_MAP_TYPED ((uintptr_t)4)
+#define PAGE_MAP_TAGS (PAGE_MAP_LARGE_BLOCK | PAGE_MAP_POINTER_FREE | PAGE_MAP_TYPED)
+
+/* ---------------------------------------------------------------------
+*  page_map_init
+*  ---------------------------------------------------------------------
+*  Description:
+*    Reserves the first level of the page map. Returns FALSE if the
+*    memory couldn't be reserved */
+bool_t page_map_init();
+
+/* ---------------------------------------------------------------------
+*  page_map_set
+*  ---------------------------------------------------------------------
+*  Description:
+*    Associates all the granules in an address range to an owner, or
+*    removes them from the map if the owner is 0. Returns FALSE if a
+*    second level table couldn't be allocated, in which case part of
+*    the range may already be set and the caller has to clear it
+*  Parameters:
+*    start ---> The first address of the range, aligned to a granule
+*    size ---> The size of the range, a multiple of PAGE_MAP_GRANULE
+*    owner ---> The heap page header or the tagged large block address */
+bool_t page_map_set(void* start, size_t size, uintptr_t owner);
+
+/* ---------------------------------------------------------------------
+*  page_map_get
+*  ---------------------------------------------------------------------
+*  Description:
+*    Returns the owner of the granule that contains the given address,
+*    or 0 if the address doesn't belong to the GC. Most of the
+*    non-heap addresses are rejected by a single range check
+*  Parameters:
+*    address ---> The address to resolve */
+uintptr_t page_map_get(void* address);
+
+/* ---------------------------------------------------------------------
+*  page_map_extend_bounds
+*  ---------------------------------------------------------------------
+*  Description:
+*    Extends the range returned by page_map_bounds to an address range
+*    reserved by the GC, even if it isn't registered yet
+*  Parameters:
+*    start ---> The first address of the range
+*    size ---> The size of the range */
+void page_map_extend_bounds(void* start, size_t size);
+
+/* ---------------------------------------------------------------------
+*  page_map_bounds
+*  ---------------------------------------------------------------------
+*  Description:
+*    Returns the range of addresses that have ever been registered into
+*    the map, all the addresses owned by the GC are inside it. The upper
+*    bound is not greater than the lower one if the map is still empty
+*  Parameters:
+*    lower ---> Set to the first address of the range
+*    upper ---> Set to the address right after the range */
+void page_map_bounds(char** lower, char** upper);
+
+/* ---------------------------------------------------------------------
+*  page_map_set_dirty
+*  ---------------------------------------------------------------------
+*  Description:
+*    Sets the dirty flag of the granule that contains the given address.
+*    Returns TRUE only for the call that turned the flag on, FALSE if
+*    it was already set or if the address doesn't belong to the GC
+*  Parameters:
+*    address ---> An address inside the granule that was written */
+bool_t page_map_set_dirty(void* address);
+
+/* ---------------------------------------------------------------------
+*  page_map_clear_dirty
+*  ---------------------------------------------------------------------
+*  Description:
+*    Clears the dirty flag of the granule that contains the given address
+*  Parameters:
+*    address ---> An address inside the granule */
+void page_map_clear_dirty(void* address);
+
+#endif
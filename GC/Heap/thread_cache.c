@@ -0,0 +1,63 @@
+#include <stddef.h>
+#include "../../Misc/GC_definitions.h"
+#include "heap.h"
+#include "thread_cache.h"
+
+/* =========== Local constants ===========*/
+
+// Each refill reserves about this many bytes, so that the caches of the big classes stay small
+#define REFILL_BYTES 8192
+
+/* ============================================================================
+*  Thread cache functions
+*  ========================================================================= */
+
+// Pops the last block of the class, the slot is cleared so that the block isn't kept alive by the cache
+void* thread_cache_alloc(thread_cache_t cache, size_t size, unsigned int kind)
+{
+	size_t block_size;
+	unsigned int index = heap_size_class(size, kind, &block_size);
+	unsigned int count = cache->counts[index];
+	if (count == 0) return NULL;
+	cache->counts[index] = --count;
+	void* block = cache->blocks[index][count];
+
+	// The cache was flushed while the thread was stopped here, the count it stored is stale
+	if (block == NULL)
+	{
+		cache->counts[index] = 0;
+		return NULL;
+	}
+	cache->blocks[index][count] = NULL;
+	return block;
+}
+
+// Fills the class with new blocks from the heap
+void* thread_cache_refill(thread_cache_t cache, size_t size, unsigned int kind)
+{
+	size_t block_size;
+	unsigned int index = heap_size_class(size, kind, &block_size);
+	unsigned int target = (unsigned int)(REFILL_BYTES / block_size);
+	if (target > THREAD_CACHE_BLOCKS) target = THREAD_CACHE_BLOCKS;
+	unsigned int count = cache->counts[index];
+	if (count < target) count += (unsigned int)heap_alloc_many(block_size, kind, cache->blocks[index] + count, target - count);
+	cache->counts[index] = count;
+
+	// The caller gets one of them, if the heap wasn't full
+	return count > 0 ? thread_cache_alloc(cache, size, kind) : NULL;
+}
+
+// Releases all the cached blocks
+void thread_cache_flush(thread_cache_t cache)
+{
+	unsigned int i;
+	for (i = 0; i < HEAP_SIZE_CLASSES; i++)
+	{
+		while (cache->counts[i] > 0)
+		{
+			unsigned int count = --cache->counts[i];
+			if (cache->blocks[i][count] != NULL) heap_free(cache->blocks[i][count]);
+			cache->blocks[i][count] = NULL;
+		}
+	}
+}
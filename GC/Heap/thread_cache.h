@@ -0,0 +1,64 @@
+#ifndef THREAD_CACHE_H
+#define THREAD_CACHE_H
+
+#include "../../Misc/GC_definitions.h"
+#include "heap.h"
+
+// Number of blocks each thread can keep for a size class
+#define THREAD_CACHE_BLOCKS 32
+
+/* ---------------------------------------------------------------------
+*  thread_cache_s
+*  ---------------------------------------------------------------------
+*  Description:
+*    The blocks reserved by a thread, so that it can allocate the small
+*    ones without taking the lock. The blocks are already allocated in
+*    the heap, so the whole structure is scanned as a root
+*  Fields:
+*    counts ---> The number of blocks left in each size class
+*    blocks ---> The blocks of each size class, the used slots are cleared */
+struct thread_cache_s
+{
+	unsigned int counts[HEAP_SIZE_CLASSES];
+	void* blocks[HEAP_SIZE_CLASSES][THREAD_CACHE_BLOCKS];
+};
+
+typedef struct thread_cache_s* thread_cache_t;
+
+/* ---------------------------------------------------------------------
+*  thread_cache_alloc
+*  ---------------------------------------------------------------------
+*  Description:
+*    Takes a block from the cache, without any lock. Returns NULL if
+*    the cache has no blocks left for the requested size
+*  Parameters:
+*    cache ---> The cache of the calling thread
+*    size ---> The requested size, at most HEAP_MAX_SMALL_SIZE
+*    kind ---> The kind of the block, one of the HEAP_ constants */
+void* thread_cache_alloc(thread_cache_t cache, size_t size, unsigned int kind);
+
+/* ---------------------------------------------------------------------
+*  thread_cache_refill
+*  ---------------------------------------------------------------------
+*  Description:
+*    Reserves a batch of blocks from the heap and returns one of them,
+*    or NULL if no more memory is available. The lock must be held
+*  Parameters:
+*    cache ---> The cache of the calling thread
+*    size ---> The requested size, at most HEAP_MAX_SMALL_SIZE
+*    kind ---> The kind of the block, one of the HEAP_ constants */
+void* thread_cache_refill(thread_cache_t cache, size_t size, unsigned int kind);
+
+/* ---------------------------------------------------------------------
+*  thread_cache_flush
+*  ---------------------------------------------------------------------
+*  Description:
+*    Returns all the blocks of the cache to the heap. The lock must be
+*    held and the owner of the cache must be stopped or not using it.
+*    A thread stopped while taking a block from its cache finds an
+*    empty slot when it resumes, and refills the cache
+*  Parameters:
+*    cache ---> The cache to empty */
+void thread_cache_flush(thread_cache_t cache);
+
+#endif
@@ -0,0 +1,196 @@
+#include <stdlib.h>
+#include <stdint.h>
+#include "../../Misc/GC_definitions.h"
+#include "../../Misc/GC_atomic.h"
+#include "../MemoryHelper/memory_helper.h"
+#include "mark_stack.h"
+
+/* =========== Local constants ===========*/
+
+#define FIRST_CAPACITY 4096
+
+// The stack stops growing past this number of entries and falls back to rescanning the heap
+#define MAX_CAPACITY ((size_t)1 << 22)
+
+// The arrays come straight from the OS, as the marking may run while the other threads are
+// stopped and one of them could be holding the lock of the libc allocator
+#define ARRAY_ALIGNMENT 4096
+#define ARRAY_BYTES(capacity) ((sizeof(struct mark_array_s) + ((capacity) - 1) * sizeof(struct mark_entry_s) \
+	+ ARRAY_ALIGNMENT - 1) & ~(size_t)(ARRAY_ALIGNMENT - 1))
+
+/* =========== Types used in the file ===========*/
+
+// A marked block that still has to be scanned
+struct mark_entry_s
+{
+	void* block;
+	size_t size;
+};
+
+// A circular array of entries, the replaced ones are kept until the stack is reset
+// because a thief may still be reading from them
+struct mark_array_s
+{
+	size_t mask;
+	struct mark_array_s* previous;
+	struct mark_entry_s entries[1];
+};
+
+typedef struct mark_array_s* mark_array_t;
+
+/* ---------------------------------------------------------------------
+*  mark_stack_s
+*  ---------------------------------------------------------------------
+*  Description:
+*    A Chase-Lev work-stealing deque of the blocks to scan. The owner
+*    pushes and pops at the bottom, the other workers steal from the top
+*  Fields:
+*    top ---> The index of the oldest entry, only moved forward by a CAS
+*    bottom ---> The index past the newest entry, only written by the owner
+*    array ---> The current array of the entries
+*    overflowed ---> Indicates whether a block was dropped because the stack was full */
+struct mark_stack_s
+{
+	intptr_t top;
+	intptr_t bottom;
+	mark_array_t array;
+	bool_t overflowed;
+};
+
+/* ============================================================================
+*  Mark stack functions
+*  ========================================================================= */
+
+// Allocates an empty array with the given capacity, a power of two
+static mark_array_t allocate_array(size_t capacity)
+{
+	mark_array_t array = (mark_array_t)reserve_aligned_pages(ARRAY_BYTES(capacity), ARRAY_ALIGNMENT);
+	if (array == NULL) return NULL;
+	array->mask = capacity - 1;
+	array->previous = NULL;
+	return array;
+}
+
+// Creates an empty mark stack
+mark_stack_t mark_stack_init()
+{
+	mark_stack_t stack = (mark_stack_t)malloc(sizeof(struct mark_stack_s));
+	if (stack == NULL) return NULL;
+	stack->array = allocate_array(FIRST_CAPACITY);
+	if (stack->array == NULL)
+	{
+		free(stack);
+		return NULL;
+	}
+	stack->top = 0;
+	stack->bottom = 0;
+	stack->overflowed = FALSE;
+	return stack;
+}
+
+// Moves the entries into an array twice as big, returns FALSE if the stack can't grow
+static bool_t grow(mark_stack_t stack, intptr_t top, intptr_t bottom)
+{
+	mark_array_t old_array = stack->array;
+	size_t capacity = (old_array->mask + 1) * 2;
+	if (capacity > MAX_CAPACITY) return FALSE;
+	mark_array_t array = allocate_array(capacity);
+	if (array == NULL) return FALSE;
+	intptr_t i;
+	for (i = top; i < bottom; i++)
+	{
+		array->entries[i & array->mask] = old_array->entries[i & old_array->mask];
+	}
+	array->previous = old_array;
+	ATOMIC_STORE(&stack->array, array);
+	return TRUE;
+}
+
+// Pushes a block at the bottom of the stack
+void mark_stack_push(mark_stack_t stack, void* block, size_t size)
+{
+	intptr_t bottom = stack->bottom;
+	intptr_t top = ATOMIC_LOAD(&stack->top);
+	mark_array_t array = stack->array;
+	if ((size_t)(bottom - top) > array->mask)
+	{
+		if (!grow(stack, top, bottom))
+		{
+			// The block is already marked, the rescan will find it again
+			stack->overflowed = TRUE;
+			return;
+		}
+		array = stack->array;
+	}
+	array->entries[bottom & array->mask].block = block;
+	array->entries[bottom & array->mask].size = size;
+	ATOMIC_STORE(&stack->bottom, bottom + 1);
+}
+
+// Pops the last block from the bottom of the stack
+bool_t mark_stack_pop(mark_stack_t stack, void** block, size_t* size)
+{
+	intptr_t bottom = stack->bottom - 1;
+	mark_array_t array = stack->array;
+	ATOMIC_STORE(&stack->bottom, bottom);
+	ATOMIC_FENCE();
+	intptr_t top = ATOMIC_LOAD(&stack->top);
+	if (top > bottom)
+	{
+		ATOMIC_STORE(&stack->bottom, bottom + 1);
+		return FALSE;
+	}
+	*block = array->entries[bottom & array->mask].block;
+	*size = array->entries[bottom & array->mask].size;
+	if (top == bottom)
+	{
+		// The last entry, a thief could be taking it as well
+		bool_t taken = ATOMIC_CAS(&stack->top, top, top + 1);
+		ATOMIC_STORE(&stack->bottom, bottom + 1);
+		return taken;
+	}
+	return TRUE;
+}
+
+// Steals the oldest block from the top of the stack
+bool_t mark_stack_steal(mark_stack_t stack, void** block, size_t* size)
+{
+	intptr_t top = ATOMIC_LOAD(&stack->top);
+	ATOMIC_FENCE();
+	intptr_t bottom = ATOMIC_LOAD(&stack->bottom);
+	if (top >= bottom) return FALSE;
+	mark_array_t array = (mark_array_t)ATOMIC_LOAD(&stack->array);
+	void* stolen_block = array->entries[top & array->mask].block;
+	size_t stolen_size = array->entries[top & array->mask].size;
+	if (!ATOMIC_CAS(&stack->top, top, top + 1)) return FALSE;
+	*block = stolen_block;
+	*size = stolen_size;
+	return TRUE;
+}
+
+// Checks whether a thief could find some entries in the stack
+bool_t mark_stack_is_empty(mark_stack_t stack)
+{
+	return (intptr_t)ATOMIC_LOAD(&stack->top) >= (intptr_t)ATOMIC_LOAD(&stack->bottom);
+}
+
+// Returns and clears the overflow flag
+bool_t mark_stack_take_overflow(mark_stack_t stack)
+{
+	bool_t overflowed = stack->overflowed;
+	stack->overflowed = FALSE;
+	return overflowed;
+}
+
+// Releases the arrays replaced while growing, the stack must be empty and unused by other threads
+void mark_stack_reset(mark_stack_t stack)
+{
+	mark_array_t array = stack->array->previous;
+	stack->array->previous = NULL;
+	while (array != NULL)
+	{
+		mark_array_t previous = array->previous;
+		release_pages(array, ARRAY_BYTES(array->mask + 1));
+		array = previous;
+	}
+}
@@ -0,0 +1,83 @@
+#ifndef MARK_STACK_H
+#define MARK_STACK_H
+
+#include "../../Misc/GC_definitions.h"
+
+// The stack of the blocks that have been marked but not scanned yet, each
+// marking thread owns one and the others can steal its oldest entries
+typedef struct mark_stack_s* mark_stack_t;
+
+/* ---------------------------------------------------------------------
+*  mark_stack_init
+*  ---------------------------------------------------------------------
+*  Description:
+*    Allocates an empty mark stack, or returns NULL on failure */
+mark_stack_t mark_stack_init();
+
+/* ---------------------------------------------------------------------
+*  mark_stack_push
+*  ---------------------------------------------------------------------
+*  Description:
+*    Pushes a marked block on the stack, growing it if needed. If the
+*    stack can't grow anymore the block is dropped and the stack
+*    remembers it overflowed, so that the marked blocks get rescanned
+*  Parameters:
+*    stack ---> The mark stack in use
+*    block ---> The first address of the block to scan
+*    size ---> The size of the block */
+void mark_stack_push(mark_stack_t stack, void* block, size_t size);
+
+/* ---------------------------------------------------------------------
+*  mark_stack_pop
+*  ---------------------------------------------------------------------
+*  Description:
+*    Pops the last pushed block. Returns FALSE if the stack is empty.
+*    Only the thread that owns the stack can pop from it
+*  Parameters:
+*    stack ---> The mark stack in use
+*    block ---> Set to the first address of the popped block
+*    size ---> Set to the size of the popped block */
+bool_t mark_stack_pop(mark_stack_t stack, void** block, size_t* size);
+
+/* ---------------------------------------------------------------------
+*  mark_stack_steal
+*  ---------------------------------------------------------------------
+*  Description:
+*    Takes the oldest block of a stack owned by another thread. Returns
+*    FALSE if the stack is empty or if another thread took the block first
+*  Parameters:
+*    stack ---> The mark stack to steal from
+*    block ---> Set to the first address of the stolen block
+*    size ---> Set to the size of the stolen block */
+bool_t mark_stack_steal(mark_stack_t stack, void** block, size_t* size);
+
+/* ---------------------------------------------------------------------
+*  mark_stack_is_empty
+*  ---------------------------------------------------------------------
+*  Description:
+*    Returns TRUE if there is nothing to steal from the stack
+*  Parameters:
+*    stack ---> The mark stack to check */
+bool_t mark_stack_is_empty(mark_stack_t stack);
+
+/* ---------------------------------------------------------------------
+*  mark_stack_take_overflow
+*  ---------------------------------------------------------------------
+*  Description:
+*    Returns TRUE if some blocks were dropped since the last call, and
+*    resets the overflow flag of the stack
+*  Parameters:
+*    stack ---> The mark stack in use */
+bool_t mark_stack_take_overflow(mark_stack_t stack);
+
+/* ---------------------------------------------------------------------
+*  mark_stack_reset
+*  ---------------------------------------------------------------------
+*  Description:
+*    Releases the arrays that were replaced while the stack grew. It
+*    must only be called when no other thread is using the stack
+*  Parameters:
+*    stack ---> The mark stack in use */
+void mark_stack_reset(mark_stack_t stack);
+
+#endif
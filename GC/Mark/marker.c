@@ -0,0 +1,613 @@
+#include <string.h>
+#if defined __AVX2__
+#include <immintrin.h>
+#endif
+#include "../../Misc/GC_definitions.h"
+#include "../../Misc/GC_atomic.h"
+#include "../../Misc/GC_threads.h"
+#include "../../HashMap/hash_map_t.h"
+#include "../Heap/heap.h"
+#include "../Heap/page_map.h"
+#include "../Heap/blacklist.h"
+#include "mark_stack.h"
+#include "type_descriptor.h"
+#include "marker.h"
+
+/* =========== Local constants ===========*/
+
+// Number of popped blocks whose memory is prefetched before they are scanned
+#define PREFETCH_DISTANCE 8
+
+// Size of the pieces of the root ranges claimed by the marking threads
+#define ROOT_CHUNK_SIZE 4096
+
+// Number of busy waiting iterations of an idle marking thread before it starts yielding
+#define IDLE_SPINS 64
+
+#define WORD_BITS (sizeof(uintptr_t) * 8)
+
+// Number of words compared against the heap bounds at once by the conservative scans
+#define SCAN_BATCH_WORDS 8
+
+// The AVX2 kernel compares four 64 bit words at a time, the other targets use the scalar one
+#if defined __AVX2__ && UINTPTR_MAX == UINT64_MAX
+#define SCAN_AVX2
+#endif
+
+/* =========== Global variables ===========*/
+
+// The hash map that tracks the large blocks
+static hash_map_t allocation_map;
+static bool_t interior_pointers = FALSE;
+static bool_t misaligned_pointers = FALSE;
+
+// The stacks of the marking threads, the first one belongs to the collector thread
+static mark_stack_t mark_stacks[MARKER_MAX_THREADS];
+static unsigned int threads_count = 1;
+
+// The helper threads are started once and wait for the next cycle between two collections
+#if defined POSIX_THREADS || defined WIN_THREADS
+static unsigned int started_threads = 1;
+static gc_mutex_t cycle_lock;
+static gc_cond_t cycle_started;
+static gc_cond_t cycle_finished;
+static unsigned int cycle = 0;
+static unsigned int finished_threads;
+#endif
+
+// The state of the current marking phase, shared by all the marking threads
+static root_range_t* root_ranges;
+static int root_ranges_count;
+static uintptr_t root_chunks_count;
+static uintptr_t next_root_chunk;
+static uintptr_t idle_threads;
+
+// The candidate pointers read by each marking thread and those that fell into the GC memory,
+// added to the shared totals when the thread runs out of work
+static THREAD_LOCAL uintptr_t local_candidates = 0;
+static THREAD_LOCAL uintptr_t local_hits = 0;
+static uintptr_t total_candidates = 0;
+static uintptr_t total_hits = 0;
+
+/* ============================================================================
+*  Setup
+*  ========================================================================= */
+
+// Allocates the stack of the collector thread
+bool_t marker_init(hash_map_t large_blocks)
+{
+	allocation_map = large_blocks;
+#if defined POSIX_THREADS || defined WIN_THREADS
+	if (!MUTEX_INIT(cycle_lock) || !COND_INIT(cycle_started) || !COND_INIT(cycle_finished)) return FALSE;
+#endif
+	mark_stacks[0] = mark_stack_init();
+	return mark_stacks[0] != NULL;
+}
+
+// Private functions prototypes
+static bool_t start_marking_thread(unsigned int index);
+
+// Starts the new marking threads, the existing ones are kept waiting if the count decreases
+bool_t marker_set_threads(unsigned int count)
+{
+	if (count == 0 || count > MARKER_MAX_THREADS) return FALSE;
+#if !defined POSIX_THREADS && !defined WIN_THREADS
+	if (count != 1) return FALSE;
+#else
+	for (; started_threads < count; started_threads++)
+	{
+		if (mark_stacks[started_threads] == NULL && (mark_stacks[started_threads] = mark_stack_init()) == NULL) return FALSE;
+		if (!start_marking_thread(started_threads)) return FALSE;
+	}
+#endif
+	threads_count = count;
+	return TRUE;
+}
+
+// Sets whether the addresses inside the blocks keep them alive
+void marker_set_interior_pointers(bool_t enabled)
+{
+	interior_pointers = enabled;
+}
+
+// Sets whether the conservative scans read the misaligned words too
+void marker_set_misaligned_pointers(bool_t enabled)
+{
+	misaligned_pointers = enabled;
+}
+
+/* ============================================================================
+*  Scanning
+*  ========================================================================= */
+
+// Marks the block referenced by a candidate pointer, returns its size if it wasn't marked yet.
+// The ambiguous candidates come from the conservative scans and pin the heap pages they reach
+static inline size_t mark_block(void* candidate, bool_t ambiguous, void** block)
+{
+	// A single page map lookup rejects the addresses that don't belong to the GC. The ambiguous
+	// ones that fall between its blocks are blacklisted, so that no block is placed there
+	uintptr_t owner = page_map_get(candidate);
+	if (owner == 0)
+	{
+		if (ambiguous) blacklist_add(candidate);
+		return 0;
+	}
+	local_hits++;
+
+	// Heap pages hold the marks of their blocks, the hash map only tracks the large ones
+	if (!(owner & PAGE_MAP_LARGE_BLOCK)) return heap_mark_block((heap_page_t)owner, candidate, interior_pointers, ambiguous, block);
+	void* start = (void*)(owner & ~PAGE_MAP_TAGS);
+	if (start != candidate && !interior_pointers) return 0;
+	size_t allocated_size = mark_as_valid_if_present(allocation_map, start);
+
+	// The pointer-free blocks are marked but never scanned, the typed ones are tagged like the heap does
+	*block = (owner & PAGE_MAP_TYPED) ? (void*)((uintptr_t)start | HEAP_TYPED_BLOCK) : start;
+	return (owner & PAGE_MAP_POINTER_FREE) ? 0 : allocated_size;
+}
+
+// Returns a bit for each word of a batch starting at the given address, set if the word is inside
+// the heap bounds: the word minus the lower bound is below the span, as an unsigned number
+static inline unsigned int batch_in_bounds(const char* position, uintptr_t lower, uintptr_t span)
+{
+#if defined SCAN_AVX2
+	// There are only signed comparisons, flipping the sign bits turns them into unsigned ones
+	const __m256i sign = _mm256_set1_epi64x(INT64_MIN);
+	const __m256i low = _mm256_set1_epi64x((long long)lower);
+	const __m256i limit = _mm256_xor_si256(_mm256_set1_epi64x((long long)span), sign);
+	unsigned int mask = 0, i;
+	for (i = 0; i < SCAN_BATCH_WORDS; i += 4)
+	{
+		__m256i words = _mm256_loadu_si256((const __m256i*)(position + i * sizeof(void*)));
+		__m256i offsets = _mm256_xor_si256(_mm256_sub_epi64(words, low), sign);
+		__m256i inside = _mm256_cmpgt_epi64(limit, offsets);
+		mask |= (unsigned int)_mm256_movemask_pd(_mm256_castsi256_pd(inside)) << i;
+	}
+	return mask;
+#else
+	// Without branches, so that the compiler can vectorize the loop where possible
+	unsigned int mask = 0, i;
+	for (i = 0; i < SCAN_BATCH_WORDS; i++)
+	{
+		uintptr_t word;
+		memcpy(&word, position + i * sizeof(void*), sizeof(void*));
+		mask |= (unsigned int)(word - lower < span) << i;
+	}
+	return mask;
+#endif
+}
+
+// Marks the candidate read at the given address and pushes its block if it wasn't marked yet
+static inline void scan_candidate(mark_stack_t stack, const char* position)
+{
+	void* candidate;
+	void* block;
+	memcpy(&candidate, position, sizeof(void*));
+	size_t allocated_size = mark_block(candidate, TRUE, &block);
+	if (allocated_size != 0)
+	{
+		mark_stack_push(stack, block, allocated_size);
+	}
+}
+
+// Scans the words read every sizeof(void*) bytes from the first address up to the last one. Only
+// the words inside the heap bounds reach the page map, most of the others are rejected in batches
+static void scan_words(mark_stack_t stack, const char* position, const char* last)
+{
+	if (position > last) return;
+	size_t words = (size_t)(last - position) / sizeof(void*) + 1;
+	local_candidates += words;
+	char* lower_bound;
+	char* upper_bound;
+	page_map_bounds(&lower_bound, &upper_bound);
+	if (upper_bound <= lower_bound) return;
+	uintptr_t lower = (uintptr_t)lower_bound, span = (uintptr_t)(upper_bound - lower_bound);
+	for (; words >= SCAN_BATCH_WORDS; words -= SCAN_BATCH_WORDS, position += SCAN_BATCH_WORDS * sizeof(void*))
+	{
+		unsigned int mask = batch_in_bounds(position, lower, span);
+		while (mask != 0)
+		{
+			scan_candidate(stack, position + count_trailing_zeros(mask) * sizeof(void*));
+			mask &= mask - 1;
+		}
+	}
+	for (; words > 0; words--, position += sizeof(void*))
+	{
+		uintptr_t word;
+		memcpy(&word, position, sizeof(void*));
+		if (word - lower < span) scan_candidate(stack, position);
+	}
+}
+
+// Scans a memory area and pushes the blocks it references that weren't marked yet. The
+// candidates are read at the aligned addresses, or at every byte if it was requested
+static void scan_range(mark_stack_t stack, void* pointer, size_t allocated_space)
+{
+	if (allocated_space < sizeof(void*)) return;
+	char* start = (char*)pointer;
+	char* last = start + allocated_space - sizeof(void*);
+	if (misaligned_pointers)
+	{
+		// Each pass reads the words at a different offset from the start
+		size_t offset;
+		for (offset = 0; offset < sizeof(void*); offset++) scan_words(stack, start + offset, last);
+		return;
+	}
+	char* first = (char*)(((uintptr_t)start + sizeof(void*) - 1) & ~(uintptr_t)(sizeof(void*) - 1));
+	scan_words(stack, first, last);
+}
+
+// Scans only the words of a typed block that its descriptor marks as pointers
+static void scan_typed_block(mark_stack_t stack, void* pointer, size_t allocated_space)
+{
+	type_descriptor_t descriptor = *DESCRIPTOR_SLOT(pointer, allocated_space);
+
+	// The descriptor of a block that is still being allocated may not be stored yet
+	if (descriptor == NULL)
+	{
+		scan_range(stack, pointer, allocated_space);
+		return;
+	}
+	void** words = (void**)pointer;
+	size_t count = allocated_space / sizeof(void*) - 1;
+	if (descriptor->words < count) count = descriptor->words;
+	size_t w;
+	for (w = 0; w * WORD_BITS < count; w++)
+	{
+		uintptr_t bits = descriptor->bits[w];
+		while (bits != 0)
+		{
+			size_t index = w * WORD_BITS + count_trailing_zeros(bits);
+			if (index >= count) break;
+			bits &= bits - 1;
+			local_candidates++;
+			void* block;
+			size_t allocated_size = mark_block(words[index], FALSE, &block);
+			if (allocated_size != 0)
+			{
+				mark_stack_push(stack, block, allocated_size);
+			}
+		}
+	}
+}
+
+// Scans a block popped from a mark stack, with its descriptor if it has one
+static inline void scan_block(mark_stack_t stack, void* block, size_t size)
+{
+	if ((uintptr_t)block & HEAP_TYPED_BLOCK) scan_typed_block(stack, (void*)((uintptr_t)block & ~HEAP_TYPED_BLOCK), size);
+	else scan_range(stack, block, size);
+}
+
+// Scans the blocks on a mark stack until it is empty. The popped blocks wait in a small
+// FIFO after being prefetched, so that their memory is in the cache when they are scanned
+static void drain_mark_stack(mark_stack_t stack)
+{
+	void* fifo_blocks[PREFETCH_DISTANCE];
+	size_t fifo_sizes[PREFETCH_DISTANCE];
+	unsigned int head = 0, count = 0;
+	for (;;)
+	{
+		while (count < PREFETCH_DISTANCE)
+		{
+			unsigned int tail = (head + count) % PREFETCH_DISTANCE;
+			if (!mark_stack_pop(stack, fifo_blocks + tail, fifo_sizes + tail)) break;
+			PREFETCH(fifo_blocks[tail]);
+			count++;
+		}
+		if (count == 0) return;
+		void* block = fifo_blocks[head];
+		size_t size = fifo_sizes[head];
+		head = (head + 1) % PREFETCH_DISTANCE;
+		count--;
+		scan_block(stack, block, size);
+	}
+}
+
+// Scans a marked block found while rescanning the heap, and everything it leads to
+static void rescan_marked_block(void* pointer, size_t size)
+{
+	// The heap already skips its pointer-free blocks and tags its typed ones, the large ones are checked here
+	uintptr_t owner = page_map_get(pointer);
+	if (owner & PAGE_MAP_LARGE_BLOCK)
+	{
+		if (owner & PAGE_MAP_POINTER_FREE) return;
+		if (owner & PAGE_MAP_TYPED) pointer = (void*)((uintptr_t)pointer | HEAP_TYPED_BLOCK);
+	}
+	scan_block(mark_stacks[0], pointer, size);
+	drain_mark_stack(mark_stacks[0]);
+}
+
+/* ============================================================================
+*  Marking threads
+*  ========================================================================= */
+
+// Adds the counters of the calling thread to the totals
+static void flush_counters()
+{
+	ATOMIC_FETCH_ADD(&total_candidates, local_candidates);
+	ATOMIC_FETCH_ADD(&total_hits, local_hits);
+	local_candidates = 0;
+	local_hits = 0;
+}
+
+// Scans the root chunk with the given index, the last word of a chunk may cross into the next one
+static void scan_root_chunk(mark_stack_t stack, uintptr_t chunk)
+{
+	int i;
+	for (i = 0; i < root_ranges_count; i++)
+	{
+		if (root_ranges[i].end <= root_ranges[i].start) continue;
+		size_t size = root_ranges[i].end - root_ranges[i].start;
+		uintptr_t chunks = (size + ROOT_CHUNK_SIZE - 1) / ROOT_CHUNK_SIZE;
+		if (chunk < chunks)
+		{
+			size_t offset = chunk * ROOT_CHUNK_SIZE;
+			size_t length = size - offset < ROOT_CHUNK_SIZE + sizeof(void*) - 1 ? size - offset : ROOT_CHUNK_SIZE + sizeof(void*) - 1;
+			scan_range(stack, root_ranges[i].start + offset, length);
+			return;
+		}
+		chunk -= chunks;
+	}
+}
+
+// Takes a block from the stack of another marking thread
+static bool_t steal_block(unsigned int index, void** block, size_t* size)
+{
+	unsigned int i;
+	for (i = 1; i < threads_count; i++)
+	{
+		if (mark_stack_steal(mark_stacks[(index + i) % threads_count], block, size)) return TRUE;
+	}
+	return FALSE;
+}
+
+// Checks whether any marking thread has blocks that can be stolen
+static bool_t work_available()
+{
+	unsigned int i;
+	for (i = 0; i < threads_count; i++)
+	{
+		if (!mark_stack_is_empty(mark_stacks[i])) return TRUE;
+	}
+	return FALSE;
+}
+
+// The body of a marking thread: it claims root chunks while there are any left,
+// then steals blocks from the others until all the threads run out of work
+static void run_marking_thread(unsigned int index)
+{
+	mark_stack_t stack = mark_stacks[index];
+	for (;;)
+	{
+		uintptr_t chunk = ATOMIC_FETCH_ADD(&next_root_chunk, 1);
+		if (chunk >= root_chunks_count) break;
+		scan_root_chunk(stack, chunk);
+		drain_mark_stack(stack);
+	}
+	for (;;)
+	{
+		void* block;
+		size_t size;
+		drain_mark_stack(stack);
+		if (steal_block(index, &block, &size))
+		{
+			scan_block(stack, block, size);
+			continue;
+		}
+
+		// An idle thread never pushes new blocks, so when all of them are idle the marking is over
+		flush_counters();
+		ATOMIC_FETCH_ADD(&idle_threads, 1);
+		unsigned int spins;
+		for (spins = 0;; spins++)
+		{
+			if (ATOMIC_LOAD(&idle_threads) == threads_count) return;
+			if (work_available())
+			{
+				ATOMIC_FETCH_ADD(&idle_threads, (uintptr_t)-1);
+				break;
+			}
+
+			// Give the CPU to the busy threads if the wait takes long
+			if (spins < IDLE_SPINS) CPU_RELAX();
+			else THREAD_YIELD();
+		}
+	}
+}
+
+#if defined POSIX_THREADS || defined WIN_THREADS
+
+// Waits for each cycle and joins it if the thread is among the requested ones
+static void run_helper_thread(unsigned int index)
+{
+	unsigned int seen_cycle = 0;
+	for (;;)
+	{
+		MUTEX_LOCK(cycle_lock);
+		while (cycle == seen_cycle)
+		{
+			COND_WAIT(cycle_started, cycle_lock);
+		}
+		seen_cycle = cycle;
+		bool_t selected = index < threads_count;
+		MUTEX_UNLOCK(cycle_lock);
+		if (!selected) continue;
+
+		run_marking_thread(index);
+
+		MUTEX_LOCK(cycle_lock);
+		if (++finished_threads == threads_count - 1) COND_BROADCAST(cycle_finished);
+		MUTEX_UNLOCK(cycle_lock);
+	}
+}
+
+// Entry point of the helper marking threads
+#if defined WIN_THREADS
+static DWORD WINAPI marking_thread(LPVOID lparam)
+{
+	run_helper_thread((unsigned int)(uintptr_t)lparam);
+	return 0;
+}
+#else
+static void* marking_thread(void* lparam)
+{
+	run_helper_thread((unsigned int)(uintptr_t)lparam);
+	return NULL;
+}
+#endif
+
+// Starts a helper marking thread, it lives as long as the process
+static bool_t start_marking_thread(unsigned int index)
+{
+#if defined WIN_THREADS
+	HANDLE thread = CreateThread(NULL, 0, marking_thread, (LPVOID)(uintptr_t)index, 0, NULL);
+	if (thread == NULL) return FALSE;
+	CloseHandle(thread);
+#else
+	pthread_t thread;
+	if (pthread_create(&thread, NULL, marking_thread, (void*)(uintptr_t)index) != 0) return FALSE;
+	pthread_detach(thread);
+#endif
+	return TRUE;
+}
+#endif
+
+// Marks from the root ranges with all the marking threads, returns TRUE if some marked blocks
+// were dropped by a full stack and their children still have to be reached
+static bool_t mark_in_parallel(root_range_t* ranges, int count)
+{
+	int i;
+	root_ranges = ranges;
+	root_ranges_count = count;
+	root_chunks_count = 0;
+	for (i = 0; i < count; i++)
+	{
+		if (ranges[i].end > ranges[i].start) root_chunks_count += (ranges[i].end - ranges[i].start + ROOT_CHUNK_SIZE - 1) / ROOT_CHUNK_SIZE;
+	}
+	next_root_chunk = 0;
+	idle_threads = 0;
+
+	// Wake up the helper threads, the collector thread marks as well
+	unsigned int t;
+#if defined POSIX_THREADS || defined WIN_THREADS
+	if (threads_count > 1)
+	{
+		MUTEX_LOCK(cycle_lock);
+		finished_threads = 0;
+		cycle++;
+		COND_BROADCAST(cycle_started);
+		MUTEX_UNLOCK(cycle_lock);
+	}
+#endif
+	run_marking_thread(0);
+#if defined POSIX_THREADS || defined WIN_THREADS
+	if (threads_count > 1)
+	{
+		MUTEX_LOCK(cycle_lock);
+		while (finished_threads < threads_count - 1)
+		{
+			COND_WAIT(cycle_finished, cycle_lock);
+		}
+		MUTEX_UNLOCK(cycle_lock);
+	}
+#endif
+
+	bool_t overflowed = FALSE;
+	for (t = 0; t < threads_count; t++)
+	{
+		if (mark_stack_take_overflow(mark_stacks[t])) overflowed = TRUE;
+		mark_stack_reset(mark_stacks[t]);
+	}
+	return overflowed;
+}
+
+// Scans all the marked blocks again, until no block is dropped anymore
+void marker_rescan()
+{
+	do
+	{
+		heap_visit_marked_blocks(rescan_marked_block);
+		visit_valid_entries(allocation_map, rescan_marked_block);
+	} while (mark_stack_take_overflow(mark_stacks[0]));
+	mark_stack_reset(mark_stacks[0]);
+	flush_counters();
+}
+
+// Marks everything reachable from the root ranges
+void mark_from_roots(root_range_t* ranges, int count)
+{
+	if (mark_in_parallel(ranges, count)) marker_rescan();
+}
+
+// Marks from the root ranges while the program runs, the rescan is left to the final pause
+bool_t mark_from_roots_concurrently(root_range_t* ranges, int count)
+{
+	return mark_in_parallel(ranges, count);
+}
+
+// Scans the marked blocks that overlap each card, on a single thread as the cards are few
+void mark_from_cards(root_range_t* cards, int count)
+{
+	int i;
+	for (i = 0; i < count; i++)
+	{
+		// The large blocks released during the marking leave their cards behind
+		uintptr_t owner = page_map_get(cards[i].start);
+		if (owner == 0) continue;
+		if (!(owner & PAGE_MAP_LARGE_BLOCK)) heap_visit_marked_range((heap_page_t)owner, cards[i].start, cards[i].end, rescan_marked_block);
+		else if (!(owner & PAGE_MAP_POINTER_FREE))
+		{
+			scan_range(mark_stacks[0], cards[i].start, cards[i].end - cards[i].start);
+			drain_mark_stack(mark_stacks[0]);
+		}
+	}
+	if (mark_stack_take_overflow(mark_stacks[0])) marker_rescan();
+	else
+	{
+		mark_stack_reset(mark_stacks[0]);
+		flush_counters();
+	}
+}
+
+// Updates the pointer words of a marked typed block that reference evacuated blocks, the
+// other blocks were scanned conservatively so everything they reference was pinned
+static void forward_block_pointers(void* pointer, size_t size)
+{
+	if (!((uintptr_t)pointer & HEAP_TYPED_BLOCK))
+	{
+		// The large blocks visited from the hash map aren't tagged
+		uintptr_t owner = page_map_get(pointer);
+		if (!(owner & PAGE_MAP_LARGE_BLOCK) || !(owner & PAGE_MAP_TYPED)) return;
+	}
+	pointer = (void*)((uintptr_t)pointer & ~HEAP_TYPED_BLOCK);
+	type_descriptor_t descriptor = *DESCRIPTOR_SLOT(pointer, size);
+	if (descriptor == NULL) return;
+	void** words = (void**)pointer;
+	size_t count = size / sizeof(void*) - 1;
+	if (descriptor->words < count) count = descriptor->words;
+	size_t w;
+	for (w = 0; w * WORD_BITS < count; w++)
+	{
+		uintptr_t bits = descriptor->bits[w];
+		while (bits != 0)
+		{
+			size_t index = w * WORD_BITS + count_trailing_zeros(bits);
+			if (index >= count) break;
+			bits &= bits - 1;
+			words[index] = heap_forward(words[index]);
+		}
+	}
+}
+
+// Updates the precise pointers of all the marked blocks after an evacuation
+void marker_forward_pointers()
+{
+	heap_visit_marked_blocks(forward_block_pointers);
+	visit_valid_entries(allocation_map, forward_block_pointers);
+}
+
+// Reads the totals of the candidate pointers
+void marker_get_counters(uintptr_t* candidates, uintptr_t* hits)
+{
+	*candidates = ATOMIC_LOAD(&total_candidates);
+	*hits = ATOMIC_LOAD(&total_hits);
+}
@@ -0,0 +1,125 @@
+#ifndef MARKER_H
+#define MARKER_H
+
+#include <stdint.h>
+#include "../../Misc/GC_definitions.h"
+#include "../../HashMap/hash_map_t.h"
+
+// The highest number of threads that can mark the heap at once
+#define MARKER_MAX_THREADS 64
+
+// A memory area whose words are candidate pointers for the marking phase
+typedef struct root_range_s
+{
+	char* start;
+	char* end;
+} root_range_t;
+
+/* ---------------------------------------------------------------------
+*  marker_init
+*  ---------------------------------------------------------------------
+*  Description:
+*    Prepares the marker with a single marking thread. Returns FALSE
+*    if its data structures couldn't be allocated
+*  Parameters:
+*    large_blocks ---> The hash map that tracks the large blocks */
+bool_t marker_init(hash_map_t large_blocks);
+
+/* ---------------------------------------------------------------------
+*  marker_set_threads
+*  ---------------------------------------------------------------------
+*  Description:
+*    Sets the number of threads that mark the heap during a collection.
+*    The new helper threads are started here and wait for the following
+*    collections. Returns FALSE if the count is not valid or if a new
+*    thread or its marking stack couldn't be created
+*  Parameters:
+*    count ---> The number of marking threads, between 1 and MARKER_MAX_THREADS */
+bool_t marker_set_threads(unsigned int count);
+
+/* ---------------------------------------------------------------------
+*  marker_set_interior_pointers
+*  ---------------------------------------------------------------------
+*  Description:
+*    Enables or disables the recognition of the addresses that fall
+*    inside a block past its first address
+*  Parameters:
+*    enabled ---> TRUE to recognize interior pointers, FALSE otherwise */
+void marker_set_interior_pointers(bool_t enabled);
+
+/* ---------------------------------------------------------------------
+*  marker_set_misaligned_pointers
+*  ---------------------------------------------------------------------
+*  Description:
+*    Chooses whether the conservative scans read a candidate pointer at
+*    every byte or only at the addresses aligned to the pointer size
+*  Parameters:
+*    enabled ---> TRUE to also read the misaligned candidates */
+void marker_set_misaligned_pointers(bool_t enabled);
+
+/* ---------------------------------------------------------------------
+*  mark_from_roots
+*  ---------------------------------------------------------------------
+*  Description:
+*    Marks all the blocks reachable from the given root ranges. The
+*    ranges are split into chunks shared by the marking threads, which
+*    then steal the pending blocks from each other until none is left
+*  Parameters:
+*    ranges ---> The memory areas to scan for roots
+*    count ---> The number of root ranges */
+void mark_from_roots(root_range_t* ranges, int count);
+
+/* ---------------------------------------------------------------------
+*  mark_from_roots_concurrently
+*  ---------------------------------------------------------------------
+*  Description:
+*    Same as mark_from_roots, but it can run while the program keeps
+*    allocating, as it never walks the heap pages. Returns TRUE if some
+*    marked blocks were dropped by a full stack: marker_rescan must
+*    then be called once the program is stopped
+*  Parameters:
+*    ranges ---> The memory areas to scan for roots
+*    count ---> The number of root ranges */
+bool_t mark_from_roots_concurrently(root_range_t* ranges, int count);
+
+/* ---------------------------------------------------------------------
+*  mark_from_cards
+*  ---------------------------------------------------------------------
+*  Description:
+*    Scans again the marked blocks that overlap the dirty cards, and
+*    marks everything they lead to. The unmarked blocks are skipped, as
+*    they are scanned whole if the marking reaches them. Only the cards
+*    themselves are scanned in the large blocks
+*  Parameters:
+*    cards ---> The cards returned by the write barrier
+*    count ---> The number of cards */
+void mark_from_cards(root_range_t* cards, int count);
+
+/* ---------------------------------------------------------------------
+*  marker_rescan
+*  ---------------------------------------------------------------------
+*  Description:
+*    Scans all the marked blocks again, to reach the children of the
+*    blocks dropped by a full stack. It walks the whole heap */
+void marker_rescan();
+
+/* ---------------------------------------------------------------------
+*  marker_forward_pointers
+*  ---------------------------------------------------------------------
+*  Description:
+*    Updates the pointer words of all the marked typed blocks that
+*    reference blocks moved by heap_evacuate. The program must be stopped */
+void marker_forward_pointers();
+
+/* ---------------------------------------------------------------------
+*  marker_get_counters
+*  ---------------------------------------------------------------------
+*  Description:
+*    Reads the cumulative counters of the marking, they wrap around
+*  Parameters:
+*    candidates ---> Set to the number of words read as candidate pointers
+*    hits ---> Set to the number of candidates that fell into an area
+*              owned by the GC and had to be looked up */
+void marker_get_counters(uintptr_t* candidates, uintptr_t* hits);
+
+#endif
@@ -0,0 +1,86 @@
+#include <stdlib.h>
+#include <stdint.h>
+#include "../../Misc/GC_definitions.h"
+#include "../MemoryHelper/memory_helper.h"
+#include "marker.h"
+#include "root_set.h"
+
+/* =========== Global variables ===========*/
+
+// The areas added manually
+static root_range_t* added = NULL;
+static int added_count = 0;
+static int added_capacity = 0;
+
+// The ranges returned to the collector, the data segments first
+static root_range_t* gathered = NULL;
+static int gathered_count = 0;
+static int gathered_capacity = 0;
+
+// Set if a range couldn't be stored while gathering
+static bool_t gather_failed = FALSE;
+
+/* ============================================================================
+*  Root set functions
+*  ========================================================================= */
+
+// Appends a range to an array, growing it if needed
+static bool_t append_range(root_range_t** ranges, int* count, int* capacity, char* start, char* end)
+{
+	if (*count == *capacity)
+	{
+		int new_capacity = *capacity == 0 ? 16 : *capacity * 2;
+		root_range_t* resized = (root_range_t*)realloc(*ranges, new_capacity * sizeof(root_range_t));
+		if (resized == NULL) return FALSE;
+		*ranges = resized;
+		*capacity = new_capacity;
+	}
+	(*ranges)[*count].start = start;
+	(*ranges)[(*count)++].end = end;
+	return TRUE;
+}
+
+// Stores a new manual root
+bool_t root_set_add(void* start, void* end)
+{
+	if ((char*)end <= (char*)start) return TRUE;
+	return append_range(&added, &added_count, &added_capacity, (char*)start, (char*)end);
+}
+
+// Removes the manual roots inside a range, the order of the others doesn't matter
+void root_set_remove(void* start, void* end)
+{
+	int i = 0;
+	while (i < added_count)
+	{
+		if (added[i].start >= (char*)start && added[i].end <= (char*)end) added[i] = added[--added_count];
+		else i++;
+	}
+}
+
+// Adds a data segment to the gathered ranges
+static void add_data_segment(void* pointer, size_t size)
+{
+	if (!append_range(&gathered, &gathered_count, &gathered_capacity, (char*)pointer, (char*)pointer + size)) gather_failed = TRUE;
+}
+
+// Rebuilds the list of the static roots
+root_range_t* root_set_gather(int* count)
+{
+	gathered_count = 0;
+	gather_failed = FALSE;
+	visit_data_segments(add_data_segment);
+	int i;
+	for (i = 0; i < added_count; i++)
+	{
+		add_data_segment(added[i].start, added[i].end - added[i].start);
+	}
+
+	// Without all the roots the collection would release reachable blocks
+	if (gather_failed)
+	{
+		ERROR_HELPER("Error gathering the static roots");
+	}
+	*count = gathered_count;
+	return gathered;
+}
@@ -0,0 +1,42 @@
+#ifndef ROOT_SET_H
+#define ROOT_SET_H
+
+#include "../../Misc/GC_definitions.h"
+#include "marker.h"
+
+/* ---------------------------------------------------------------------
+*  root_set_add
+*  ---------------------------------------------------------------------
+*  Description:
+*    Adds a memory area to the roots scanned by every collection.
+*    Returns FALSE if it couldn't be stored
+*  Parameters:
+*    start ---> The first address of the area
+*    end ---> The address past the end of the area */
+bool_t root_set_add(void* start, void* end);
+
+/* ---------------------------------------------------------------------
+*  root_set_remove
+*  ---------------------------------------------------------------------
+*  Description:
+*    Removes all the areas added with root_set_add that are entirely
+*    inside the given range
+*  Parameters:
+*    start ---> The first address of the range
+*    end ---> The address past the end of the range */
+void root_set_remove(void* start, void* end);
+
+/* ---------------------------------------------------------------------
+*  root_set_gather
+*  ---------------------------------------------------------------------
+*  Description:
+*    Finds the data and BSS areas of the program again, as libraries
+*    may have been loaded, and returns them followed by the areas added
+*    manually. It takes the locks of the dynamic loader, so it must be
+*    called before stopping the other threads. The array is owned by
+*    the root set and stays valid until the next call
+*  Parameters:
+*    count ---> Set to the number of returned ranges */
+root_range_t* root_set_gather(int* count);
+
+#endif
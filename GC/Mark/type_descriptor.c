@@ -0,0 +1,53 @@
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include "../../Misc/GC_definitions.h"
+#include "type_descriptor.h"
+
+/* =========== Local constants ===========*/
+
+#define WORD_BITS (sizeof(uintptr_t) * 8)
+
+/* ============================================================================
+*  Descriptors creation
+*  ========================================================================= */
+
+// Allocates a descriptor with all the bits cleared
+static type_descriptor_t create_descriptor(size_t words)
+{
+	size_t bitmap_words = words == 0 ? 1 : (words + WORD_BITS - 1) / WORD_BITS;
+	type_descriptor_t descriptor = (type_descriptor_t)calloc(1, sizeof(struct type_descriptor_s) + (bitmap_words - 1) * sizeof(uintptr_t));
+	if (descriptor == NULL) return NULL;
+	descriptor->words = words;
+	return descriptor;
+}
+
+// Copies the bitmap, the bits past the described words are dropped
+type_descriptor_t descriptor_from_bitmap(const uintptr_t* bitmap, size_t words)
+{
+	type_descriptor_t descriptor = create_descriptor(words);
+	if (descriptor == NULL) return NULL;
+	size_t bitmap_words = (words + WORD_BITS - 1) / WORD_BITS;
+	memcpy(descriptor->bits, bitmap, bitmap_words * sizeof(uintptr_t));
+	if (words % WORD_BITS != 0) descriptor->bits[bitmap_words - 1] &= ((uintptr_t)1 << (words % WORD_BITS)) - 1;
+	return descriptor;
+}
+
+// Sets the bit of each offset, the type ends at the last pointer field
+type_descriptor_t descriptor_from_offsets(const size_t* offsets, size_t count)
+{
+	size_t i, words = 0;
+	for (i = 0; i < count; i++)
+	{
+		if (offsets[i] % sizeof(void*) != 0) return NULL;
+		if (offsets[i] / sizeof(void*) >= words) words = offsets[i] / sizeof(void*) + 1;
+	}
+	type_descriptor_t descriptor = create_descriptor(words);
+	if (descriptor == NULL) return NULL;
+	for (i = 0; i < count; i++)
+	{
+		size_t word = offsets[i] / sizeof(void*);
+		descriptor->bits[word / WORD_BITS] |= (uintptr_t)1 << (word % WORD_BITS);
+	}
+	return descriptor;
+}
@@ -0,0 +1,51 @@
+#ifndef TYPE_DESCRIPTOR_H
+#define TYPE_DESCRIPTOR_H
+
+#include <stdint.h>
+#include "../../Misc/GC_definitions.h"
+
+/* ---------------------------------------------------------------------
+*  type_descriptor_s
+*  ---------------------------------------------------------------------
+*  Description:
+*    The layout of the typed blocks of a type: one bit for each word of
+*    the block, set if the word may hold a pointer. The words past the
+*    end of the bitmap are never scanned
+*  Fields:
+*    words ---> The number of words described by the bitmap
+*    bits ---> The bitmap, starting from the lowest bit of its first word */
+struct type_descriptor_s
+{
+	size_t words;
+	uintptr_t bits[1];
+};
+
+typedef struct type_descriptor_s* type_descriptor_t;
+
+// The last word of a typed block holds its descriptor
+#define DESCRIPTOR_SLOT(block, size) ((type_descriptor_t*)((char*)(block) + (size)) - 1)
+
+/* ---------------------------------------------------------------------
+*  descriptor_from_bitmap
+*  ---------------------------------------------------------------------
+*  Description:
+*    Creates a descriptor from a copy of a bitmap. The descriptors live
+*    as long as the process. Returns NULL if the memory isn't available
+*  Parameters:
+*    bitmap ---> One bit for each word of the type, set for the pointers
+*    words ---> The number of words described by the bitmap */
+type_descriptor_t descriptor_from_bitmap(const uintptr_t* bitmap, size_t words);
+
+/* ---------------------------------------------------------------------
+*  descriptor_from_offsets
+*  ---------------------------------------------------------------------
+*  Description:
+*    Creates a descriptor from the offsets of the pointer fields of a
+*    type. Returns NULL if an offset isn't aligned to the size of a
+*    pointer or if the memory isn't available
+*  Parameters:
+*    offsets ---> The offsets in bytes of the pointer fields
+*    count ---> The number of offsets */
+type_descriptor_t descriptor_from_offsets(const size_t* offsets, size_t count);
+
+#endif
@@ -0,0 +1,96 @@
+#include <stdlib.h>
+#include "../../Misc/GC_definitions.h"
+#include "../../Misc/GC_atomic.h"
+#include "../Heap/page_map.h"
+#include "../Heap/heap.h"
+#include "marker.h"
+#include "write_barrier.h"
+
+/* =========== Local constants ===========*/
+
+// The cards are the granules of the page map
+#define CARD_SIZE PAGE_MAP_GRANULE
+
+// The highest number of dirty cards in a cycle, past it all the marked blocks are scanned again
+#define LOG_CAPACITY 65536
+
+/* =========== Global variables ===========*/
+
+// Indicates whether the writes are being recorded, and whether only the ones into old blocks are
+static uintptr_t barrier_active = 0;
+static bool_t old_blocks_only = FALSE;
+
+// The first address of each card that was dirtied in the current cycle
+static void** dirty_log = NULL;
+static uintptr_t dirty_count = 0;
+
+// The cards returned to the collector, reused by every cycle
+static root_range_t* dirty_ranges = NULL;
+
+/* ============================================================================
+*  Write barrier functions
+*  ========================================================================= */
+
+// Allocates the log and the ranges returned to the collector
+bool_t barrier_init()
+{
+	dirty_log = (void**)malloc(LOG_CAPACITY * sizeof(void*));
+	dirty_ranges = (root_range_t*)malloc(LOG_CAPACITY * sizeof(root_range_t));
+	return dirty_log != NULL && dirty_ranges != NULL;
+}
+
+// Starts recording the writes
+void barrier_enable(bool_t old_only)
+{
+	dirty_count = 0;
+	old_blocks_only = old_only;
+	ATOMIC_STORE(&barrier_active, 1);
+}
+
+// Stops recording the writes
+void barrier_disable()
+{
+	ATOMIC_STORE(&barrier_active, 0);
+}
+
+// Records a write, only the first write into each card appends it to the log
+void barrier_record(void* slot)
+{
+	if (!ATOMIC_LOAD(&barrier_active)) return;
+
+	// A young block is scanned whole when a minor collection reaches it, the large blocks are all old
+	if (old_blocks_only)
+	{
+		uintptr_t owner = page_map_get(slot);
+		if (owner == 0 || (!(owner & PAGE_MAP_LARGE_BLOCK) && !heap_is_marked((heap_page_t)owner, slot))) return;
+	}
+	if (!page_map_set_dirty(slot)) return;
+	uintptr_t index = ATOMIC_FETCH_ADD(&dirty_count, 1);
+	if (index < LOG_CAPACITY) dirty_log[index] = (void*)((uintptr_t)slot & ~(uintptr_t)(CARD_SIZE - 1));
+
+	// The card doesn't fit, the collector will scan everything again so the flag can be dropped
+	else page_map_clear_dirty(slot);
+}
+
+// Turns the log into card ranges and empties it
+root_range_t* barrier_take_dirty_cards(int* count, bool_t* overflowed)
+{
+	uintptr_t recorded = ATOMIC_LOAD(&dirty_count);
+	*overflowed = recorded > LOG_CAPACITY;
+	if (recorded > LOG_CAPACITY) recorded = LOG_CAPACITY;
+	uintptr_t i, kept = 0;
+	for (i = 0; i < recorded; i++)
+	{
+		page_map_clear_dirty(dirty_log[i]);
+
+		// The card of a large block freed after the write may not be readable anymore, the other ones
+		// are whole: they are inside a heap page or in the granules reserved for a large block
+		if (page_map_get(dirty_log[i]) == 0) continue;
+		dirty_ranges[kept].start = (char*)dirty_log[i];
+		dirty_ranges[kept].end = (char*)dirty_log[i] + CARD_SIZE;
+		kept++;
+	}
+	*count = (int)kept;
+	ATOMIC_STORE(&dirty_count, 0);
+	return dirty_ranges;
+}
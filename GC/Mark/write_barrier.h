@@ -0,0 +1,55 @@
+#ifndef WRITE_BARRIER_H
+#define WRITE_BARRIER_H
+
+#include "../../Misc/GC_definitions.h"
+#include "marker.h"
+
+/* ---------------------------------------------------------------------
+*  barrier_init
+*  ---------------------------------------------------------------------
+*  Description:
+*    Allocates the log of the dirty cards. Returns FALSE on failure */
+bool_t barrier_init();
+
+/* ---------------------------------------------------------------------
+*  barrier_enable
+*  ---------------------------------------------------------------------
+*  Description:
+*    Starts recording the writes into the GC memory, it is called when
+*    the concurrent marking starts and when the heap gets young blocks
+*  Parameters:
+*    old_only ---> TRUE to ignore the writes into the young blocks */
+void barrier_enable(bool_t old_only);
+
+/* ---------------------------------------------------------------------
+*  barrier_disable
+*  ---------------------------------------------------------------------
+*  Description:
+*    Stops recording the writes, the cards already logged are kept */
+void barrier_disable();
+
+/* ---------------------------------------------------------------------
+*  barrier_record
+*  ---------------------------------------------------------------------
+*  Description:
+*    Marks the card that contains the written address as dirty, if the
+*    barrier is enabled and the address belongs to the GC
+*  Parameters:
+*    slot ---> The address that was written */
+void barrier_record(void* slot);
+
+/* ---------------------------------------------------------------------
+*  barrier_take_dirty_cards
+*  ---------------------------------------------------------------------
+*  Description:
+*    Returns the cards written since the barrier was enabled or since
+*    the previous call, as ranges for mark_from_cards, and empties the
+*    log. The array is owned by the barrier and stays valid until the
+*    next call. The program must be stopped while this is called
+*  Parameters:
+*    count ---> Set to the number of returned cards
+*    overflowed ---> Set to TRUE if some cards didn't fit into the log,
+*                    all the marked blocks must then be scanned again */
+root_range_t* barrier_take_dirty_cards(int* count, bool_t* overflowed);
+
+#endif
@@ -1,26 +1,258 @@
+// pthread_getattr_np and mremap are GNU extensions
+#if defined __linux__ && !defined _GNU_SOURCE
+#define _GNU_SOURCE
+#endif
+
+#include <stdint.h>
+#include <string.h>
 #include "../../Misc/GC_definitions.h"
+#include "memory_helper.h"
+
+#if defined _WIN32
+#include <windows.h>
+#else
+#include <sys/mman.h>
+#include <pthread.h>
+#include <time.h>
+#endif
+#if defined __GLIBC__
+#include <malloc.h>
+#endif
+#if defined __linux__ || defined __FreeBSD__ || defined __NetBSD__ || defined __OpenBSD__
+#include <link.h>
+#define ELF_PROGRAM_HEADERS
+#elif defined(__APPLE__) && defined(__MACH__)
+#include <mach-o/getsect.h>
+#include <mach-o/ldsyms.h>
+#endif
 
 // Returns the stack pointer
-inline void* get_stack_pointer()
+void* get_stack_pointer()
 {
-	// Checks the current CPU architecture
-#if defined(__x86_64__) || defined(_M_X64)
-	asm("movq %rsp, %rax");
+	// The frame of this function is always below the one of its caller
+#if defined _MSC_VER
+	return _AddressOfReturnAddress();
 #else
-	asm("movl %esp, %eax");
+	return __builtin_frame_address(0);
+#endif
+}
+
+// Returns the highest address of the stack of the calling thread
+void* get_stack_base()
+{
+#if defined _WIN32
+	return ((NT_TIB*)NtCurrentTeb())->StackBase;
+#elif defined(__APPLE__) && defined(__MACH__)
+	return pthread_get_stackaddr_np(pthread_self());
+#elif defined __linux__
+	pthread_attr_t attributes;
+	void* address;
+	size_t size;
+	if (pthread_getattr_np(pthread_self(), &attributes) != 0) return NULL;
+	int result = pthread_attr_getstack(&attributes, &address, &size);
+	pthread_attr_destroy(&attributes);
+	return result == 0 ? (char*)address + size : NULL;
+#else
+	return NULL;
+#endif
+}
+
+#if defined ELF_PROGRAM_HEADERS
+
+// Visits the writable segments of a loaded object, their memory size includes the BSS
+static int visit_object_segments(struct dl_phdr_info* info, size_t size, void* data)
+{
+	(void)size;
+	block_visitor_t visitor = *(block_visitor_t*)data;
+	int i;
+	for (i = 0; i < info->dlpi_phnum; i++)
+	{
+		const ElfW(Phdr)* header = info->dlpi_phdr + i;
+		if (header->p_type != PT_LOAD || !(header->p_flags & PF_W)) continue;
+		visitor((void*)(info->dlpi_addr + header->p_vaddr), header->p_memsz);
+	}
+	return 0;
+}
+#endif
+
+// Visits the writable data and BSS areas of the executable and of the loaded libraries
+void visit_data_segments(block_visitor_t visitor)
+{
+#if defined ELF_PROGRAM_HEADERS
+	dl_iterate_phdr(visit_object_segments, &visitor);
+#elif defined _WIN32
+	// Only the sections of the executable, the DLLs have to add their roots manually
+	char* module = (char*)GetModuleHandle(NULL);
+	IMAGE_NT_HEADERS* headers = (IMAGE_NT_HEADERS*)(module + ((IMAGE_DOS_HEADER*)module)->e_lfanew);
+	IMAGE_SECTION_HEADER* section = IMAGE_FIRST_SECTION(headers);
+	WORD i;
+	for (i = 0; i < headers->FileHeader.NumberOfSections; i++, section++)
+	{
+		if (section->Characteristics & IMAGE_SCN_MEM_WRITE)
+		{
+			visitor(module + section->VirtualAddress, section->Misc.VirtualSize);
+		}
+	}
+#elif defined(__APPLE__) && defined(__MACH__)
+	unsigned long size;
+	uint8_t* data = getsegmentdata(&_mh_execute_header, "__DATA", &size);
+	if (data != NULL) visitor(data, size);
 #endif
 }
 
-#if !defined(_WIN32) && (defined(__unix__) || defined(__unix) || (defined(__APPLE__) && defined(__MACH__)))
-extern char edata;
+/* ============================================================================
+*  Clock and memory limit
+*  ========================================================================= */
 
-void* get_start_data_pointer()
+// Reads the monotonic clock of the OS
+uint64_t get_nanoseconds()
 {
-	return &edata;
+#if defined _WIN32
+	static LARGE_INTEGER frequency;
+	LARGE_INTEGER counter;
+	if (frequency.QuadPart == 0) QueryPerformanceFrequency(&frequency);
+	QueryPerformanceCounter(&counter);
+	return (uint64_t)counter.QuadPart / frequency.QuadPart * 1000000000u
+		+ (uint64_t)counter.QuadPart % frequency.QuadPart * 1000000000u / frequency.QuadPart;
+#else
+	struct timespec now;
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	return (uint64_t)now.tv_sec * 1000000000u + now.tv_nsec;
+#endif
 }
 
+// Reads the limit of the unified cgroup hierarchy, the "0::" line of /proc/self/cgroup holds its path
+size_t get_memory_limit()
+{
+#if defined __linux__
+	char line[4096], path[4200];
+	FILE* file = fopen("/proc/self/cgroup", "r");
+	if (file == NULL) return 0;
+	bool_t found = FALSE;
+	while (!found && fgets(line, sizeof(line), file) != NULL)
+	{
+		found = strncmp(line, "0::", 3) == 0;
+	}
+	fclose(file);
+	if (!found) return 0;
+	line[strcspn(line, "\n")] = '\0';
+	snprintf(path, sizeof(path), "/sys/fs/cgroup%s/memory.max", line + 3);
+
+	// The file holds either a number of bytes or "max"
+	unsigned long long limit = 0;
+	file = fopen(path, "r");
+	if (file == NULL) return 0;
+	if (fscanf(file, "%llu", &limit) != 1) limit = 0;
+	fclose(file);
+	return limit > SIZE_MAX ? SIZE_MAX : (size_t)limit;
+#else
+	return 0;
+#endif
+}
+
+/* ============================================================================
+*  OS pages
+*  ========================================================================= */
+
+// Reserves an aligned memory area from the OS
+void* reserve_aligned_pages(size_t size, size_t alignment)
+{
+#if defined _WIN32
+	// VirtualAlloc already returns 64KB aligned areas, bigger alignments need a manual retry
+	void* address = VirtualAlloc(NULL, size, MEM_RESERVE | MEM_COMMIT, PAGE_READWRITE);
+	if (address == NULL || ((uintptr_t)address & (alignment - 1)) == 0) return address;
+	VirtualFree(address, 0, MEM_RELEASE);
+	char* base = (char*)VirtualAlloc(NULL, size + alignment, MEM_RESERVE, PAGE_NOACCESS);
+	if (base == NULL) return NULL;
+	char* aligned = (char*)(((uintptr_t)base + alignment - 1) & ~(uintptr_t)(alignment - 1));
+	VirtualFree(base, 0, MEM_RELEASE);
+	return VirtualAlloc(aligned, size, MEM_RESERVE | MEM_COMMIT, PAGE_READWRITE);
+#else
+	// Map a bigger area and trim the unaligned head and the exceeding tail
+	char* base = (char*)mmap(NULL, size + alignment, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+	if (base == (char*)MAP_FAILED) return NULL;
+	char* aligned = (char*)(((uintptr_t)base + alignment - 1) & ~(uintptr_t)(alignment - 1));
+	size_t head = aligned - base, tail = alignment - head;
+	if (head != 0) munmap(base, head);
+	if (tail != 0) munmap(aligned + size, tail);
+	return aligned;
+#endif
+}
 
-void* get_bss_end_pointer()
+// Releases an area reserved with reserve_aligned_pages
+void release_pages(void* address, size_t size)
 {
-	//return sbrk(0);
-}
\ No newline at end of file
+#if defined _WIN32
+	VirtualFree(address, 0, MEM_RELEASE);
+#else
+	munmap(address, size);
+#endif
+}
+
+// Gives the physical memory of an area back to the OS, the address range stays reserved
+void decommit_pages(void* address, size_t size)
+{
+#if defined _WIN32
+	VirtualFree(address, size, MEM_DECOMMIT);
+#elif defined __linux__ || !defined MADV_FREE
+	madvise(address, size, MADV_DONTNEED);
+#else
+	madvise(address, size, MADV_FREE);
+#endif
+}
+
+// Makes a decommitted area usable again, only Windows needs to commit it explicitly
+bool_t recommit_pages(void* address, size_t size)
+{
+#if defined _WIN32
+	return VirtualAlloc(address, size, MEM_COMMIT, PAGE_READWRITE) != NULL;
+#else
+	(void)address;
+	(void)size;
+	return TRUE;
+#endif
+}
+
+// Asks the libc allocator to return its free memory to the OS, only glibc supports it
+void trim_libc_heap()
+{
+#if defined __GLIBC__
+	malloc_trim(0);
+#endif
+}
+
+// Resizes an area reserved with reserve_aligned_pages, only Linux can remap the pages
+void* resize_pages(void* address, size_t old_size, size_t new_size)
+{
+#if defined __linux__
+	void* result = mremap(address, old_size, new_size, MREMAP_MAYMOVE);
+	return result == MAP_FAILED ? NULL : result;
+#else
+	return NULL;
+#endif
+}
+
+/* ============================================================================
+*  Aligned blocks
+*  ========================================================================= */
+
+// Allocates an aligned block with the libc allocator
+void* aligned_block_alloc(size_t size, size_t alignment)
+{
+#if defined _WIN32
+	return _aligned_malloc(size, alignment);
+#else
+	void* pointer;
+	return posix_memalign(&pointer, alignment, size) == 0 ? pointer : NULL;
+#endif
+}
+
+// Deallocates an aligned block
+void aligned_block_free(void* pointer)
+{
+#if defined _WIN32
+	_aligned_free(pointer);
+#else
+	free(pointer);
+#endif
+}
@@ -1,6 +1,10 @@
 #ifndef MEMORY_HELPER_H
 #define MEMORY_HELPER_H
 
+#include <stddef.h>
+#include <stdint.h>
+#include "../../Misc/GC_definitions.h"
+
 /* ---------------------------------------------------------------------
 *  get_stack_pointer
 *  ---------------------------------------------------------------------
@@ -8,9 +12,128 @@
 *    Returns the pointer of the current top of the stack */
 void* get_stack_pointer();
 
-void* get_start_data_pointer();
+/* ---------------------------------------------------------------------
+*  get_stack_base
+*  ---------------------------------------------------------------------
+*  Description:
+*    Returns the highest address of the stack of the calling thread,
+*    or NULL if the OS doesn't expose it */
+void* get_stack_base();
+
+/* ---------------------------------------------------------------------
+*  visit_data_segments
+*  ---------------------------------------------------------------------
+*  Description:
+*    Calls the visitor with each writable data or BSS area of the
+*    program: the ones of all the loaded objects on ELF systems, the
+*    ones of the executable on Windows and macOS. Nothing is visited on
+*    the other systems
+*  Parameters:
+*    visitor ---> The function called with the start and the size of each area */
+void visit_data_segments(block_visitor_t visitor);
+
+/* ---------------------------------------------------------------------
+*  get_nanoseconds
+*  ---------------------------------------------------------------------
+*  Description:
+*    Returns the time of a monotonic clock in nanoseconds, only the
+*    differences between two calls are meaningful */
+uint64_t get_nanoseconds();
+
+/* ---------------------------------------------------------------------
+*  get_memory_limit
+*  ---------------------------------------------------------------------
+*  Description:
+*    Returns the memory.max limit of the cgroup v2 of the process on
+*    Linux, or 0 if there is no limit or it can't be read */
+size_t get_memory_limit();
+
+/* ---------------------------------------------------------------------
+*  reserve_aligned_pages
+*  ---------------------------------------------------------------------
+*  Description:
+*    Requests a zeroed, readable and writable memory area directly from
+*    the OS, bypassing the libc allocator. Returns NULL on failure
+*  Parameters:
+*    size ---> The size of the area, must be a multiple of the alignment
+*    alignment ---> The required alignment of the first address,
+*                   it must be a power of two */
+void* reserve_aligned_pages(size_t size, size_t alignment);
+
+/* ---------------------------------------------------------------------
+*  release_pages
+*  ---------------------------------------------------------------------
+*  Description:
+*    Returns a memory area obtained with reserve_aligned_pages to the OS
+*  Parameters:
+*    address ---> The first address of the area to release
+*    size ---> The size that was used when reserving the area */
+void release_pages(void* address, size_t size);
+
+/* ---------------------------------------------------------------------
+*  decommit_pages
+*  ---------------------------------------------------------------------
+*  Description:
+*    Returns the physical memory of a part of an area obtained with
+*    reserve_aligned_pages to the OS, the addresses stay reserved. The
+*    content is lost, recommit_pages must be called before reusing it
+*  Parameters:
+*    address ---> The first address to decommit, aligned to a system page
+*    size ---> The size to decommit, a multiple of the system page */
+void decommit_pages(void* address, size_t size);
+
+/* ---------------------------------------------------------------------
+*  recommit_pages
+*  ---------------------------------------------------------------------
+*  Description:
+*    Makes decommitted pages readable and writable again, they read as
+*    zeros or as their old content. Returns FALSE on failure
+*  Parameters:
+*    address ---> The first address that was decommitted
+*    size ---> The size that was decommitted */
+bool_t recommit_pages(void* address, size_t size);
 
+/* ---------------------------------------------------------------------
+*  trim_libc_heap
+*  ---------------------------------------------------------------------
+*  Description:
+*    Asks the libc allocator to return its unused memory to the OS,
+*    it does nothing if the libc doesn't support it */
+void trim_libc_heap();
 
-void* get_bss_end_pointer();
+/* ---------------------------------------------------------------------
+*  resize_pages
+*  ---------------------------------------------------------------------
+*  Description:
+*    Grows or shrinks an area obtained with reserve_aligned_pages
+*    without copying its content: the OS moves its pages to another
+*    address if it can't be resized in place. The new pages are zeroed.
+*    Returns the new address, or NULL if the OS can't resize the area,
+*    which is then left untouched
+*  Parameters:
+*    address ---> The first address of the area
+*    old_size ---> The current size of the area
+*    new_size ---> The requested size of the area */
+void* resize_pages(void* address, size_t old_size, size_t new_size);
+
+/* ---------------------------------------------------------------------
+*  aligned_block_alloc
+*  ---------------------------------------------------------------------
+*  Description:
+*    Allocates a memory block through the libc allocator, with its
+*    first address aligned to the given boundary. Returns NULL on failure
+*  Parameters:
+*    size ---> The size of the block
+*    alignment ---> The required alignment, a power of two */
+void* aligned_block_alloc(size_t size, size_t alignment);
+
+/* ---------------------------------------------------------------------
+*  aligned_block_free
+*  ---------------------------------------------------------------------
+*  Description:
+*    Deallocates a block obtained with aligned_block_alloc
+*  Parameters:
+*    pointer ---> The first address of the block */
+void aligned_block_free(void* pointer);
 
-#endif
\ No newline at end of file
+#endif
@@ -0,0 +1,385 @@
+#include <stdlib.h>
+#include <string.h>
+#include <setjmp.h>
+#include "../../Misc/GC_definitions.h"
+#include "../../Misc/GC_threads.h"
+#include "../../Misc/GC_atomic.h"
+#include "../MemoryHelper/memory_helper.h"
+#include "../Heap/page_map.h"
+#include "../Heap/thread_cache.h"
+#include "../Mark/marker.h"
+#include "thread_registry.h"
+
+#if defined POSIX_THREADS
+#include <errno.h>
+#include <signal.h>
+#include <semaphore.h>
+#endif
+
+/* =========== Local constants ===========*/
+
+// The signals used to stop and resume the threads, the same ones as most collectors on Linux
+#if defined POSIX_THREADS
+#if defined SIGPWR
+#define SUSPEND_SIGNAL SIGPWR
+#else
+#define SUSPEND_SIGNAL SIGUSR1
+#endif
+#define RESUME_SIGNAL SIGXCPU
+#endif
+
+// Each thread adds its stack, its registers and its cache to the roots
+#define RANGES_PER_THREAD 3
+
+// Maximum number of slots on the shadow stack of a thread, the pages are only committed when used
+#define SHADOW_STACK_SLOTS ((size_t)1 << 16)
+#define SHADOW_STACK_BYTES (SHADOW_STACK_SLOTS * sizeof(void*))
+
+/* =========== Types used in the file ===========*/
+
+/* ---------------------------------------------------------------------
+*  gc_thread_s
+*  ---------------------------------------------------------------------
+*  Description:
+*    The record of a registered thread
+*  Fields:
+*    cache ---> The blocks reserved by the thread
+*    stack_bottom ---> The highest address of the stack of the thread
+*    stack_top ---> The stack pointer saved when the thread was stopped
+*    id ---> The OS handle of the thread
+*    context ---> The registers saved when the thread was stopped, on
+*                 POSIX systems they are on the stack of the signal handler
+*    shadow_slots ---> The addresses of the roots pushed by the thread
+*    shadow_count ---> The number of pushed roots
+*    shadow_values ---> The values of the roots, copied while the thread is stopped
+*    next ---> The next registered thread */
+struct gc_thread_s
+{
+	struct thread_cache_s cache;
+	char* stack_bottom;
+	char* stack_top;
+#if defined POSIX_THREADS
+	pthread_t id;
+#elif defined WIN_THREADS
+	HANDLE id;
+	CONTEXT context;
+#endif
+	void*** shadow_slots;
+	uintptr_t shadow_count;
+	void** shadow_values;
+	struct gc_thread_s* next;
+};
+
+/* =========== Global variables ===========*/
+
+// The registered threads
+static gc_thread_t threads = NULL;
+static int threads_count = 0;
+
+// The ranges returned to the collector, grown when the threads are registered
+static root_range_t* ranges = NULL;
+static int ranges_capacity = 0;
+
+// The record of the calling thread
+static THREAD_LOCAL gc_thread_t current_thread = NULL;
+
+// Whether the shadow stacks replace the conservative scan of the stacks
+static bool_t precise_roots = FALSE;
+
+#if defined POSIX_THREADS
+
+// Set while the world is stopped, and posted by each thread when it stops and when it resumes
+static uintptr_t world_stopped = 0;
+static sem_t acknowledged;
+#endif
+
+/* ============================================================================
+*  Suspension handlers
+*  ========================================================================= */
+
+#if defined POSIX_THREADS
+
+// Saves the registers on the stack and waits until the world is started again
+static void suspend_handler(int signal)
+{
+	(void)signal;
+	int saved_errno = errno;
+	jmp_buf registers_backup;
+	setjmp(registers_backup);
+
+	// The saved registers and the signal context are both above the top of the stack
+	current_thread->stack_top = (char*)get_stack_pointer();
+	sem_post(&acknowledged);
+	sigset_t mask;
+	sigfillset(&mask);
+	sigdelset(&mask, RESUME_SIGNAL);
+	while (ATOMIC_LOAD(&world_stopped))
+	{
+		sigsuspend(&mask);
+	}
+	sem_post(&acknowledged);
+	errno = saved_errno;
+}
+
+// Only interrupts the wait of the suspended threads
+static void resume_handler(int signal)
+{
+	(void)signal;
+}
+
+// Waits for all the stopped threads to acknowledge a signal
+static void wait_acknowledgements(int count)
+{
+	int i;
+	for (i = 0; i < count; i++)
+	{
+		while (sem_wait(&acknowledged) != 0 && errno == EINTR);
+	}
+}
+#endif
+
+/* ============================================================================
+*  Thread registry functions
+*  ========================================================================= */
+
+// Installs the suspension handlers
+bool_t registry_init()
+{
+#if defined POSIX_THREADS
+	if (sem_init(&acknowledged, 0, 0) != 0) return FALSE;
+
+	// The resume signal stays blocked while the thread is stopped, so it can't be lost before the wait
+	struct sigaction action;
+	memset(&action, 0, sizeof(action));
+	action.sa_handler = suspend_handler;
+	action.sa_flags = SA_RESTART;
+	sigfillset(&action.sa_mask);
+	if (sigaction(SUSPEND_SIGNAL, &action, NULL) != 0) return FALSE;
+	action.sa_handler = resume_handler;
+	sigemptyset(&action.sa_mask);
+	if (sigaction(RESUME_SIGNAL, &action, NULL) != 0) return FALSE;
+#endif
+	return TRUE;
+}
+
+// Allocates the record of the calling thread, and the room for its ranges
+gc_thread_t registry_add()
+{
+	if (current_thread != NULL) return current_thread;
+	if (ranges_capacity < (threads_count + 1) * RANGES_PER_THREAD)
+	{
+		int capacity = ranges_capacity == 0 ? 16 * RANGES_PER_THREAD : ranges_capacity * 2;
+		root_range_t* resized = (root_range_t*)realloc(ranges, capacity * sizeof(root_range_t));
+		if (resized == NULL) return NULL;
+		ranges = resized;
+		ranges_capacity = capacity;
+	}
+	gc_thread_t thread = (gc_thread_t)calloc(1, sizeof(struct gc_thread_s));
+	if (thread == NULL) return NULL;
+
+	// The shadow stack can't grow, as the thread may be stopped while it pushes a root
+	thread->shadow_slots = (void***)reserve_aligned_pages(SHADOW_STACK_BYTES, PAGE_MAP_GRANULE);
+	thread->shadow_values = (void**)reserve_aligned_pages(SHADOW_STACK_BYTES, PAGE_MAP_GRANULE);
+	if (thread->shadow_slots == NULL || thread->shadow_values == NULL)
+	{
+		if (thread->shadow_slots != NULL) release_pages(thread->shadow_slots, SHADOW_STACK_BYTES);
+		if (thread->shadow_values != NULL) release_pages(thread->shadow_values, SHADOW_STACK_BYTES);
+		free(thread);
+		return NULL;
+	}
+
+	// Without the real base, only the frames below the current one are scanned
+	thread->stack_bottom = (char*)get_stack_base();
+	if (thread->stack_bottom == NULL) thread->stack_bottom = (char*)get_stack_pointer();
+#if defined POSIX_THREADS
+	thread->id = pthread_self();
+#elif defined WIN_THREADS
+	if (!DuplicateHandle(GetCurrentProcess(), GetCurrentThread(), GetCurrentProcess(), &thread->id, 0, FALSE, DUPLICATE_SAME_ACCESS))
+	{
+		release_pages(thread->shadow_slots, SHADOW_STACK_BYTES);
+		release_pages(thread->shadow_values, SHADOW_STACK_BYTES);
+		free(thread);
+		return NULL;
+	}
+#endif
+	thread->next = threads;
+	threads = thread;
+	threads_count++;
+	current_thread = thread;
+	return thread;
+}
+
+// Unlinks the record of the calling thread and releases it
+void registry_remove(gc_thread_t thread)
+{
+	gc_thread_t* link = &threads;
+	while (*link != thread) link = &(*link)->next;
+	*link = thread->next;
+	threads_count--;
+	current_thread = NULL;
+#if defined WIN_THREADS
+	CloseHandle(thread->id);
+#endif
+	release_pages(thread->shadow_slots, SHADOW_STACK_BYTES);
+	release_pages(thread->shadow_values, SHADOW_STACK_BYTES);
+	free(thread);
+}
+
+// Returns the record stored in the thread local variable
+gc_thread_t registry_current()
+{
+	return current_thread;
+}
+
+// Returns the cache embedded in the record
+thread_cache_t registry_cache(gc_thread_t thread)
+{
+	return &thread->cache;
+}
+
+// Returns the stack base saved when the thread was registered
+char* registry_stack_bottom(gc_thread_t thread)
+{
+	return thread->stack_bottom;
+}
+
+// Chooses between the shadow stacks and the conservative scan of the stacks
+void registry_set_precise_roots(bool_t enabled)
+{
+	precise_roots = enabled;
+}
+
+// Pushes the address of a root, the count is published after the slot
+void registry_push_root(gc_thread_t thread, void** slot)
+{
+	uintptr_t count = thread->shadow_count;
+	if (count == SHADOW_STACK_SLOTS)
+	{
+		ERROR_HELPER("The shadow stack is full");
+	}
+	thread->shadow_slots[count] = slot;
+	ATOMIC_STORE(&thread->shadow_count, count + 1);
+}
+
+// Pops the last pushed roots
+void registry_pop_roots(gc_thread_t thread, unsigned int count)
+{
+	if (count > thread->shadow_count)
+	{
+		ERROR_HELPER("Popping more roots than the pushed ones");
+	}
+	ATOMIC_STORE(&thread->shadow_count, thread->shadow_count - count);
+}
+
+// Copies the values of the roots of a stopped thread, they are scanned like a stack
+static void copy_shadow_stack(gc_thread_t thread, root_range_t* range)
+{
+	uintptr_t i, count = thread->shadow_count;
+	for (i = 0; i < count; i++)
+	{
+		thread->shadow_values[i] = *thread->shadow_slots[i];
+	}
+	range->start = (char*)thread->shadow_values;
+	range->end = (char*)(thread->shadow_values + count);
+}
+
+// Stops the other threads and collects their roots
+root_range_t* registry_stop_world(gc_thread_t self, char* top, int* count)
+{
+	gc_thread_t thread;
+#if defined POSIX_THREADS
+	int stopped = 0;
+	ATOMIC_STORE(&world_stopped, 1);
+	for (thread = threads; thread != NULL; thread = thread->next)
+	{
+		if (thread == self) continue;
+		if (pthread_kill(thread->id, SUSPEND_SIGNAL) != 0)
+		{
+			ERROR_HELPER("Error stopping a thread");
+		}
+		stopped++;
+	}
+	wait_acknowledgements(stopped);
+#elif defined WIN_THREADS
+	for (thread = threads; thread != NULL; thread = thread->next)
+	{
+		if (thread == self) continue;
+
+		// Getting the context also waits for the thread to be actually suspended
+		thread->context.ContextFlags = CONTEXT_INTEGER | CONTEXT_CONTROL;
+		if (SuspendThread(thread->id) == (DWORD)-1 || !GetThreadContext(thread->id, &thread->context))
+		{
+			ERROR_HELPER("Error stopping a thread");
+		}
+#if defined _WIN64
+		thread->stack_top = (char*)thread->context.Rsp;
+#else
+		thread->stack_top = (char*)thread->context.Esp;
+#endif
+	}
+#endif
+
+	// The stacks, the saved registers and the cached blocks of all the threads.
+	// In precise mode, only the pushed roots replace both the stack and the registers
+	int used = 0;
+	for (thread = threads; thread != NULL; thread = thread->next)
+	{
+		if (precise_roots)
+		{
+			copy_shadow_stack(thread, ranges + used++);
+			ranges[used].start = (char*)&thread->cache;
+			ranges[used++].end = (char*)(&thread->cache + 1);
+			continue;
+		}
+		ranges[used].start = thread == self ? top : thread->stack_top;
+		ranges[used++].end = thread->stack_bottom;
+#if defined WIN_THREADS
+		if (thread != self)
+		{
+			ranges[used].start = (char*)&thread->context;
+			ranges[used++].end = (char*)(&thread->context + 1);
+		}
+#endif
+		ranges[used].start = (char*)&thread->cache;
+		ranges[used++].end = (char*)(&thread->cache + 1);
+	}
+	*count = used;
+	return ranges;
+}
+
+// Resumes the stopped threads
+void registry_start_world(gc_thread_t self)
+{
+	gc_thread_t thread;
+#if defined POSIX_THREADS
+	int stopped = 0;
+	ATOMIC_STORE(&world_stopped, 0);
+	for (thread = threads; thread != NULL; thread = thread->next)
+	{
+		if (thread == self) continue;
+		if (pthread_kill(thread->id, RESUME_SIGNAL) != 0)
+		{
+			ERROR_HELPER("Error resuming a thread");
+		}
+		stopped++;
+	}
+
+	// A thread that is still in the handler would miss the next stop
+	wait_acknowledgements(stopped);
+#elif defined WIN_THREADS
+	for (thread = threads; thread != NULL; thread = thread->next)
+	{
+		if (thread != self) ResumeThread(thread->id);
+	}
+#endif
+}
+
+// Empties the caches of all the threads
+void registry_flush_caches()
+{
+	gc_thread_t thread;
+	for (thread = threads; thread != NULL; thread = thread->next)
+	{
+		thread_cache_flush(&thread->cache);
+	}
+}
@@ -0,0 +1,129 @@
+#ifndef THREAD_REGISTRY_H
+#define THREAD_REGISTRY_H
+
+#include "../../Misc/GC_definitions.h"
+#include "../Heap/thread_cache.h"
+#include "../Mark/marker.h"
+
+// A thread that uses the GC, its stack and its cache are scanned by every collection
+typedef struct gc_thread_s* gc_thread_t;
+
+/* ---------------------------------------------------------------------
+*  registry_init
+*  ---------------------------------------------------------------------
+*  Description:
+*    Installs the handlers used to stop the threads. Returns FALSE on failure */
+bool_t registry_init();
+
+/* ---------------------------------------------------------------------
+*  registry_add
+*  ---------------------------------------------------------------------
+*  Description:
+*    Registers the calling thread and returns its record, or NULL if
+*    it couldn't be allocated. The lock must be held */
+gc_thread_t registry_add();
+
+/* ---------------------------------------------------------------------
+*  registry_remove
+*  ---------------------------------------------------------------------
+*  Description:
+*    Removes the calling thread from the registry. Its cache must have
+*    been flushed already. The lock must be held
+*  Parameters:
+*    thread ---> The record of the calling thread */
+void registry_remove(gc_thread_t thread);
+
+/* ---------------------------------------------------------------------
+*  registry_current
+*  ---------------------------------------------------------------------
+*  Description:
+*    Returns the record of the calling thread, or NULL if the thread
+*    isn't registered */
+gc_thread_t registry_current();
+
+/* ---------------------------------------------------------------------
+*  registry_cache
+*  ---------------------------------------------------------------------
+*  Description:
+*    Returns the allocation cache of a registered thread
+*  Parameters:
+*    thread ---> The record of the thread */
+thread_cache_t registry_cache(gc_thread_t thread);
+
+/* ---------------------------------------------------------------------
+*  registry_stack_bottom
+*  ---------------------------------------------------------------------
+*  Description:
+*    Returns the highest address of the stack of a registered thread
+*  Parameters:
+*    thread ---> The record of the thread */
+char* registry_stack_bottom(gc_thread_t thread);
+
+/* ---------------------------------------------------------------------
+*  registry_set_precise_roots
+*  ---------------------------------------------------------------------
+*  Description:
+*    Chooses whether the stacks of the threads are scanned conservatively
+*    or only the roots pushed on their shadow stacks are
+*  Parameters:
+*    enabled ---> TRUE to only scan the shadow stacks */
+void registry_set_precise_roots(bool_t enabled);
+
+/* ---------------------------------------------------------------------
+*  registry_push_root
+*  ---------------------------------------------------------------------
+*  Description:
+*    Pushes the address of a variable on the shadow stack of a thread,
+*    it doesn't need the lock
+*  Parameters:
+*    thread ---> The record of the calling thread
+*    slot ---> The address of the variable that holds the root */
+void registry_push_root(gc_thread_t thread, void** slot);
+
+/* ---------------------------------------------------------------------
+*  registry_pop_roots
+*  ---------------------------------------------------------------------
+*  Description:
+*    Removes the last roots pushed on the shadow stack of a thread
+*  Parameters:
+*    thread ---> The record of the calling thread
+*    count ---> The number of roots to remove */
+void registry_pop_roots(gc_thread_t thread, unsigned int count);
+
+/* ---------------------------------------------------------------------
+*  registry_stop_world
+*  ---------------------------------------------------------------------
+*  Description:
+*    Stops all the registered threads but the one that requested the
+*    collection, and returns the ranges to scan: the stacks, the saved
+*    registers and the caches of all the threads, or the values of the
+*    roots on their shadow stacks instead of the stacks and registers. The array is owned by
+*    the registry and stays valid until the world is started again.
+*    The lock must be held, and no thread can be stopped twice
+*  Parameters:
+*    self ---> The thread that requested the collection, it isn't stopped
+*    top ---> The top of the stack of that thread, its registers must
+*             have been saved below this address
+*    count ---> Set to the number of returned ranges */
+root_range_t* registry_stop_world(gc_thread_t self, char* top, int* count);
+
+/* ---------------------------------------------------------------------
+*  registry_start_world
+*  ---------------------------------------------------------------------
+*  Description:
+*    Resumes the threads stopped by registry_stop_world
+*  Parameters:
+*    self ---> The thread that requested the collection */
+void registry_start_world(gc_thread_t self);
+
+/* ---------------------------------------------------------------------
+*  registry_flush_caches
+*  ---------------------------------------------------------------------
+*  Description:
+*    Returns the cached blocks of all the threads to the heap. The caches
+*    are roots, so a collection would otherwise mark the blocks that the
+*    threads didn't use yet. The lock must be held and the other threads
+*    must be stopped */
+void registry_flush_caches();
+
+#endif
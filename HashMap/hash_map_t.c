@@ -1,45 +1,67 @@
 #include <stdio.h>
 #include <stdlib.h>
-#include <assert.h>
+#include <stdint.h>
+#include <string.h>
 #include "../Misc/GC_definitions.h"
+#include "../Misc/GC_atomic.h"
 #include "hash_map_t.h"
 
 /* =========== Local constants ===========*/
 
-#define CAPACITY_THRESHOLD 74
-#define SENTINEL (void*)-1
-#define FIRST_PRIME 257
-#define VALID_THRESHOLD 1
+#define CAPACITY_THRESHOLD 50
+#define FIRST_CAPACITY 256
+#define NOT_FOUND ((size_t)-1)
+
+// The highest bit of the size field is used to store the mark of each entry,
+// an entry is valid when its bit matches the current colour of the hash map
+#define VALID_FLAG ((size_t)1 << (sizeof(size_t) * 8 - 1))
+#define SIZE_MASK (~VALID_FLAG)
+
+// 2^N divided by the golden ratio, used by the Fibonacci hashing
+#if UINTPTR_MAX > 0xFFFFFFFFu
+#define FIBONACCI_MULTIPLIER ((uintptr_t)11400714819323198485ull)
+#else
+#define FIBONACCI_MULTIPLIER ((uintptr_t)2654435769u)
+#endif
 
 /* =========== Types used in the file ===========*/
 
-// Struct that holds the allocated memory block address, its size and a flag
+// Struct that holds the allocated memory block address, its size and the mark bit
 struct pointer_entry_s
 {
 	void* pointer;
-	size_t size;
-	bool_t valid;
+	size_t info;
 };
 
 // The type used in the hash map functions
-typedef pointer_entry_s* pointer_entry_t;
+typedef struct pointer_entry_s pointer_entry_t;
 
 /* ---------------------------------------------------------------------
 *  hash_map_s
 *  ---------------------------------------------------------------------
 *  Description:
-*    The struct that contains all the info for a given hash map instance
+*    The struct that contains all the info for a given hash map instance.
+*    The entries are stored inline and use linear probing, so that a
+*    lookup usually touches a single cache line
 *  Fields:
-*    map ---> The hash map of pointer_entry_t, holds all the used references 
-*    current_max_size ---> The size of the hash map
+*    map ---> The array of pointer_entry_t, empty entries have a NULL pointer
+*    mask ---> The size of the hash map minus one, the size is a power of two
+*    shift ---> The number of bits to drop from the result of the multiplication
 *    current_size ---> The actual number of items in the hash map
-*    prime_for_hash ---> Prime number used to perform the hashing operations */
+*    lower_bound ---> The lowest key ever inserted into the hash map
+*    upper_bound ---> The highest address covered by a block in the hash map
+*    valid_colour ---> The value of the mark bit of the valid entries
+*    rehashes ---> The number of times the array was resized */
 struct hash_map_s
 {
 	pointer_entry_t* map;
-	int current_max_size;
-	int current_size;
-	int prime_for_hash;
+	size_t mask;
+	unsigned int shift;
+	size_t current_size;
+	char* lower_bound;
+	char* upper_bound;
+	size_t valid_colour;
+	size_t rehashes;
 };
 
 /* ============================================================================
@@ -47,156 +69,150 @@ struct hash_map_s
 *  ========================================================================= */
 
 /* ---------------------------------------------------------------------
-*  custom_hash_map_init
+*  allocate_entries
 *  ---------------------------------------------------------------------
 *  Description:
-*    Creates a new hash map with the desired size
+*    Allocates an empty array of entries and updates the size fields
+*    of the hash map. Returns FALSE if the allocation fails
 *  Parameters:
-*    size ---> The maximum value for the size of the new hash map */
-static hash_map_t custom_hash_map_init(size_t size)
+*    hm ---> The hash map that will use the new array
+*    size ---> The number of entries, it must be a power of two */
+static bool_t allocate_entries(hash_map_t hm, size_t size)
 {
-	// Allocate the struct and the array used as the hash map
-	hash_map_t to_return = (hash_map_t)malloc(sizeof(struct hash_map_s));
-	to_return->map = (pointer_entry_t*)malloc(size * sizeof(pointer_entry_t));
-
-	// Initialize all the array items to NULL
-	int i;
-	for (i = 0; i < size; ++i)
-	{
-		to_return->map[i] = NULL;
-	}
-
-	// Set the default hash map parameters
-	to_return->current_max_size = size;
-	to_return->current_size = 0;
-
-	// Calculate the new prime number to use in the hash map
-	if (is_prime(size)) to_return->prime_for_hash = size;
-	else
-	{
-		to_return->prime_for_hash = biggest_previous_prime(size);
-	}
-	return to_return;
+	pointer_entry_t* map = (pointer_entry_t*)calloc(size, sizeof(pointer_entry_t));
+	if (map == NULL) return FALSE;
+	hm->map = map;
+	hm->mask = size - 1;
+	hm->shift = (unsigned int)(sizeof(uintptr_t) * 8 - log2_floor(size));
+	return TRUE;
 }
 
 // Creates and returns an empty hash map
 hash_map_t hash_map_init()
 {
-	return custom_hash_map_init(FIRST_PRIME);
+	hash_map_t to_return = (hash_map_t)malloc(sizeof(struct hash_map_s));
+	if (to_return == NULL) return NULL;
+	if (!allocate_entries(to_return, FIRST_CAPACITY))
+	{
+		free(to_return);
+		return NULL;
+	}
+	to_return->current_size = 0;
+	to_return->lower_bound = (char*)UINTPTR_MAX;
+	to_return->upper_bound = NULL;
+	to_return->valid_colour = 0;
+	to_return->rehashes = 0;
+	return to_return;
 }
 
 /* ============================================================================
 *  Hash functions
 *  ========================================================================= */
 
-// Private functions prototypes
-static int find_position(hash_map_t hm, void* k);
-static bool_t insert_entry(hash_map_t hm, pointer_entry_t pe)
-
 /* ---------------------------------------------------------------------
-*  rehash
+*  hash_function
 *  ---------------------------------------------------------------------
 *  Description:
-*    Creates a new hash map than can contain twice as many items as the
-*    previous one, moves the content of the first map into the second
-*    one and then deallocates the first hash map
+*    Fibonacci hashing: multiplies the address by 2^N / phi and keeps
+*    the highest bits, which depend on all the bits of the address
 *  Parameters:
-*    hm ---> The hash map to destroy */
-static void rehash(hash_map_t hm)
+*    hm ---> The hash map in use
+*    k ---> The value to hash */
+static inline size_t hash_function(hash_map_t hm, void* k)
 {
-	int size = hm->current_max_size;
-	hash_map_t hm_new = custom_hash_map_init(2 * size);
-	int i;
-	for (i = 0; i < size; ++i)
-	{
-		if (hm->map[i] != NULL && hm->map[i] != SENTINEL) insert_entry(hm_new, hm->map[i]);
-	}
-	free(hm->map);
-	free(hm);
-	hm = custom_hash_map_init(hm_new->current_max_size);
-	for (i = 0; i < hm->current_max_size; ++i)
-	{
-		if (hm_new->map[i] != NULL && hm->map[i] != SENTINEL) insert_entry(hm, hm_new->map[i]);
-	}
-	free(hm_new->map);
-	free(hm_new);
+	return (size_t)(((uintptr_t)k * FIBONACCI_MULTIPLIER) >> hm->shift);
 }
 
 /* ---------------------------------------------------------------------
-*  hash_function_1
+*  place_entry
 *  ---------------------------------------------------------------------
 *  Description:
-*    Main hash function with Horner's method
+*    Stores an entry into the first free slot of its probe sequence,
+*    without checking the load factor of the hash map
 *  Parameters:
-*    k ---> The value to hash
-*    n ---> Upper bound for the hash result */
-static int hash_function_1(int* k, int n)
+*    hm ---> The hash map in use
+*    pointer ---> The key of the new entry
+*    info ---> The size of the block and its flags */
+static void place_entry(hash_map_t hm, void* pointer, size_t info)
 {
-	const int a = 33;
-	int len;
-	int* digits = extract_digits_array((int)k, &len);
-	int sum = digits[len - 1], i;
-	for (i = len - 2; >= 0; i--)
+	size_t i = hash_function(hm, pointer);
+	while (hm->map[i].pointer != NULL)
 	{
-		sum *= a;
-		sum += digits[i];
+		i = (i + 1) & hm->mask;
 	}
-	return abs(sum % n);
+	hm->map[i].pointer = pointer;
+	hm->map[i].info = info;
 }
 
 /* ---------------------------------------------------------------------
-*  hash_function_2
+*  rehash
 *  ---------------------------------------------------------------------
 *  Description:
-*    Secondary hash function, used whenever a collision occurs
+*    Moves the content of the hash map into a new array that can
+*    contain twice as many items as the previous one
 *  Parameters:
-*    k ---> The value to hash */
-static int hash_function_2(int* k)
+*    hm ---> The hash map to resize */
+static bool_t rehash(hash_map_t hm)
 {
-	int q = 17;
-	return q - ((int)k % q);
+	pointer_entry_t* old_map = hm->map;
+	size_t old_size = hm->mask + 1, i;
+	if (!allocate_entries(hm, old_size * 2)) return FALSE;
+	for (i = 0; i < old_size; ++i)
+	{
+		if (old_map[i].pointer != NULL) place_entry(hm, old_map[i].pointer, old_map[i].info);
+	}
+	free(old_map);
+	hm->rehashes++;
+	return TRUE;
 }
 
 /* ============================================================================
 *  Internal hash map functions
 *  ========================================================================= */
 
-static int find_position(hash_map_t hm, void* k)
+// Returns the index of the given key, or NOT_FOUND
+static size_t find_position(hash_map_t hm, void* k)
 {
-	int max_size = hm->current_max_size;
-	int i = hash_function_1((int*)k, hm->prime_for_hash);
-	if (hm->map[i] != SENTINEL && hm->map[i] != NULL && hm->map[i]->pointer == k) return i;
-	else if (hm->map[i] == NULL) return -1;
-	int j;
-	int hf2 = hash_function_2((int*)k);
-	for (j = 0; j < max_size; ++j)
+	if ((char*)k < hm->lower_bound || (char*)k >= hm->upper_bound) return NOT_FOUND;
+	size_t i = hash_function(hm, k);
+	for (;;)
 	{
-		int p = (i + j * hf2) % hm->prime_for_hash;
-		if (hm->map[p] != SENTINEL && hm->map[p] != NULL && hm->map[p]->pointer == k) return i;
-		else if (hm->map[p] == NULL) return -1;
+		void* temp = hm->map[i].pointer;
+		if (temp == k) return i;
+		if (temp == NULL) return NOT_FOUND;
+		i = (i + 1) & hm->mask;
 	}
-	return -1;
 }
 
-static bool_t insert_entry(hash_map_t hm, pointer_entry_t pe)
+/* ---------------------------------------------------------------------
+*  delete_at
+*  ---------------------------------------------------------------------
+*  Description:
+*    Removes the entry in the given slot and shifts back the following
+*    entries of the same cluster, so that no tombstones are needed
+*  Parameters:
+*    hm ---> The hash map in use
+*    i ---> The index of the entry to remove */
+static void delete_at(hash_map_t hm, size_t i)
 {
-	void* key = pe->pointer;
-	size_t size = pe->size;
-	bool_t success = insert_key(hm, key, size);
-	if (success)
+	size_t j = i;
+	for (;;)
 	{
-		int i = find_position(hm, key);
-		hm->map[i]->valid = pe->valid;
-	}
-	return success;
-}
+		j = (j + 1) & hm->mask;
+		if (hm->map[j].pointer == NULL) break;
 
-static pointer_entry_t create_pointer_entry(void* pointer, size_t size)
-{
-	pointer_entry_t pointer_entry = (pointer_entry_t)malloc(sizeof(struct pointer_entry_s));
-	pointer_entry->pointer = pointer;
-	pointer_entry->size = size;
-	return pointer_entry;
+		// The entry can only move back if its home slot doesn't fall in (i, j]
+		size_t home = hash_function(hm, hm->map[j].pointer);
+		bool_t stays = i <= j ? (home > i && home <= j) : (home > i || home <= j);
+		if (!stays)
+		{
+			hm->map[i] = hm->map[j];
+			i = j;
+		}
+	}
+	hm->map[i].pointer = NULL;
+	hm->map[i].info = 0;
+	hm->current_size -= 1;
 }
 
 /* ============================================================================
@@ -206,132 +222,139 @@ static pointer_entry_t create_pointer_entry(void* pointer, size_t size)
 // Inserts a new key into the target hash map
 bool_t insert_key(hash_map_t hm, void* k, size_t size)
 {
-	int max_size = hm->current_max_size;
-	int i = hash_function_1((int*)k, hm->prime_for_hash);
-	if (hm->map[i] == NULL || hm->map[i] == SENTINEL)
-	{
-		hm->map[i] = create_pointer_entry(k, size);
-		hm->current_size += 1;
-		if (100 * hm->current_size / max_size) >= CAPACITY_THRESHOLD) rehash(hm);
-		return TRUE;
-	}
-	int j;
-	int hf2 = hash_function_2((int*)k);
-	for (j = 0; j < max_size; ++j)
-	{
-		int p = (i + j * hf2) % hm->prime_for_hash;
-		if (hm->map[p] == NULL || hm->map[p] == SENTINEL)
-		{
-			hm->map[p] = create_pointer_entry(k, size);
-			hm->current_size += 1;
-			if (100 * hm->current_size / max_size) >= CAPACITY_THRESHOLD) rehash(hm);
-			return TRUE;
-		}
-	}
-	return FALSE;
+	if (k == NULL) return FALSE;
+	if (100 * (hm->current_size + 1) >= CAPACITY_THRESHOLD * (hm->mask + 1) && !rehash(hm)) return FALSE;
+	// New entries must look invalid to the next collection
+	place_entry(hm, k, (size & SIZE_MASK) | hm->valid_colour);
+	hm->current_size += 1;
+
+	// Update the range of addresses covered by the hash map
+	if ((char*)k < hm->lower_bound) hm->lower_bound = (char*)k;
+	if ((char*)k + size > hm->upper_bound) hm->upper_bound = (char*)k + size;
+	return TRUE;
 }
 
 // Checks if the given key exists in the target hash map
 size_t find_key(hash_map_t hm, void* k)
 {
-	int max_size = hm->current_max_size;
-	int i = hash_function_1((int*)k, hm->prime_for_hash);
-	void* temp = hm->map[i]->pointer;
-	if (temp == k) return hm->map[i]->size;
-	else if (temp == NULL) return 0;
-	int j;
-	int hf2 = hash_function_2((int*)k);
-	for (j = 0; j < max_size; ++j)
-	{
-		int p = (i + j * hf2) % hm->prime_for_hash;
-		temp = hm->map[p]->pointer;
-		if (temp == k) return hm->map[p]->size;
-		else if (temp == NULL) return 0;
-	}
-	return 0;
+	size_t i = find_position(hm, k);
+	return i == NOT_FOUND ? 0 : hm->map[i].info & SIZE_MASK;
 }
 
 // Remove a given key from the hash map
 bool_t remove_key(hash_map_t hm, void* k)
 {
-	int i;
-	if ((i = find_position(hm, k)) == -1) return FALSE;
-	free(hm->map[i]->pointer);
-	free(hm->map[i]);
-	hm->map[i] = SENTINEL;
-	hm->current_size -= 1;
+	size_t i = find_position(hm, k);
+	if (i == NOT_FOUND) return FALSE;
+	delete_at(hm, i);
 	return TRUE;
 }
 
 // Removes the first key and inserts the new one
-bool_t replace_key(hash_map_t hm, void* old_key, void* new_key)
+bool_t replace_key(hash_map_t hm, void* old_key, void* new_key, size_t size)
+{
+	size_t i = find_position(hm, old_key);
+	if (i == NOT_FOUND) return FALSE;
+	delete_at(hm, i);
+	return insert_key(hm, new_key, size);
+}
+
+// Updates the size of a key without moving its entry
+bool_t update_key(hash_map_t hm, void* k, size_t size)
 {
-	if (!remove_key(hm, old_key)) return FALSE;
-	return insert_key(hm, new_key);
+	size_t i = find_position(hm, k);
+	if (i == NOT_FOUND) return FALSE;
+	hm->map[i].info = (hm->map[i].info & VALID_FLAG) | (size & SIZE_MASK);
+	if ((char*)k + size > hm->upper_bound) hm->upper_bound = (char*)k + size;
+	return TRUE;
 }
 
 // Deallocates the target hash map
-void hash_map_free(hash_map_t hm)
+void hash_map_free(hash_map_t hm, block_deallocator_t deallocator)
 {
-	int max_size = hm->current_max_size;
-	int i;
-	for (i = 0; i < max_size; ++i)
+	size_t i;
+	for (i = 0; i <= hm->mask; ++i)
 	{
-		if (hm->map[i] != NULL && hm->map[i] != SENTINEL)
-		{
-			free(hm->map[i]->pointer);
-			free(hm->map[i]);
-		}
+		if (hm->map[i].pointer != NULL) deallocator(hm->map[i].pointer, hm->map[i].info & SIZE_MASK);
 	}
 	free(hm->map);
 	free(hm);
 }
 
+// Empties the hash map
+void hash_map_clear(hash_map_t hm)
+{
+	memset(hm->map, 0, (hm->mask + 1) * sizeof(pointer_entry_t));
+	hm->current_size = 0;
+	hm->lower_bound = (char*)UINTPTR_MAX;
+	hm->upper_bound = NULL;
+}
+
+// Returns the size, the capacity and the number of rehashes of the hash map
+void hash_map_get_stats(hash_map_t hm, size_t* count, size_t* capacity, size_t* rehashes)
+{
+	*count = hm->current_size;
+	*capacity = hm->mask + 1;
+	*rehashes = hm->rehashes;
+}
+
 /* ============================================================================
 *  GC utility functions
 *  ========================================================================= */
 
-// Sets the "valid" parameter of all the items into the hash map to FALSE
+// Flips the colour of the hash map, so that all the items become invalid
 void mark_pointers_as_invalid(hash_map_t hm)
 {
-	int i;
-	pointer_entry_t* map = hm->map;
-	for (i = 0; i < hm->current_max_size; i++)
-	{
-		if (map[i] != NULL && map[i] != SENTINEL)
-		{
-			map[i]->valid = FALSE;
-		}
-	}
+	hm->valid_colour ^= VALID_FLAG;
 }
 
 // Mark the given key as valid if it is present inside the hash map
-void mark_as_valid_if_present(hash_map_t hm, void* pointer)
+size_t mark_as_valid_if_present(hash_map_t hm, void* pointer)
 {
-	int i = find_position(hm, pointer);
-	if (i == -1) return;
-	hm->map[i]->valid = TRUE;
+	size_t i = find_position(hm, pointer);
+	if (i == NOT_FOUND) return 0;
+	size_t info = ATOMIC_LOAD(&hm->map[i].info);
+	if ((info & VALID_FLAG) == hm->valid_colour) return 0;
+
+	// Other marking threads may look for the same key, only the one that flips the flag gets the size
+	info = hm->valid_colour
+		? ATOMIC_FETCH_OR(&hm->map[i].info, VALID_FLAG)
+		: ATOMIC_FETCH_AND(&hm->map[i].info, SIZE_MASK);
+	if ((info & VALID_FLAG) == hm->valid_colour) return 0;
+	return info & SIZE_MASK;
 }
 
-// Deallocates and removes all the invalid items inside the hash map
-void deallocate_lost_references(hash_map_t hm)
+// Visits all the valid items inside the hash map
+void visit_valid_entries(hash_map_t hm, block_visitor_t visitor)
 {
-	int i;
-	pointer_entry_t* map = hm->map;
-	for (i = 0; i < hm->current_max_sizel; i++)
+	size_t i;
+	for (i = 0; i <= hm->mask; ++i)
 	{
-		if (map[i] != NULL && map[i] != SENTINEL)
+		if (hm->map[i].pointer != NULL && (hm->map[i].info & VALID_FLAG) == hm->valid_colour)
 		{
-			if (!map[i]->valid)
-			{
-				remove_key(hm, map[i]->pointer);
-			}
+			visitor(hm->map[i].pointer, hm->map[i].info & SIZE_MASK);
 		}
 	}
 }
 
-int main()
+// Deallocates and removes all the invalid items inside the hash map
+void deallocate_lost_references(hash_map_t hm, block_deallocator_t deallocator)
 {
-	
-	return 0;
-}
\ No newline at end of file
+	// Start right after an empty slot, so that no cluster is shifted across the starting point
+	pointer_entry_t* map = hm->map;
+	size_t start = 0, visited = 0;
+	while (map[start].pointer != NULL) start++;
+	size_t i = (start + 1) & hm->mask;
+	while (visited <= hm->mask)
+	{
+		if (map[i].pointer != NULL && (map[i].info & VALID_FLAG) != hm->valid_colour)
+		{
+			// The slot is filled again by the following entries, so check it once more
+			deallocator(map[i].pointer, map[i].info & SIZE_MASK);
+			delete_at(hm, i);
+			continue;
+		}
+		i = (i + 1) & hm->mask;
+		visited++;
+	}
+}
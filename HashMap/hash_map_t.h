@@ -1,9 +1,15 @@
 #ifndef HASH_H
 #define HASH_H
 
+#include <stddef.h>
+#include "../Misc/GC_definitions.h"
+
 // The hash map used by the GC
 typedef struct hash_map_s* hash_map_t;
 
+// The function used to deallocate the blocks removed from the hash map
+typedef void (*block_deallocator_t)(void* pointer, size_t size);
+
 /* ============================================================================
 *  Generic hash map functions
 *  ========================================================================= */
@@ -32,18 +38,19 @@ bool_t insert_key(hash_map_t hm, void* key, size_t size);
 *  ---------------------------------------------------------------------
 *  Description:
 *    Checks if a given address is present into the hash map.
-*    It returns TRUE if present, FALSE otherwise
+*    It returns the size of the block if present, 0 otherwise
 *  Parameters:
 *    hm ---> The hash map currently in use
 *    key ---> The pointer to find inside the hash map */
-bool_t find_key(hash_map_t hm, void* key);
+size_t find_key(hash_map_t hm, void* key);
 
 /* ---------------------------------------------------------------------
 *  remove_key
 *  ---------------------------------------------------------------------
 *  Description:
-*    Removes a given address from the hash map. Returns TRUE if the
-*    operation succedes, FALSE if the key isn't found inside the hash map
+*    Removes a given address from the hash map, the memory block it
+*    references is left untouched. Returns TRUE if the operation
+*    succedes, FALSE if the key isn't found inside the hash map
 *  Parameters:
 *    hm ---> The hash map currently in use
 *    key ---> The pointer to find and remove from the hash map */
@@ -54,14 +61,29 @@ bool_t remove_key(hash_map_t hm, void* key);
 *  ---------------------------------------------------------------------
 *  Description:
 *    Removes a given address from the hash map and replaces it with
-*    another one. Returns TRUE if the operation succedes (if the first
-*    key is found inside the hash map and removed correctly), 
+*    another one, without deallocating the previous memory block.
+*    Returns TRUE if the operation succedes (if the first key is found
+*    inside the hash map and removed correctly), 
 *    FALSE if the key isn't found inside the hash map
 *  Parameters:
 *    hm ---> The hash map currently in use
 *    old_key ---> The pointer to find and remove from the hash map
-*    new_key ---> The new value to insert into the hash map */
-bool_t replace_key(hash_map_t hm, void* old_key, void* new_key);
+*    new_key ---> The new value to insert into the hash map
+*    size ---> The size of the allocated area referenced by new_key */
+bool_t replace_key(hash_map_t hm, void* old_key, void* new_key, size_t size);
+
+/* ---------------------------------------------------------------------
+*  update_key
+*  ---------------------------------------------------------------------
+*  Description:
+*    Changes the size stored for a given address, the entry keeps its
+*    slot and its mark. Returns TRUE if the key is found inside the
+*    hash map, FALSE otherwise
+*  Parameters:
+*    hm ---> The hash map currently in use
+*    key ---> The pointer whose block was resized in place
+*    size ---> The new size of the allocated area referenced by key */
+bool_t update_key(hash_map_t hm, void* key, size_t size);
 
 /* ---------------------------------------------------------------------
 *  hash_map_free
@@ -71,8 +93,31 @@ bool_t replace_key(hash_map_t hm, void* old_key, void* new_key);
 *    inside the hash map (so all the memory areas that were previously
 *    allocated through the GC), then deallocates the hash map itself
 *  Parameters:
-*    hm ---> The hash map to deallocate */
-void hash_map_free(hash_map_t hm);
+*    hm ---> The hash map to deallocate
+*    deallocator ---> The function that releases each memory area */
+void hash_map_free(hash_map_t hm, block_deallocator_t deallocator);
+
+/* ---------------------------------------------------------------------
+*  hash_map_clear
+*  ---------------------------------------------------------------------
+*  Description:
+*    Removes all the keys from the hash map, without deallocating the
+*    memory areas they reference. The array of the entries is kept
+*  Parameters:
+*    hm ---> The hash map to empty */
+void hash_map_clear(hash_map_t hm);
+
+/* ---------------------------------------------------------------------
+*  hash_map_get_stats
+*  ---------------------------------------------------------------------
+*  Description:
+*    Reads the occupancy of the hash map
+*  Parameters:
+*    hm ---> The hash map in use
+*    count ---> Set to the number of items in the hash map
+*    capacity ---> Set to the number of slots of the hash map
+*    rehashes ---> Set to the number of times the slots were reallocated */
+void hash_map_get_stats(hash_map_t hm, size_t* count, size_t* capacity, size_t* rehashes);
 
 /* ============================================================================
 *  GC utility functions
@@ -83,7 +128,8 @@ void hash_map_free(hash_map_t hm);
 *  ---------------------------------------------------------------------
 *  Description:
 *    Marks all the references in the hash map as invalid. This function
-*    is used by the GC before starting the collect operation
+*    is used by the GC before starting the collect operation, it runs
+*    in constant time as it only flips the meaning of the mark bits
 *  Parameters:
 *    hm ---> The hash map in use */
 void mark_pointers_as_invalid(hash_map_t hm);
@@ -93,11 +139,24 @@ void mark_pointers_as_invalid(hash_map_t hm);
 *  ---------------------------------------------------------------------
 *  Description:
 *    Checks if a given pointer is present, and marks it as valid if 
-*    it is found inside the hash map
+*    it is found inside the hash map. Returns the size of the block if
+*    it has just been marked, 0 if it was already valid or not found.
+*    Several threads can mark the entries of the hash map at once
 *  Parameters:
 *    hm ---> The hash map in use
 *    pointer ---> The pointer to look for inside the hash map */
-void mark_as_valid_if_present(hash_map_t hm, void* pointer);
+size_t mark_as_valid_if_present(hash_map_t hm, void* pointer);
+
+/* ---------------------------------------------------------------------
+*  visit_valid_entries
+*  ---------------------------------------------------------------------
+*  Description:
+*    Invokes the visitor on every block marked as valid. The visitor
+*    can mark more entries, but it must not insert or remove any
+*  Parameters:
+*    hm ---> The hash map in use
+*    visitor ---> The function to call with each valid block */
+void visit_valid_entries(hash_map_t hm, block_visitor_t visitor);
 
 /* ---------------------------------------------------------------------
 *  deallocate_lost_references
@@ -106,7 +165,8 @@ void mark_as_valid_if_present(hash_map_t hm, void* pointer);
 *    Deallocates all the memory areas that are referenced by pointers
 *    inside the hash map that are marked as invalid
 *  Parameters:
-*    hm ---> The hash map in use */
-void deallocate_lost_references(hash_map_t hm);
+*    hm ---> The hash map in use
+*    deallocator ---> The function that releases each memory area */
+void deallocate_lost_references(hash_map_t hm, block_deallocator_t deallocator);
 
 #endif
\ No newline at end of file
@@ -0,0 +1,69 @@
+#ifndef GC_ATOMIC
+#define GC_ATOMIC
+
+#include <stdint.h>
+
+// Atomic operations on word sized integers, the loads acquire and the stores release.
+// The read-modify-write operations return the previous value
+#if defined(__GNUC__) || defined(__clang__)
+#define ATOMIC_LOAD(pointer) __atomic_load_n(pointer, __ATOMIC_ACQUIRE)
+#define ATOMIC_STORE(pointer, value) __atomic_store_n(pointer, value, __ATOMIC_RELEASE)
+#define ATOMIC_CAS(pointer, expected, desired) __sync_bool_compare_and_swap(pointer, expected, desired)
+#define ATOMIC_FETCH_ADD(pointer, value) __atomic_fetch_add(pointer, value, __ATOMIC_ACQ_REL)
+#define ATOMIC_FETCH_OR(pointer, value) __atomic_fetch_or(pointer, value, __ATOMIC_ACQ_REL)
+#define ATOMIC_FETCH_AND(pointer, value) __atomic_fetch_and(pointer, value, __ATOMIC_ACQ_REL)
+#define ATOMIC_FENCE() __atomic_thread_fence(__ATOMIC_SEQ_CST)
+#if defined(__x86_64__) || defined(__i386__)
+#define CPU_RELAX() __builtin_ia32_pause()
+#else
+#define CPU_RELAX() __asm__ __volatile__("" ::: "memory")
+#endif
+#elif defined _MSC_VER
+#include <windows.h>
+#if defined _WIN64
+#define ATOMIC_WORD volatile LONG64*
+#define ATOMIC_CAS(pointer, expected, desired) \
+	(InterlockedCompareExchange64((ATOMIC_WORD)(pointer), (LONG64)(desired), (LONG64)(expected)) == (LONG64)(expected))
+#define ATOMIC_FETCH_ADD(pointer, value) ((uintptr_t)InterlockedExchangeAdd64((ATOMIC_WORD)(pointer), (LONG64)(value)))
+#define ATOMIC_FETCH_OR(pointer, value) ((uintptr_t)InterlockedOr64((ATOMIC_WORD)(pointer), (LONG64)(value)))
+#define ATOMIC_FETCH_AND(pointer, value) ((uintptr_t)InterlockedAnd64((ATOMIC_WORD)(pointer), (LONG64)(value)))
+#else
+#define ATOMIC_WORD volatile LONG*
+#define ATOMIC_CAS(pointer, expected, desired) \
+	(InterlockedCompareExchange((ATOMIC_WORD)(pointer), (LONG)(desired), (LONG)(expected)) == (LONG)(expected))
+#define ATOMIC_FETCH_ADD(pointer, value) ((uintptr_t)InterlockedExchangeAdd((ATOMIC_WORD)(pointer), (LONG)(value)))
+#define ATOMIC_FETCH_OR(pointer, value) ((uintptr_t)InterlockedOr((ATOMIC_WORD)(pointer), (LONG)(value)))
+#define ATOMIC_FETCH_AND(pointer, value) ((uintptr_t)InterlockedAnd((ATOMIC_WORD)(pointer), (LONG)(value)))
+#endif
+#define ATOMIC_LOAD(pointer) (MemoryBarrier(), *(volatile uintptr_t*)(pointer))
+#define ATOMIC_STORE(pointer, value) (MemoryBarrier(), *(pointer) = (value))
+#define ATOMIC_FENCE() MemoryBarrier()
+#define CPU_RELAX() YieldProcessor()
+#else
+
+// Without a known compiler the GC only runs a single thread
+#define ATOMIC_LOAD(pointer) (*(pointer))
+#define ATOMIC_STORE(pointer, value) (*(pointer) = (value))
+#define ATOMIC_CAS(pointer, expected, desired) (*(pointer) == (expected) ? (*(pointer) = (desired), 1) : 0)
+#define ATOMIC_FETCH_ADD(pointer, value) ((*(pointer) += (value)) - (value))
+#define ATOMIC_FETCH_OR(pointer, value) gc_fetch_or((uintptr_t*)(pointer), (uintptr_t)(value))
+#define ATOMIC_FETCH_AND(pointer, value) gc_fetch_and((uintptr_t*)(pointer), (uintptr_t)(value))
+#define ATOMIC_FENCE()
+#define CPU_RELAX()
+
+static inline uintptr_t gc_fetch_or(uintptr_t* pointer, uintptr_t value)
+{
+	uintptr_t previous = *pointer;
+	*pointer = previous | value;
+	return previous;
+}
+
+static inline uintptr_t gc_fetch_and(uintptr_t* pointer, uintptr_t value)
+{
+	uintptr_t previous = *pointer;
+	*pointer = previous & value;
+	return previous;
+}
+#endif
+
+#endif
@@ -4,16 +4,31 @@
 // General libraries
 #include <stdio.h>
 #include <stdlib.h>
-#include "Math/GC_math.h"
 
 // Displays an error message and terminates the process
 #define ERROR_HELPER(error)    \
 fprintf(stderr, "%s", error);  \
 exit(EXIT_FAILURE);            \
 
+// Hints the CPU to load the cache line of an address that will be read soon
+#if defined(__GNUC__) || defined(__clang__)
+#define PREFETCH(address) __builtin_prefetch(address)
+#elif defined _MSC_VER
+#include <xmmintrin.h>
+#define PREFETCH(address) _mm_prefetch((const char*)(address), _MM_HINT_T0)
+#else
+#define PREFETCH(address)
+#endif
+
 // An unnamed enum used to replicate the C++ bool type
 #ifndef BOOL
 typedef enum { FALSE, TRUE } bool_t;
 #endif
 
+// The function invoked for each block when iterating over the GC memory
+typedef void (*block_visitor_t)(void* pointer, size_t size);
+
+// Math helpers, they need the bool_t type
+#include "Math/GC_math.h"
+
 #endif
@@ -0,0 +1,66 @@
+#ifndef GC_THREADS
+#define GC_THREADS
+
+// On Unix-like OSes, switch to a multithread GC
+#if !defined(_WIN32) && (defined(__unix__) || defined(__unix) || (defined(__APPLE__) && defined(__MACH__)))
+#include <pthread.h>
+#include <sched.h>
+#include <time.h>
+#include <unistd.h>
+#define POSIX_THREADS
+#define THREAD_YIELD() sched_yield()
+#elif defined _WIN32
+#include <windows.h>
+#define WIN_THREADS
+#define THREAD_YIELD() SwitchToThread()
+#else
+#define THREAD_YIELD()
+#endif
+
+// Storage class of the variables that have a copy for each thread
+#if defined _MSC_VER
+#define THREAD_LOCAL __declspec(thread)
+#else
+#define THREAD_LOCAL __thread
+#endif
+
+// Mutexes and condition variables used to park the GC threads between two cycles.
+// The init macros evaluate to a non zero value on success
+#if defined POSIX_THREADS
+typedef pthread_mutex_t gc_mutex_t;
+typedef pthread_cond_t gc_cond_t;
+#define MUTEX_INIT(mutex) (pthread_mutex_init(&(mutex), NULL) == 0)
+#define MUTEX_LOCK(mutex) pthread_mutex_lock(&(mutex))
+#define MUTEX_UNLOCK(mutex) pthread_mutex_unlock(&(mutex))
+#define COND_INIT(cond) (pthread_cond_init(&(cond), NULL) == 0)
+#define COND_WAIT(cond, mutex) pthread_cond_wait(&(cond), &(mutex))
+#define COND_TIMED_WAIT(cond, mutex, milliseconds) cond_timed_wait(&(cond), &(mutex), milliseconds)
+#define COND_BROADCAST(cond) pthread_cond_broadcast(&(cond))
+
+// Waits on a condition variable for at most the given time, the caller checks its condition again
+static inline void cond_timed_wait(pthread_cond_t* cond, pthread_mutex_t* mutex, unsigned long milliseconds)
+{
+	struct timespec deadline;
+	clock_gettime(CLOCK_REALTIME, &deadline);
+	deadline.tv_sec += milliseconds / 1000;
+	deadline.tv_nsec += (long)(milliseconds % 1000) * 1000000;
+	if (deadline.tv_nsec >= 1000000000)
+	{
+		deadline.tv_sec++;
+		deadline.tv_nsec -= 1000000000;
+	}
+	pthread_cond_timedwait(cond, mutex, &deadline);
+}
+#elif defined WIN_THREADS
+typedef CRITICAL_SECTION gc_mutex_t;
+typedef CONDITION_VARIABLE gc_cond_t;
+#define MUTEX_INIT(mutex) (InitializeCriticalSection(&(mutex)), 1)
+#define MUTEX_LOCK(mutex) EnterCriticalSection(&(mutex))
+#define MUTEX_UNLOCK(mutex) LeaveCriticalSection(&(mutex))
+#define COND_INIT(cond) (InitializeConditionVariable(&(cond)), 1)
+#define COND_WAIT(cond, mutex) SleepConditionVariableCS(&(cond), &(mutex), INFINITE)
+#define COND_TIMED_WAIT(cond, mutex, milliseconds) SleepConditionVariableCS(&(cond), &(mutex), (DWORD)(milliseconds))
+#define COND_BROADCAST(cond) WakeAllConditionVariable(&(cond))
+#endif
+
+#endif
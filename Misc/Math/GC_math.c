@@ -5,7 +5,7 @@
 *  ========================================================================= */
 
 // Returns the absolute value of an integer
-static inline int abs(int value)
+static inline int int_abs(int value)
 {
 	return value >= 0 ? value : -value;
 }
@@ -21,9 +21,8 @@ static inline int isqrt_next_iteration(int xk, int n)
 int isqrt(int value)
 {
 	int xk = 1, xknext = isqrt_next_iteration(xk, value);
-	while (abs(xknext - xk) >= 1)
+	while (int_abs(xknext - xk) >= 1)
 	{
-		int temp = xk;
 		xk = xknext;
 		xknext = isqrt_next_iteration(xk, value);
 	}
@@ -31,81 +30,53 @@ int isqrt(int value)
 }
 
 /* ============================================================================
-*  Prime numbers
+*  Base 2 logarithm
 *  ========================================================================= */
 
-// Checks if the given number is prime
-bool_t is_prime(int number) 
+// Returns the position of the highest set bit
+unsigned int log2_floor(size_t number)
 {
-	// 0 and 1 are not prime numbers
-    if (number <= 1) return FALSE;
-
-	// Iterate through from 0 to the integer root of the number
-    int i;
-    for (i=2; i <= isqrt(number); i++) 
-    {
-        if (number % i == 0) return FALSE;
-    }
-    return TRUE;
-}
-
-// Returns the biggest prime number lower or equal than the passed parameter
-int biggest_previous_prime(int number)
-{
-	if (is_prime(number)) return number;
-	bool_t x[number];
-	x[1] = FALSE;
-	int i;
-	for (i = 2; i < number; ++i) x[i] = TRUE;
-	for (i = 2; i <= isqrt(number); ++i)
-	{
-		if (x[i])
-		{
-			int j, k = 0;
-			for (j = i * i; j < number; j += k * i)
-			{
-				x[j] = FALSE;
-				++k;
-				j = i * i;
-			}
-		}
-	}
-	int previous = 2;
-	for (i = 2; i < number; ++i)
-	{
-		if (x[i]) previous = i;
-	}
-	return previous;
+#if defined(__GNUC__) || defined(__clang__)
+	return (unsigned int)(sizeof(unsigned long long) * 8 - 1 - __builtin_clzll((unsigned long long)number));
+#else
+	unsigned int log = 0;
+	while (number >>= 1) log++;
+	return log;
+#endif
 }
 
 /* ============================================================================
-*  Horner hash function
+*  Bit operations
 *  ========================================================================= */
 
-// Returns the base 10 logarithm of a given integer number
-static int base10_log(int value)
+// Returns the index of the lowest set bit
+unsigned int count_trailing_zeros(uintptr_t word)
 {
-	if (value < 0) ERROR_HELPER("The log function can't accept a negative argument");
-	if (value == 0) ERROR_HELPER("The log of 0 doesn't exist");
-	int log = 0;
-	while (value)
+#if defined(__GNUC__) || defined(__clang__)
+	return (unsigned int)__builtin_ctzll((unsigned long long)word);
+#else
+	unsigned int count = 0;
+	while (!(word & 1))
 	{
-		log++;
-		value /= 10;
+		word >>= 1;
+		count++;
 	}
-	return log;
+	return count;
+#endif
 }
 
-// Extract the digits of a number and returns an array with all of them from left to right
-int* extract_digits_array(int number, int* size)
+// Counts the bits set to 1
+unsigned int count_set_bits(uintptr_t word)
 {
-	number = abs(number);
-	int digits = base10_log(number) + 1, i = digits - 1;
-	int* digits_array = (int*)malloc(sizeof(int) * digits);
-	while (number > 0)
+#if defined(__GNUC__) || defined(__clang__)
+	return (unsigned int)__builtin_popcountll((unsigned long long)word);
+#else
+	unsigned int count = 0;
+	while (word)
 	{
-		digits_array[i] = number % 10;
-		number /= 10;
+		word &= word - 1;
+		count++;
 	}
-	return digits_array;
-}
\ No newline at end of file
+	return count;
+#endif
+}
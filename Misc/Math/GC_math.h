@@ -1,7 +1,9 @@
 #ifndef GC_MATH
 #define GC_MATH
 
-#include "GC_definitions.h"
+#include <stddef.h>
+#include <stdint.h>
+#include "../GC_definitions.h"
 
 /* ---------------------------------------------------------------------
 *  isqrt
@@ -14,32 +16,31 @@
 int isqrt(int value);
 
 /* ---------------------------------------------------------------------
-*  is_prime
+*  log2_floor
 *  ---------------------------------------------------------------------
 *  Description:
-*    Checks if a given number is prime and returns TRUE, FALSE otherwise
+*    Returns the integer part of the base 2 logarithm of a number,
+*    which is the exponent when the number is a power of two
 *  Parameters:
-*    value ---> The number to check */
-bool_t is_prime(int number);
+*    number ---> The number to use, it must be greater than 0 */
+unsigned int log2_floor(size_t number);
 
 /* ---------------------------------------------------------------------
-*  biggest_previous_prime
+*  count_trailing_zeros
 *  ---------------------------------------------------------------------
 *  Description:
-*    Returns the biggest prime number that is lower or equal to number.
-*    It uses the sieve of Erathostenes to calculate the prime number
+*    Returns the index of the lowest set bit of a word
 *  Parameters:
-*    value ---> The maximum value of the prime number to return */
-int biggest_previous_prime(int number);
+*    word ---> The word to inspect, it must be different from 0 */
+unsigned int count_trailing_zeros(uintptr_t word);
 
 /* ---------------------------------------------------------------------
-*  extract_digits_array
+*  count_set_bits
 *  ---------------------------------------------------------------------
 *  Description:
-*    Extract the digits of a number and returns an array with all 
-*    of them from left to right
+*    Returns the number of bits set to 1 in a word
 *  Parameters:
-*    number ---> The number to split into single digits */
-int* extract_digits_array(int number, int* size);
+*    word ---> The word to inspect */
+unsigned int count_set_bits(uintptr_t word);
 
-#endif
\ No newline at end of file
+#endif
@@ -0,0 +1,126 @@
+#include <stddef.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include "../GC/GC.h"
+
+#if defined _WIN32
+#include <windows.h>
+#else
+#include <pthread.h>
+#endif
+
+// The compactions stop the registered threads while they move the blocks. A thread stopped
+// inside malloc may hold the lock of the libc allocator, so the collector must not use it then
+
+#define ROUNDS 12
+#define NODES 200000
+#define KEPT_EVERY 4
+
+typedef struct node_s
+{
+	struct node_s* next;
+	size_t value;
+} node_t;
+
+// Tells the worker thread to stop, and how many malloc and free pairs it did
+static volatile int stop_worker = 0;
+static volatile size_t worker_pairs = 0;
+
+// Keeps calling malloc and free with various sizes, while the other thread compacts the heap
+static void run_worker()
+{
+	GC_register_thread();
+	size_t seed = 12345, pairs = 0;
+	while (!stop_worker)
+	{
+		seed = seed * 6364136223846793005ull + 1442695040888963407ull;
+		char* buffer = (char*)malloc(16 + (seed >> 40) % 4096);
+		if (buffer == NULL) break;
+		buffer[0] = (char)pairs;
+		free(buffer);
+		pairs++;
+	}
+	worker_pairs = pairs;
+	GC_unregister_thread();
+}
+
+#if defined _WIN32
+static DWORD WINAPI worker_thread(LPVOID lparam)
+{
+	(void)lparam;
+	run_worker();
+	return 0;
+}
+#else
+static void* worker_thread(void* lparam)
+{
+	(void)lparam;
+	run_worker();
+	return NULL;
+}
+#endif
+
+int main()
+{
+	GC_init();
+	if (!GC_set_compaction(TRUE))
+	{
+		printf("The compaction can't be enabled\n");
+		return 1;
+	}
+#if defined _WIN32
+	HANDLE worker = CreateThread(NULL, 0, worker_thread, NULL, 0, NULL);
+	if (worker == NULL) return 1;
+#else
+	pthread_t worker;
+	if (pthread_create(&worker, NULL, worker_thread, NULL) != 0) return 1;
+#endif
+
+	// The typed nodes can move, as the collector knows where their pointers are. Only a
+	// quarter of them stays reachable, so their pages are sparse and get evacuated
+	size_t offsets[] = { offsetof(node_t, next) };
+	GC_descriptor_t descriptor = GC_make_descriptor(offsets, 1);
+	node_t* head = NULL;
+	int errors = 0, round;
+	for (round = 0; round < ROUNDS && errors == 0; round++)
+	{
+		size_t i;
+		head = NULL;
+		for (i = 0; i < NODES; i++)
+		{
+			node_t* node = (node_t*)GC_alloc_typed(sizeof(node_t), descriptor);
+			node->value = i;
+			if (i % KEPT_EVERY == 0)
+			{
+				node->next = head;
+				head = node;
+			}
+		}
+		GC_collect();
+
+		// The kept nodes survived the moves with their values
+		size_t expected = (NODES - 1) / KEPT_EVERY * KEPT_EVERY;
+		node_t* node;
+		for (node = head; node != NULL; node = node->next, expected -= KEPT_EVERY)
+		{
+			if (node->value != expected) errors++;
+			if (expected == 0) break;
+		}
+	}
+	stop_worker = 1;
+#if defined _WIN32
+	WaitForSingleObject(worker, INFINITE);
+#else
+	pthread_join(worker, NULL);
+#endif
+
+	struct GC_stats_s stats = GC_get_stats();
+	printf("moved %zu KB in %d rounds, the worker did %zu malloc and free pairs\n", stats.total_moved_bytes / 1024, round, (size_t)worker_pairs);
+	if (errors != 0 || stats.total_moved_bytes == 0)
+	{
+		printf("FAILED\n");
+		return 1;
+	}
+	printf("OK\n");
+	return 0;
+}
@@ -0,0 +1,96 @@
+#include <stdio.h>
+#include "../GC/GC.h"
+
+// The large blocks allocated, resized and released while a concurrent marking runs must not wait for
+// it: the new ones survive the cycle with the small blocks they reference, the released ones are gone
+
+#define ROUNDS 8
+#define LIVE_NODES 200000
+#define LARGE_BLOCKS 64
+#define LARGE_SIZE (256 * 1024)
+
+typedef struct node_s
+{
+	struct node_s* next;
+	size_t value;
+} node_t;
+
+// Checks the small block referenced by the first word of a large one
+static int check_block(void** block, size_t value)
+{
+	node_t* node = (node_t*)block[0];
+	return node != NULL && node->value == value ? 0 : 1;
+}
+
+int main()
+{
+	GC_init();
+	if (!GC_set_concurrent(TRUE))
+	{
+		printf("The concurrent collections can't be enabled\n");
+		return 1;
+	}
+
+	// A long list keeps the background marker busy
+	node_t* list = NULL;
+	size_t i;
+	for (i = 0; i < LIVE_NODES; i++)
+	{
+		node_t* node = (node_t*)GC_alloc(sizeof(node_t));
+		node->value = i;
+		GC_WRITE(&node->next, list);
+		list = node;
+	}
+
+	void*** table = (void***)GC_calloc(LARGE_BLOCKS, sizeof(void**));
+	int errors = 0, round;
+	for (round = 0; round < ROUNDS; round++)
+	{
+		// Starts a marking, the operations below run while it is in progress
+		GC_collect();
+		for (i = 0; i < LARGE_BLOCKS; i++)
+		{
+			void** block = (void**)GC_alloc(LARGE_SIZE);
+			node_t* node = (node_t*)GC_alloc(sizeof(node_t));
+			node->next = NULL;
+			node->value = round * LARGE_BLOCKS + i;
+			GC_WRITE(&block[0], node);
+
+			// Half of the previous blocks are released, the other half grow and move
+			void** previous = table[i];
+			if (previous != NULL && i % 2 == 0) GC_free(previous);
+			else if (previous != NULL)
+			{
+				previous = (void**)GC_realloc(previous, 2 * LARGE_SIZE);
+				if (previous == NULL || check_block(previous, (round - 1) * LARGE_BLOCKS + i) != 0) errors++;
+				GC_free(previous);
+			}
+			GC_WRITE(&table[i], block);
+		}
+
+		// Completes the marking, then sweeps with a second full cycle
+		GC_collect();
+		GC_collect();
+		GC_collect();
+		for (i = 0; i < LARGE_BLOCKS; i++)
+		{
+			errors += check_block(table[i], round * LARGE_BLOCKS + i);
+		}
+	}
+
+	// Only the blocks of the table and at most a few kept by stale stack words are left
+	GC_collect();
+	struct GC_stats_s stats = GC_get_stats();
+	for (i = 0; list != NULL; list = list->next, i++)
+	{
+		if (list->value != LIVE_NODES - 1 - i) errors++;
+	}
+	printf("large blocks: %zu, errors: %d\n", stats.large_blocks, errors);
+	if (errors != 0 || i != LIVE_NODES || stats.large_blocks < LARGE_BLOCKS || stats.large_blocks > 2 * LARGE_BLOCKS)
+	{
+		printf("FAILED\n");
+		return 1;
+	}
+	printf("OK\n");
+	return 0;
+}
@@ -0,0 +1,99 @@
+#include <stdio.h>
+#include "../GC/GC.h"
+
+// The minor collections must release the young blocks that are no longer reachable, even when
+// they were written after their allocation, while keeping the ones stored into the old blocks
+
+#define ROUNDS 24
+#define LIST_NODES 20000
+#define TABLE_SLOTS 256
+
+typedef struct node_s
+{
+	struct node_s* next;
+	size_t value;
+} node_t;
+
+// Builds a linked list of young blocks, each node is written after the allocation of the next one
+static node_t* build_list(size_t count)
+{
+	node_t* head = NULL;
+	size_t i;
+	for (i = 0; i < count; i++)
+	{
+		node_t* node = (node_t*)GC_alloc(sizeof(node_t));
+		node->value = i;
+		GC_WRITE(&node->next, head);
+		head = node;
+	}
+	return head;
+}
+
+// Allocates a list and drops it, the stack words it used are then overwritten so that no stale
+// pointer keeps it alive. The calls go through pointers, so that they aren't inlined
+static void make_garbage()
+{
+	volatile node_t* garbage = build_list(LIST_NODES);
+	garbage = NULL;
+	(void)garbage;
+}
+static void clear_stack()
+{
+	volatile char buffer[16384];
+	size_t i;
+	for (i = 0; i < sizeof(buffer); i++) buffer[i] = 0;
+}
+static void (*volatile make_garbage_call)() = make_garbage;
+static void (*volatile clear_stack_call)() = clear_stack;
+
+int main()
+{
+	GC_init();
+	GC_set_heap_growth(-1);
+	if (!GC_set_generational(TRUE))
+	{
+		printf("The generational collections can't be enabled\n");
+		return 1;
+	}
+
+	// An old table, its slots are replaced with young blocks that must survive the minor collections
+	node_t** table = (node_t**)GC_calloc(TABLE_SLOTS, sizeof(node_t*));
+	GC_collect();
+	size_t first_live = 0, last_live = 0, minor_freed = 0;
+	int round;
+	for (round = 0; round < ROUNDS; round++)
+	{
+		make_garbage_call();
+		clear_stack_call();
+		node_t* kept = (node_t*)GC_alloc(sizeof(node_t));
+		kept->next = NULL;
+		kept->value = (size_t)round;
+		GC_WRITE(&table[round % TABLE_SLOTS], kept);
+
+		size_t minor_before = GC_get_stats().minor_collections;
+		GC_collect();
+		struct GC_stats_s stats = GC_get_stats();
+		if (stats.minor_collections != minor_before) minor_freed += stats.last_freed_blocks;
+		if (round == 1) first_live = stats.live_bytes;
+		last_live = stats.live_bytes;
+	}
+
+	// The young blocks stored into the old table are still there
+	int errors = 0;
+	for (round = 0; round < ROUNDS; round++)
+	{
+		if (table[round]->value != (size_t)round) errors++;
+	}
+	printf("live after round 1: %zu KB, after round %d: %zu KB, blocks freed by the minor collections: %zu\n",
+		first_live / 1024, ROUNDS - 1, last_live / 1024, minor_freed);
+
+	// A few lists may stay reachable from stale stack slots, but the live memory can't grow with the rounds
+	size_t list_bytes = LIST_NODES * sizeof(node_t);
+	if (errors != 0 || last_live > first_live + 2 * list_bytes || minor_freed < (ROUNDS / 2) * LIST_NODES)
+	{
+		printf("FAILED\n");
+		return 1;
+	}
+	printf("OK\n");
+	return 0;
+}